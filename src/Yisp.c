@@ -31,8 +31,13 @@ sExpr* set(sExpr* symbol, sExpr* value){
     sExpr* val_it = values;
     while (!isnil(sym_it) && !isnil(val_it)) {
         if (sExpr_to_bool(eq(car(sym_it), symbol))) {
+            // Call sites that cached the old function have to look again,
+            // and functions it was inlined into have to be recompiled
+            int was_function = islambda(car(val_it)) || ismacro(car(val_it)) || type_of(car(val_it)) == TYPE_NATIVE;
+            if (was_function) global_epoch++;
             // update the corresponding value node
             val_it->value.cons.car = value;
+            if (was_function) inline_invalidate(symbol);
             return value;
         }
         sym_it = cdr(sym_it);
@@ -62,94 +67,382 @@ sExpr* get_symbol(sExpr* target, sExpr* symbol, sExpr* value){
     return create_symbol("undefined");
 }
 
+// Call frames
+//
+// Frames of in-progress calls live on a stack separate from global_env, which
+// only holds the global frame. A lambda application evaluates its arguments
+// straight into the slot region and releases them on return, so an ordinary
+// call conses nothing. Frames whose values are a cons list instead (heap
+// frames) come from push_env, and are also used when the slot region is full.
+// Lambdas don't capture their environment, so no frame outlives its call
+// unless something copies it out. let and the loop forms push frames too;
+// their parameter lists are the binding forms themselves, so an element may
+// be (name init ...) rather than a bare name. Each generator runs on an EvalStack of its
+// own; the slot region starts small and doubles as needed.
+
+#define SLOT_CAPACITY (1 << 16)
+#define INITIAL_SLOTS 256
+
+typedef struct {
+    sExpr *params;
+    int base;        // first slot in the slot region, or -1 for a heap frame
+    int count;       // number of values
+    sExpr *values;   // heap frame values
+} Frame;
+
+struct EvalStack {
+    Frame *frames;
+    int nframes;
+    int frame_cap;
+    sExpr **slots;
+    int nslots;
+    int slot_cap;
+};
+
+static EvalStack main_stack;
+static EvalStack *stack = &main_stack;
+
+static sExpr undefined_symbol = { .type = TYPE_SYMBOL, .value.symbol = "undefined" };
+#define UNDEFINED (&undefined_symbol)
+
+static Frame *push_frame(sExpr *params, int base, int count, sExpr *values){
+    note_params(params, base >= 0);
+    if (stack->nframes == stack->frame_cap) {
+        stack->frame_cap = stack->frame_cap ? stack->frame_cap * 2 : 256;
+        stack->frames = realloc(stack->frames, sizeof(Frame) * stack->frame_cap);
+    }
+    Frame *f = &stack->frames[stack->nframes++];
+    f->params = params;
+    f->base = base;
+    f->count = count;
+    f->values = values;
+    return f;
+}
+
+// Reserves n slots, or returns -1 if the region is full. Slots are always
+// addressed by index, so the region can move when it grows.
+static int alloc_slots(int n){
+    if (stack->nslots + n > stack->slot_cap) {
+        if (stack->nslots + n > SLOT_CAPACITY) return -1;
+        int cap = stack->slot_cap ? stack->slot_cap : INITIAL_SLOTS;
+        while (cap < stack->nslots + n) cap *= 2;
+        stack->slots = realloc(stack->slots, sizeof(sExpr *) * cap);
+        stack->slot_cap = cap;
+    }
+    int base = stack->nslots;
+    stack->nslots += n;
+    return base;
+}
+
 sExpr* push_env(sExpr* params, sExpr* args){
-    sExpr* new_frame = cons(params, cons(args, NIL));
-    global_env = cons(new_frame, global_env);
-    return new_frame;
+    int count = 0;
+    for (sExpr* it = args; !isnil(it); it = cdr(it)) count++;
+    push_frame(params, -1, count, args);
+    return args;
 }
 
 void pop_env(){
-    if (isnil(global_env)) return;
-    if (isnil(cdr(global_env))) {
-        return;
+    if (stack->nframes == 0) return;
+    Frame *f = &stack->frames[--stack->nframes];
+    if (f->base >= 0) stack->nslots = f->base;
+}
+
+EvalStack* eval_stack_new(void){
+    return calloc(1, sizeof(EvalStack));
+}
+
+void eval_stack_free(EvalStack* s){
+    free(s->frames);
+    free(s->slots);
+    free(s);
+}
+
+// Makes s the stack calls push onto, and returns the previous one
+EvalStack* eval_stack_switch(EvalStack* s){
+    EvalStack* old = stack;
+    stack = s;
+    return old;
+}
+
+StackMark stack_mark(void){
+    StackMark mark = { stack, stack->nframes, stack->nslots };
+    return mark;
+}
+
+void stack_restore(StackMark mark){
+    stack = mark.stack;
+    stack->nframes = mark.nframes;
+    stack->nslots = mark.nslots;
+}
+
+// Evaluates form with params bound to the n values in args
+sExpr* eval_in_frame(sExpr* form, sExpr* params, sExpr** args, int n){
+    BUDGET_ENTER();
+    int base = alloc_slots(n);
+    if (base < 0) {
+        sExpr* list = NIL;
+        for (int i = n - 1; i >= 0; i--) list = cons(args[i], list);
+        push_env(params, list);
+    } else {
+        memcpy(&stack->slots[base], args, sizeof(sExpr *) * n);
+        push_frame(params, base, n, NIL);
+    }
+    sExpr* result = eval(form);
+    pop_env();
+    BUDGET_LEAVE();
+    return result;
+}
+
+static int same_symbol(sExpr* a, sExpr* b){
+    return a == b || (issymbol(a) && strcmp(a->value.symbol, b->value.symbol) == 0);
+}
+
+// The name a parameter list element binds
+sExpr* param_name(sExpr* param){
+    return type_of(param) == TYPE_CONS ? car(param) : param;
+}
+
+// Pushes a frame for params with room for n values, none bound yet.
+// bind_local then binds them in order.
+void open_frame(sExpr* params, int n){
+    int base = alloc_slots(n);
+    if (base < 0) {
+        sExpr* values = NIL;
+        for (int i = 0; i < n; i++) values = cons(NIL, values);
+        push_frame(params, -1, 0, values);
+    } else {
+        push_frame(params, base, 0, NIL);
+    }
+}
+
+static sExpr** local_cell(Frame* f, int i){
+    if (f->base >= 0) return &stack->slots[f->base + i];
+    sExpr* values = f->values;
+    while (i-- > 0) values = cdr(values);
+    return &values->value.cons.car;
+}
+
+// Binds the next parameter of the innermost frame
+void bind_local(sExpr* value){
+    Frame* f = &stack->frames[stack->nframes - 1];
+    *local_cell(f, f->count) = value;
+    f->count++;
+}
+
+// Rebinds parameter i of the innermost frame
+void set_local(int i, sExpr* value){
+    *local_cell(&stack->frames[stack->nframes - 1], i) = value;
+}
+
+sExpr* get_local(int i){
+    return *local_cell(&stack->frames[stack->nframes - 1], i);
+}
+
+// set on a name bound by a call in progress changes that binding. Returns 0
+// if no call binds symbol.
+int assign_local(sExpr* symbol, sExpr* value){
+    for (int n = stack->nframes - 1; n >= 0; n--) {
+        Frame* f = &stack->frames[n];
+        int i = 0;
+        for (sExpr* p = f->params; !isnil(p) && i < f->count; p = cdr(p), i++) {
+            if (same_symbol(param_name(car(p)), symbol)) {
+                *local_cell(f, i) = value;
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Looks symbol up in one frame; NULL if it isn't bound there
+static sExpr* frame_lookup(Frame* f, sExpr* symbol){
+    sExpr* values = f->values;
+    int i = 0;
+    for (sExpr* p = f->params; !isnil(p) && i < f->count; p = cdr(p), i++) {
+        if (same_symbol(param_name(car(p)), symbol)) {
+            return f->base >= 0 ? stack->slots[f->base + i] : car(values);
+        }
+        if (f->base < 0) values = cdr(values);
+    }
+    return NULL;
+}
+
+// Value of symbol in the calls in progress, or NULL if none binds it
+sExpr* lookup_local(sExpr* symbol){
+    for (int i = stack->nframes - 1; i >= 0; i--) {
+        sExpr* val = frame_lookup(&stack->frames[i], symbol);
+        if (val) return val;
+    }
+    return NULL;
+}
+
+// Index of symbol among the parameters of the innermost call, if that call
+// keeps its arguments in slots; -1 otherwise
+int local_slot_of(sExpr* symbol, sExpr** params){
+    if (stack->nframes == 0) return -1;
+    Frame *f = &stack->frames[stack->nframes - 1];
+    if (f->base < 0) return -1;
+    int i = 0;
+    for (sExpr* p = f->params; !isnil(p) && i < f->count; p = cdr(p), i++) {
+        if (same_symbol(param_name(car(p)), symbol)) {
+            *params = f->params;
+            return i;
+        }
     }
-    global_env = cdr(global_env);
+    return -1;
+}
+
+// Slot of the innermost call if it was made with params; NULL if not
+sExpr* local_slot(sExpr* params, int slot){
+    if (stack->nframes == 0) return NULL;
+    Frame *f = &stack->frames[stack->nframes - 1];
+    if (f->params != params || f->base < 0 || slot >= f->count) return NULL;
+    return stack->slots[f->base + slot];
 }
 
 sExpr* lookup_stack(sExpr* symbol){
+    sExpr* local = lookup_local(symbol);
+    if (local) return local;
+    return lookup_global(symbol);
+}
+
+// Value of symbol in the global environment, ignoring calls in progress
+sExpr* lookup_global(sExpr* symbol){
     sExpr* env = global_env;
     while(!isnil(env)){
         sExpr* frame = car(env);
-        sExpr* val = get_symbol(symbol, car(frame), car(cdr(frame)));
-        if(!issymbol(val) || strcmp(val->value.symbol, "undefined") == 0){
-            return val;
+        sExpr* sym_it = car(frame);
+        sExpr* val_it = car(cdr(frame));
+        while (!isnil(sym_it) && !isnil(val_it)) {
+            if (same_symbol(car(sym_it), symbol)) return car(val_it);
+            sym_it = cdr(sym_it);
+            val_it = cdr(val_it);
         }
         env = cdr(env);
     }
-    return create_symbol("undefined");
+    return UNDEFINED;
+}
+
+// Applies a lambda to unevaluated argument forms
+sExpr* apply_lambda(sExpr* lambda_expr, sExpr* args){
+    sExpr* arg_names = car(cdr(lambda_expr));
+    sExpr* body = car(cdr(cdr(lambda_expr)));
+
+    BUDGET_ENTER();
+    int n = 0;
+    for (sExpr* cur = args; !isnil(cur); cur = cdr(cur)) n++;
+
+    int base = alloc_slots(n);
+    if (base < 0) {
+        // Slot region exhausted: fall back to a heap frame
+        sExpr* evaled_args = NIL;
+        sExpr* tail = NIL;
+        for (sExpr* cur = args; !isnil(cur); cur = cdr(cur)) {
+            sExpr* cell = cons(eval(car(cur)), NIL);
+            if (isnil(evaled_args)) evaled_args = cell;
+            else tail->value.cons.cdr = cell;
+            tail = cell;
+        }
+        push_env(arg_names, evaled_args);
+    } else {
+        // Nested calls made while evaluating an argument use slots above ours,
+        // and may grow the region, so it's indexed only after eval returns
+        int i = 0;
+        for (sExpr* cur = args; !isnil(cur); cur = cdr(cur), i++) {
+            sExpr* val = eval(car(cur));
+            stack->slots[base + i] = val;
+        }
+        push_frame(arg_names, base, n, NIL);
+    }
+
+    sExpr* result = eval(body);
+    pop_env();
+    BUDGET_LEAVE();
+    return result;
+}
+
+int islambda(sExpr* e){
+    return type_of(e) == TYPE_CONS && issymbol(car(e)) && strcmp(car(e)->value.symbol, "lambda") == 0;
+}
+
+// Calls fn on n evaluated values. fn is a lambda, a native, or the name of a builtin.
+sExpr* apply_values(sExpr* fn, sExpr** args, int n){
+    if (islambda(fn)) return eval_in_frame(car(cdr(cdr(fn))), car(cdr(fn)), args, n);
+    if (type_of(fn) == TYPE_NATIVE) return apply_native(fn, args, n);
+    if (type_of(fn) == TYPE_GENERATOR) return generator_yield(fn, n > 0 ? args[0] : NIL);
+
+    sExpr* call = NIL;
+    for (int i = n - 1; i >= 0; i--) {
+        call = cons(cons(create_symbol("quote"), cons(args[i], NIL)), call);
+    }
+    return eval(cons(fn, call));
 }
 
 //Constructors
-sExpr* create_int(long value) {
+_Thread_local size_t allocated_bytes = 0;
+
+// Every value cell comes from here, so allocated_bytes counts them
+sExpr* alloc_sExpr(sExprType type){
+    if (type == TYPE_CONS) return alloc_cons();
     sExpr *e = (sExpr *)malloc(sizeof(sExpr));
-    e->type = TYPE_INT;
+    e->type = type;
+    allocated_bytes += sizeof(sExpr);
+    return e;
+}
+
+sExpr* create_int(long value) {
+    sExpr *e = alloc_sExpr(TYPE_INT);
     e->value.integer = value;
     return e;
 }
 
 sExpr* create_double(double value){
-    sExpr *e = (sExpr *)malloc(sizeof(sExpr));
-    e->type = TYPE_DOUBLE;
+    sExpr *e = alloc_sExpr(TYPE_DOUBLE);
     e->value.dbl = value;
     return e;
 }
 
 sExpr* create_string(const char *value){
-    sExpr *e = (sExpr *)malloc(sizeof(sExpr));
-    e->type = TYPE_STRING;
-    e->value.string = strdup(value);
-    return e;
+    return create_string_len(value, strlen(value));
 }
 
 sExpr* create_symbol(const char *s){
-    sExpr *e = (sExpr *)malloc(sizeof(sExpr));
-    e->type = TYPE_SYMBOL;
+    sExpr *e = alloc_sExpr(TYPE_SYMBOL);
     e->value.symbol = strdup(s);
     return e;
 }
 
 sExpr* cons(sExpr *car, sExpr *cdr){
-    sExpr *e = (sExpr *)malloc(sizeof(sExpr));
-    e->type = TYPE_CONS;
+    sExpr *e = alloc_cons();
     e->value.cons.car = car;
     e->value.cons.cdr = cdr;
     return e;
 }
 
 sExpr* car(sExpr *e){
-    return (e->type == TYPE_CONS) ? e->value.cons.car : NIL;
+    return (type_of(e) == TYPE_CONS) ? e->value.cons.car : NIL;
 }
 
 sExpr* cdr(sExpr *e){
-    return (e->type == TYPE_CONS) ? e->value.cons.cdr : NIL;
+    return (type_of(e) == TYPE_CONS) ? e->value.cons.cdr : NIL;
 }
 
-int isnil(sExpr *e) { return (e->type == TYPE_NIL); }
-int issymbol(sExpr *e) { return (e->type == TYPE_SYMBOL); }
-int isnumber(sExpr *e) { return (e->type == TYPE_INT || e->type == TYPE_DOUBLE); }
-int isstring(sExpr *e) { return (e->type == TYPE_STRING); }
+int isnil(sExpr *e) { return (type_of(e) == TYPE_NIL); }
+int issymbol(sExpr *e) { return (type_of(e) == TYPE_SYMBOL); }
+int isnumber(sExpr *e) { return (type_of(e) == TYPE_INT || type_of(e) == TYPE_DOUBLE); }
+int isstring(sExpr *e) { return (type_of(e) == TYPE_STRING); }
 
 int islist(sExpr *e) {
-    while (e->type == TYPE_CONS) e = cdr(e);
-    return (e->type == TYPE_NIL);
+    while (type_of(e) == TYPE_CONS) e = cdr(e);
+    return (type_of(e) == TYPE_NIL);
 }
 
 int sExpr_to_bool(sExpr *e) {
-    return (e->type == TYPE_NIL) ? 0 : 1;
+    return (type_of(e) == TYPE_NIL) ? 0 : 1;
 }
 
-void print_sExpr(sExpr *e) {
-    switch (e->type) {
+static void print_atom(sExpr *e) {
+    switch (type_of(e)) {
         case TYPE_INT:
             printf("%ld", e->value.integer);
             break;
@@ -170,59 +463,172 @@ void print_sExpr(sExpr *e) {
             printf("()");
             break;
 
-        case TYPE_CONS: {
-            sExpr *head = e->value.cons.car;
-            sExpr *tail = e->value.cons.cdr;
-
-            if (head && head->type == TYPE_SYMBOL &&
-                strcmp(head->value.symbol, "quote") == 0 &&
-                tail && tail->type == TYPE_CONS &&
-                tail->value.cons.cdr->type == TYPE_NIL) {
-                printf("'");
-                print_sExpr(tail->value.cons.car);
-                return;
-            }
+        case TYPE_HASH:
+            print_hash(e->value.hash);
+            break;
 
-            printf("(");
-            sExpr *cur = e;
-            while (cur->type == TYPE_CONS) {
-                print_sExpr(cur->value.cons.car);
-                cur = cur->value.cons.cdr;
-                if (cur->type == TYPE_CONS) {
-                    printf(" ");
-                }
-            }
-            if (cur->type != TYPE_NIL) {
-                printf(" . ");
-                print_sExpr(cur);
-            }
-            printf(")");
+        case TYPE_PMAP:
+            print_pmap(e->value.pmap);
             break;
-        }
-    }
-}
 
+        case TYPE_PVEC:
+            print_pvec(e->value.pvec);
+            break;
 
-void free_sExpr(sExpr *e){
-    if (!e) return;
-    switch (e->type){
-        case TYPE_STRING:
-            free(e->value.string);
+        case TYPE_PROMISE:
+            printf("#<promise>");
             break;
-        case TYPE_SYMBOL:
-            free(e->value.symbol);
+
+        case TYPE_GENERATOR:
+            printf("#<generator>");
             break;
-        case TYPE_CONS:
-            free_sExpr(e->value.cons.car);
-            free_sExpr(e->value.cons.cdr);
+
+        case TYPE_NATIVE:
+            printf("#<native %s>", native_name(e->value.native));
             break;
-        case TYPE_NIL:
-            return;
-        default:
+
+        case TYPE_QUICK:
+            if (quick_symbol(e)) print_atom(quick_symbol(e));
+            break;
+
+        case TYPE_BUILDER: {
+            size_t len;
+            printf("#<string-builder \"%s\">", builder_data(e->value.builder, &len));
+            break;
+        }
+
+        case TYPE_CONS:
             break;
     }
+}
+
+// Work items for print_sExpr
+typedef struct {
+    enum { PRINT_FORM, PRINT_REST, PRINT_TEXT } kind;
+    sExpr *e;               // form, or the rest of a list being printed
+    const char *text;
+} PrintItem;
+
+static const char *print_prefix(sExpr *e) {
+    sExpr *head = e->value.cons.car;
+    sExpr *tail = e->value.cons.cdr;
+    if (!head || type_of(head) != TYPE_SYMBOL || !tail || type_of(tail) != TYPE_CONS ||
+        type_of(tail->value.cons.cdr) != TYPE_NIL) {
+        return NULL;
+    }
+    if (strcmp(head->value.symbol, "quote") == 0) return "'";
+    if (strcmp(head->value.symbol, "quasiquote") == 0) return "`";
+    if (strcmp(head->value.symbol, "unquote") == 0) return ",";
+    if (strcmp(head->value.symbol, "unquote-splicing") == 0) return ",@";
+    return NULL;
+}
+
+// Prints e using a heap stack of pending work, so neither long nor deeply
+// nested lists recurse on the C stack
+void print_sExpr(sExpr *e) {
+    int cap = 16, n = 0;
+    PrintItem *stack = malloc(sizeof(PrintItem) * cap);
+    stack[n++] = (PrintItem){ PRINT_FORM, e, NULL };
+
+    while (n > 0) {
+        if (n + 2 > cap) {
+            cap *= 2;
+            stack = realloc(stack, sizeof(PrintItem) * cap);
+        }
+        PrintItem item = stack[--n];
+
+        if (item.kind == PRINT_TEXT) {
+            printf("%s", item.text);
+        } else if (item.kind == PRINT_REST) {
+            sExpr *cur = item.e;
+            if (type_of(cur) == TYPE_CONS) {
+                printf(" ");
+                stack[n++] = (PrintItem){ PRINT_REST, cur->value.cons.cdr, NULL };
+                stack[n++] = (PrintItem){ PRINT_FORM, cur->value.cons.car, NULL };
+            } else if (type_of(cur) != TYPE_NIL) {
+                printf(" . ");
+                stack[n++] = (PrintItem){ PRINT_TEXT, NULL, ")" };
+                stack[n++] = (PrintItem){ PRINT_FORM, cur, NULL };
+            } else {
+                printf(")");
+            }
+        } else if (type_of(item.e) != TYPE_CONS) {
+            print_atom(item.e);
+        } else {
+            if (islambda(item.e)) item.e = inline_source(item.e); // as written
+            const char *prefix = print_prefix(item.e);
+            if (prefix) {
+                printf("%s", prefix);
+                stack[n++] = (PrintItem){ PRINT_FORM, item.e->value.cons.cdr->value.cons.car, NULL };
+            } else {
+                printf("(");
+                stack[n++] = (PrintItem){ PRINT_REST, item.e->value.cons.cdr, NULL };
+                stack[n++] = (PrintItem){ PRINT_FORM, item.e->value.cons.car, NULL };
+            }
+        }
+    }
+    free(stack);
+}
+
 
-    free(e);
+// Frees e and everything under it. Pending conses go on a heap stack, so
+// the depth of e doesn't matter.
+void free_sExpr(sExpr *e){
+    int cap = 16, n = 0;
+    sExpr **stack = malloc(sizeof(sExpr *) * cap);
+    stack[n++] = e;
+
+    while (n > 0) {
+        e = stack[--n];
+        if (!e || e == TRUE) continue; // singletons are never freed
+        if (is_hash_consed(e)) continue; // shared
+        switch (type_of(e)){
+            case TYPE_STRING:
+                free_string(e->value.string);
+                break;
+            case TYPE_SYMBOL:
+                free(e->value.symbol);
+                break;
+            case TYPE_CONS:
+                if (n + 2 > cap) {
+                    cap *= 2;
+                    stack = realloc(stack, sizeof(sExpr *) * cap);
+                }
+                stack[n++] = e->value.cons.cdr;
+                stack[n++] = e->value.cons.car;
+                break;
+            case TYPE_HASH:
+                hash_free(e->value.hash);
+                break;
+            case TYPE_PMAP:
+                free_pmap(e->value.pmap);
+                break;
+            case TYPE_PVEC:
+                free_pvec(e->value.pvec);
+                break;
+            case TYPE_BUILDER:
+                free_builder(e->value.builder);
+                break;
+            case TYPE_PROMISE:
+                free_promise(e->value.promise);
+                break;
+            case TYPE_QUICK:
+                free_quick(e->value.quick);
+                break;
+            case TYPE_GENERATOR:
+                free_generator(e->value.generator);
+                break;
+            case TYPE_NATIVE:
+                free_native(e->value.native);
+                break;
+            case TYPE_NIL:
+                continue;
+            default:
+                break;
+        }
+        free_cell(e);
+    }
+    free(stack);
 }
 
 //Tokenizer
@@ -255,9 +661,18 @@ TokenStream tokenize(const char* input){
             char buf[2] = {*p, '\0'};
             ts.items[ts.count++] = strdup(buf);
             p++;
-        } else if(*p == '\'') {
-            ts.items[ts.count++] = strdup("'");
+        } else if(*p == '\'' || *p == '`') {
+            char buf[2] = {*p, '\0'};
+            ts.items[ts.count++] = strdup(buf);
             p++;
+        } else if(*p == ',') {
+            if (p[1] == '@') {
+                ts.items[ts.count++] = strdup(",@");
+                p += 2;
+            } else {
+                ts.items[ts.count++] = strdup(",");
+                p++;
+            }
         }else if (*p== '"'){
             p++;
             const char *start = p;
@@ -322,59 +737,98 @@ char *next(TokenStream *ts){
 
 sExpr* parse_sexpr(TokenStream *ts);
 
+// Parses the elements of a list whose '(' has been consumed, up to and
+// including the ')'
 sExpr* parse_list(TokenStream *ts){
-    if (strcmp(peek(ts), ")") == 0) {
-        next(ts); // consume ')'
-        return NIL;
+    sExpr *head = NIL;
+    sExpr *tail = NIL;
+    const char *tok;
+    while ((tok = peek(ts)) && strcmp(tok, ")") != 0) {
+        sExpr *cell = cons(parse_sexpr(ts), NIL);
+        if (isnil(head)) head = cell;
+        else tail->value.cons.cdr = cell;
+        tail = cell;
     }
+    if (tok) next(ts); // consume ')'
+    return head;
+}
 
-    sExpr *first = parse_sexpr(ts);
-    sExpr *rest = parse_list(ts);
-    return cons(first, rest);
-};
+static const char *reader_macro_for(const char *tok) {
+    if (strcmp(tok, "'") == 0) return "quote";
+    if (strcmp(tok, "`") == 0) return "quasiquote";
+    if (strcmp(tok, ",") == 0) return "unquote";
+    if (strcmp(tok, ",@") == 0) return "unquote-splicing";
+    return NULL;
+}
+
+static sExpr *parse_atom(const char *tok);
 
+// A list being read, or a quote prefix waiting for its form
+typedef struct {
+    const char *reader_macro;   // NULL for a list
+    sExpr *head;
+    sExpr *tail;
+} OpenForm;
+
+// Reads one form. Nesting is tracked on a heap stack rather than the C
+// stack, so deeply nested input can't overflow it.
 sExpr *parse_sexpr(TokenStream *ts) {
-    const char *tok = peek(ts);
-    if (!tok) return NIL; // end of input
-
-    // Handle list
-    if (strcmp(tok, "(") == 0) {
-        next(ts); // consume
-        sExpr *head = NIL;
-        sExpr *tail = NIL;
-
-        while ((tok = peek(ts)) && strcmp(tok, ")") != 0) {
-            sExpr *elem = parse_sexpr(ts);
-            if (elem == NULL) elem = NIL; // safety
-
-            if (head == NIL) {
-                head = cons(elem, NIL);
-                tail = head;
-            } else {
-                tail->value.cons.cdr = cons(elem, NIL);
-                tail = tail->value.cons.cdr;
-            }
-        }
+    OpenForm *open = NULL;
+    int depth = 0, cap = 0, lists = 0;
+    sExpr *value;
 
+    for (;;) {
+        const char *tok = peek(ts);
         if (!tok) {
-            return NIL; // unmatched '('
+            if (lists > 0) { // unmatched '('
+                free(open);
+                return NIL;
+            }
+            value = NIL; // end of input
+        } else if (strcmp(tok, "(") == 0 || reader_macro_for(tok)) {
+            next(ts); // consume
+            if (depth == cap) {
+                cap = cap ? cap * 2 : 16;
+                open = realloc(open, sizeof(OpenForm) * cap);
+            }
+            open[depth].reader_macro = reader_macro_for(tok);
+            open[depth].head = open[depth].tail = NIL;
+            if (!open[depth].reader_macro) lists++;
+            depth++;
+            continue;
+        } else if (strcmp(tok, ")") == 0 && depth > 0 && !open[depth - 1].reader_macro) {
+            next(ts); // consume ')'
+            value = open[--depth].head;
+            lists--;
+        } else {
+            next(ts); // consume token
+            value = parse_atom(tok);
         }
 
-        next(ts); // consume ')'
-        return head;
+        // Hand the finished form to whatever encloses it
+        while (depth > 0 && open[depth - 1].reader_macro) {
+            depth--;
+            value = cons(create_symbol(open[depth].reader_macro), cons(value, NIL));
+        }
+        if (depth == 0) {
+            free(open);
+            return hash_cons_reader ? hash_cons_fresh(value) : value;
+        }
+        OpenForm *list = &open[depth - 1];
+        sExpr *cell = cons(value, NIL);
+        if (isnil(list->head)) list->head = cell;
+        else list->tail->value.cons.cdr = cell;
+        list->tail = cell;
     }
+}
 
-    // Handle quoted expression
-    if (strcmp(tok, "'") == 0) {
-        next(ts); // consume '
-        sExpr *quoted = parse_sexpr(ts);
-        sExpr *quote_sym = create_symbol("quote");
-        return cons(quote_sym, cons(quoted, NIL));
+static sExpr *parse_atom(const char *tok) {
+    // String (the tokenizer keeps the surrounding quotes)
+    if (tok[0] == '"') {
+        size_t len = strlen(tok);
+        return create_string_len(tok + 1, len >= 2 ? len - 2 : 0);
     }
 
-    // Atom
-    next(ts); // consume token
-
     // Integer
     char *endptr;
     long val = strtol(tok, &endptr, 10);
@@ -390,14 +844,14 @@ sExpr *parse_sexpr(TokenStream *ts) {
 
 
 sExpr* add(sExpr *a, sExpr *b) {
-    if ((a->type != TYPE_INT && a->type != TYPE_DOUBLE) ||
-        (b->type != TYPE_INT && b->type != TYPE_DOUBLE)) {
+    if ((type_of(a) != TYPE_INT && type_of(a) != TYPE_DOUBLE) ||
+        (type_of(b) != TYPE_INT && type_of(b) != TYPE_DOUBLE)) {
         return NIL;
     }
 
-    if (a->type == TYPE_DOUBLE || b->type == TYPE_DOUBLE) {
-        double x = (a->type == TYPE_DOUBLE) ? a->value.dbl : a->value.integer;
-        double y = (b->type == TYPE_DOUBLE) ? b->value.dbl : b->value.integer;
+    if (type_of(a) == TYPE_DOUBLE || type_of(b) == TYPE_DOUBLE) {
+        double x = (type_of(a) == TYPE_DOUBLE) ? a->value.dbl : a->value.integer;
+        double y = (type_of(b) == TYPE_DOUBLE) ? b->value.dbl : b->value.integer;
         return create_double(x + y);
     } else {
         return create_int(a->value.integer + b->value.integer);
@@ -405,14 +859,14 @@ sExpr* add(sExpr *a, sExpr *b) {
 }
 
 sExpr* sub(sExpr *a, sExpr *b) {
-    if ((a->type != TYPE_INT && a->type != TYPE_DOUBLE) ||
-        (b->type != TYPE_INT && b->type != TYPE_DOUBLE)) {
+    if ((type_of(a) != TYPE_INT && type_of(a) != TYPE_DOUBLE) ||
+        (type_of(b) != TYPE_INT && type_of(b) != TYPE_DOUBLE)) {
         return NIL;
     }
 
-    if (a->type == TYPE_DOUBLE || b->type == TYPE_DOUBLE) {
-        double x = (a->type == TYPE_DOUBLE) ? a->value.dbl : a->value.integer;
-        double y = (b->type == TYPE_DOUBLE) ? b->value.dbl : b->value.integer;
+    if (type_of(a) == TYPE_DOUBLE || type_of(b) == TYPE_DOUBLE) {
+        double x = (type_of(a) == TYPE_DOUBLE) ? a->value.dbl : a->value.integer;
+        double y = (type_of(b) == TYPE_DOUBLE) ? b->value.dbl : b->value.integer;
         return create_double(x - y);
     } else {
         return create_int(a->value.integer - b->value.integer);
@@ -420,14 +874,14 @@ sExpr* sub(sExpr *a, sExpr *b) {
 }
 
 sExpr* mul(sExpr *a, sExpr *b) {
-    if ((a->type != TYPE_INT && a->type != TYPE_DOUBLE) ||
-        (b->type != TYPE_INT && b->type != TYPE_DOUBLE)) {
+    if ((type_of(a) != TYPE_INT && type_of(a) != TYPE_DOUBLE) ||
+        (type_of(b) != TYPE_INT && type_of(b) != TYPE_DOUBLE)) {
         return NIL;
     }
 
-    if (a->type == TYPE_DOUBLE || b->type == TYPE_DOUBLE) {
-        double x = (a->type == TYPE_DOUBLE) ? a->value.dbl : a->value.integer;
-        double y = (b->type == TYPE_DOUBLE) ? b->value.dbl : b->value.integer;
+    if (type_of(a) == TYPE_DOUBLE || type_of(b) == TYPE_DOUBLE) {
+        double x = (type_of(a) == TYPE_DOUBLE) ? a->value.dbl : a->value.integer;
+        double y = (type_of(b) == TYPE_DOUBLE) ? b->value.dbl : b->value.integer;
         return create_double(x * y);
     } else {
         return create_int(a->value.integer * b->value.integer);
@@ -435,72 +889,74 @@ sExpr* mul(sExpr *a, sExpr *b) {
 }
 
 sExpr* divide(sExpr *a, sExpr *b) {
-    if ((a->type != TYPE_INT && a->type != TYPE_DOUBLE) ||
-        (b->type != TYPE_INT && b->type != TYPE_DOUBLE)) {
+    if ((type_of(a) != TYPE_INT && type_of(a) != TYPE_DOUBLE) ||
+        (type_of(b) != TYPE_INT && type_of(b) != TYPE_DOUBLE)) {
         return NIL;
     }
 
-    double y = (b->type == TYPE_DOUBLE) ? b->value.dbl : b->value.integer;
+    double y = (type_of(b) == TYPE_DOUBLE) ? b->value.dbl : b->value.integer;
     if (y == 0) return NIL;
 
-    double x = (a->type == TYPE_DOUBLE) ? a->value.dbl : a->value.integer;
+    double x = (type_of(a) == TYPE_DOUBLE) ? a->value.dbl : a->value.integer;
     return create_double(x / y);
 }
 
 sExpr* mod(sExpr *a, sExpr *b) {
-    if (a->type != TYPE_INT || b->type != TYPE_INT) return NIL;
+    if (type_of(a) != TYPE_INT || type_of(b) != TYPE_INT) return NIL;
     if (b->value.integer == 0) return NIL;
     return create_int(a->value.integer % b->value.integer);
 }
 
 sExpr* lt(sExpr *a, sExpr *b) {
-    if ((a->type != TYPE_INT && a->type != TYPE_DOUBLE) ||
-        (b->type != TYPE_INT && b->type != TYPE_DOUBLE)) return NIL;
+    if ((type_of(a) != TYPE_INT && type_of(a) != TYPE_DOUBLE) ||
+        (type_of(b) != TYPE_INT && type_of(b) != TYPE_DOUBLE)) return NIL;
 
-    double x = (a->type == TYPE_DOUBLE) ? a->value.dbl : a->value.integer;
-    double y = (b->type == TYPE_DOUBLE) ? b->value.dbl : b->value.integer;
+    double x = (type_of(a) == TYPE_DOUBLE) ? a->value.dbl : a->value.integer;
+    double y = (type_of(b) == TYPE_DOUBLE) ? b->value.dbl : b->value.integer;
     return (x < y) ? TRUE : NIL;
 }
 
 sExpr* gt(sExpr *a, sExpr *b) {
-    if ((a->type != TYPE_INT && a->type != TYPE_DOUBLE) ||
-        (b->type != TYPE_INT && b->type != TYPE_DOUBLE)) return NIL;
+    if ((type_of(a) != TYPE_INT && type_of(a) != TYPE_DOUBLE) ||
+        (type_of(b) != TYPE_INT && type_of(b) != TYPE_DOUBLE)) return NIL;
 
-    double x = (a->type == TYPE_DOUBLE) ? a->value.dbl : a->value.integer;
-    double y = (b->type == TYPE_DOUBLE) ? b->value.dbl : b->value.integer;
+    double x = (type_of(a) == TYPE_DOUBLE) ? a->value.dbl : a->value.integer;
+    double y = (type_of(b) == TYPE_DOUBLE) ? b->value.dbl : b->value.integer;
     return (x > y) ? TRUE : NIL;
 }
 
 sExpr* lte(sExpr *a, sExpr *b) {
-    if ((a->type != TYPE_INT && a->type != TYPE_DOUBLE) ||
-        (b->type != TYPE_INT && b->type != TYPE_DOUBLE)) return NIL;
+    if ((type_of(a) != TYPE_INT && type_of(a) != TYPE_DOUBLE) ||
+        (type_of(b) != TYPE_INT && type_of(b) != TYPE_DOUBLE)) return NIL;
 
-    double x = (a->type == TYPE_DOUBLE) ? a->value.dbl : a->value.integer;
-    double y = (b->type == TYPE_DOUBLE) ? b->value.dbl : b->value.integer;
+    double x = (type_of(a) == TYPE_DOUBLE) ? a->value.dbl : a->value.integer;
+    double y = (type_of(b) == TYPE_DOUBLE) ? b->value.dbl : b->value.integer;
     return (x <= y) ? TRUE : NIL;
 }
 
 sExpr* gte(sExpr *a, sExpr *b) {
-    if ((a->type != TYPE_INT && a->type != TYPE_DOUBLE) ||
-        (b->type != TYPE_INT && b->type != TYPE_DOUBLE)) return NIL;
+    if ((type_of(a) != TYPE_INT && type_of(a) != TYPE_DOUBLE) ||
+        (type_of(b) != TYPE_INT && type_of(b) != TYPE_DOUBLE)) return NIL;
 
-    double x = (a->type == TYPE_DOUBLE) ? a->value.dbl : a->value.integer;
-    double y = (b->type == TYPE_DOUBLE) ? b->value.dbl : b->value.integer;
+    double x = (type_of(a) == TYPE_DOUBLE) ? a->value.dbl : a->value.integer;
+    double y = (type_of(b) == TYPE_DOUBLE) ? b->value.dbl : b->value.integer;
     return (x >= y) ? TRUE : NIL;
 }
 
 sExpr* eq(sExpr *a, sExpr *b) {
-    if ((a->type == TYPE_INT || a->type == TYPE_DOUBLE) &&
-        (b->type == TYPE_INT || b->type == TYPE_DOUBLE)) {
-        double x = (a->type == TYPE_DOUBLE) ? a->value.dbl : a->value.integer;
-        double y = (b->type == TYPE_DOUBLE) ? b->value.dbl : b->value.integer;
+    if (type_of(a) == TYPE_QUICK) a = quick_symbol(a);
+    if (type_of(b) == TYPE_QUICK) b = quick_symbol(b);
+    if ((type_of(a) == TYPE_INT || type_of(a) == TYPE_DOUBLE) &&
+        (type_of(b) == TYPE_INT || type_of(b) == TYPE_DOUBLE)) {
+        double x = (type_of(a) == TYPE_DOUBLE) ? a->value.dbl : a->value.integer;
+        double y = (type_of(b) == TYPE_DOUBLE) ? b->value.dbl : b->value.integer;
         return (x == y) ? TRUE : NIL;
     }
 
-    if (a->type != b->type) return NIL;
+    if (type_of(a) != type_of(b)) return NIL;
 
-    switch (a->type) {
-        case TYPE_STRING: return (strcmp(a->value.string, b->value.string) == 0) ? TRUE : NIL;
+    switch (type_of(a)) {
+        case TYPE_STRING: return string_equal(a, b) ? TRUE : NIL;
         case TYPE_SYMBOL: return (strcmp(a->value.symbol, b->value.symbol) == 0) ? TRUE : NIL;
         case TYPE_NIL:    return TRUE;
         default:          return NIL;
@@ -514,8 +970,10 @@ sExpr* not_sExpr(sExpr *a) {
 
 sExpr* eval(sExpr *expr) {
     if (isnil(expr)) return NIL;
+    if (type_of(expr) == TYPE_QUICK) return eval_quick_ref(expr);
 
-    if (isnumber(expr) || isstring(expr)) {
+    // Everything but symbols and calls evaluates to itself
+    if (!issymbol(expr) && type_of(expr) != TYPE_CONS) {
         return expr;
     }
 
@@ -527,16 +985,18 @@ sExpr* eval(sExpr *expr) {
         return expr;
     }
 
+    if (trace_enabled && !trace_claim(expr)) return trace_call(expr);
+
     sExpr *fn = car(expr);
     sExpr *args = cdr(expr);
+    if (type_of(fn) == TYPE_QUICK) return eval_quick_call(expr);
 
     sExpr* lambda_expr = NIL;
     const char* sym = NULL;
 
     if (issymbol(fn)) {
         sym = fn->value.symbol;
-        lambda_expr = lookup_stack(fn);
-    }else if (fn->type == TYPE_CONS && issymbol(car(fn)) && strcmp(car(fn)->value.symbol, "lambda") == 0){
+    }else if (type_of(fn) == TYPE_CONS && issymbol(car(fn)) && strcmp(car(fn)->value.symbol, "lambda") == 0){
         lambda_expr = fn;
     }else{
         printf("Invalid function call\n");
@@ -545,17 +1005,257 @@ sExpr* eval(sExpr *expr) {
 
 
     if (sym != NULL) {
+        if (quicken_builtin(expr, sym)) return eval_quick_call(expr);
         if (strcmp(sym, "quote") == 0) return car(args);
+        if (strcmp(sym, "quasiquote") == 0) return quasiquote(car(args));
+        if (strcmp(sym, "defmacro") == 0) {
+            sExpr *name = car(args);
+            sExpr *macro = cons(create_symbol("macro"), cdr(args));
+            return set(name, macro);
+        }
+        if (strcmp(sym, "macroexpand") == 0) return macroexpand(eval(car(args)));
         if (strcmp(sym, "set") == 0) {
             sExpr *var = car(args);
             sExpr *val = eval(car(cdr(args)));
+            if (assign_local(var, val)) return val;
             return set(var, val);
         }
         if (strcmp(sym, "define") == 0) {
             sExpr* name = car(args);
             sExpr* val_expr = car(cdr(args));
+            if (issymbol(car(val_expr)) && strcmp(car(val_expr)->value.symbol, "lambda") == 0) {
+                val_expr = inline_calls(name, val_expr);
+            }
             return set(name, val_expr);
         }
+        if (strcmp(sym, "let") == 0) return eval_let(args, 0);
+        if (strcmp(sym, "let*") == 0) return eval_let(args, 1);
+        if (strcmp(sym, "while") == 0) return eval_while(args);
+        if (strcmp(sym, "dotimes") == 0) return eval_dotimes(args);
+        if (strcmp(sym, "dolist") == 0) return eval_dolist(args);
+        if (strcmp(sym, "do") == 0) return eval_do(args);
+        if (strcmp(sym, "save-image") == 0) {
+            sExpr *path = eval(car(args));
+            if (!isstring(path)) return NIL;
+            return save_image(path->value.string) == 0 ? TRUE : NIL;
+        }
+        if (strcmp(sym, "reload") == 0) {
+            sExpr *path = eval(car(args));
+            if (!isstring(path)) return NIL;
+            int n = reload_file(path->value.string);
+            if (n < 0) {
+                printf("reload: cannot read %s\n", path->value.string);
+                return NIL;
+            }
+            return create_int(n);
+        }
+        if (strcmp(sym, "load") == 0) {
+            sExpr *path = eval(car(args));
+            if (!isstring(path)) return NIL;
+            return load_file(path->value.string);
+        }
+        if (strcmp(sym, "make-hash") == 0) {
+            sExpr *size = eval(car(args));
+            return create_hash(type_of(size) == TYPE_INT && size->value.integer > 0 ? (size_t)size->value.integer : 0);
+        }
+        if (strcmp(sym, "hash-get") == 0) {
+            sExpr *h = eval(car(args));
+            sExpr *key = eval(car(cdr(args)));
+            if (type_of(h) != TYPE_HASH) return NIL;
+            sExpr *val = hash_get(h->value.hash, key);
+            return val ? val : NIL;
+        }
+        if (strcmp(sym, "hash-set!") == 0) {
+            sExpr *h = eval(car(args));
+            sExpr *key = eval(car(cdr(args)));
+            sExpr *val = eval(car(cdr(cdr(args))));
+            if (type_of(h) != TYPE_HASH || hash_set(h->value.hash, key, val) < 0) return NIL;
+            return val;
+        }
+        if (strcmp(sym, "hash-remove!") == 0) {
+            sExpr *h = eval(car(args));
+            sExpr *key = eval(car(cdr(args)));
+            if (type_of(h) != TYPE_HASH) return NIL;
+            return hash_remove(h->value.hash, key) ? TRUE : NIL;
+        }
+        if (strcmp(sym, "hash-count") == 0) {
+            sExpr *h = eval(car(args));
+            if (type_of(h) != TYPE_HASH) return NIL;
+            return create_int((long)hash_count(h->value.hash));
+        }
+        if (strcmp(sym, "hash-keys") == 0) {
+            sExpr *h = eval(car(args));
+            if (type_of(h) != TYPE_HASH) return NIL;
+            return hash_keys(h->value.hash);
+        }
+        if (strcmp(sym, "hash-map") == 0) {
+            sExpr *m = make_transient(create_pmap());
+            for (sExpr *cur = args; !isnil(cur) && !isnil(cdr(cur)); cur = cdr(cdr(cur))) {
+                sExpr *key = eval(car(cur));
+                if (!pmap_assoc(m, key, eval(car(cdr(cur))))) return NIL;
+            }
+            return make_persistent(m);
+        }
+        if (strcmp(sym, "vector") == 0) {
+            sExpr *v = make_transient(create_pvec());
+            for (sExpr *cur = args; !isnil(cur); cur = cdr(cur)) pvec_conj(v, eval(car(cur)));
+            return make_persistent(v);
+        }
+        // The ! forms only take transients, and the others only persistent
+        // collections, so an update never changes a version someone else has
+        if (strcmp(sym, "assoc") == 0 || strcmp(sym, "assoc!") == 0) {
+            sExpr *c = eval(car(args));
+            sExpr *key = eval(car(cdr(args)));
+            sExpr *val = eval(car(cdr(cdr(args))));
+            if (is_transient(c) != (sym[strlen(sym) - 1] == '!')) return NIL;
+            sExpr *result = NULL;
+            if (type_of(c) == TYPE_PMAP) {
+                result = pmap_assoc(c, key, val);
+            } else if (type_of(c) == TYPE_PVEC && type_of(key) == TYPE_INT && key->value.integer >= 0) {
+                result = pvec_assoc(c, (size_t)key->value.integer, val);
+            }
+            return result ? result : NIL;
+        }
+        if (strcmp(sym, "dissoc") == 0 || strcmp(sym, "dissoc!") == 0) {
+            sExpr *m = eval(car(args));
+            sExpr *key = eval(car(cdr(args)));
+            if (type_of(m) != TYPE_PMAP || is_transient(m) != (sym[strlen(sym) - 1] == '!')) return NIL;
+            return pmap_dissoc(m, key);
+        }
+        if (strcmp(sym, "conj") == 0 || strcmp(sym, "conj!") == 0) {
+            sExpr *v = eval(car(args));
+            sExpr *val = eval(car(cdr(args)));
+            if (type_of(v) != TYPE_PVEC || is_transient(v) != (sym[strlen(sym) - 1] == '!')) return NIL;
+            return pvec_conj(v, val);
+        }
+        if (strcmp(sym, "get") == 0 || strcmp(sym, "nth") == 0) {
+            sExpr *c = eval(car(args));
+            sExpr *key = eval(car(cdr(args)));
+            sExpr *val = NULL;
+            if (type_of(c) == TYPE_PMAP && strcmp(sym, "get") == 0) {
+                val = pmap_get(c->value.pmap, key);
+            } else if (type_of(c) == TYPE_PVEC && type_of(key) == TYPE_INT && key->value.integer >= 0) {
+                val = pvec_nth(c->value.pvec, (size_t)key->value.integer);
+            }
+            return val ? val : NIL;
+        }
+        if (strcmp(sym, "map-count") == 0) {
+            sExpr *m = eval(car(args));
+            if (type_of(m) != TYPE_PMAP) return NIL;
+            return create_int((long)pmap_count(m->value.pmap));
+        }
+        if (strcmp(sym, "vector-count") == 0) {
+            sExpr *v = eval(car(args));
+            if (type_of(v) != TYPE_PVEC) return NIL;
+            return create_int((long)pvec_count(v->value.pvec));
+        }
+        if (strcmp(sym, "transient") == 0) {
+            sExpr *t = make_transient(eval(car(args)));
+            return t ? t : NIL;
+        }
+        if (strcmp(sym, "persistent!") == 0) {
+            sExpr *c = make_persistent(eval(car(args)));
+            return c ? c : NIL;
+        }
+        if (strcmp(sym, "map-keys") == 0) {
+            sExpr *m = eval(car(args));
+            if (type_of(m) != TYPE_PMAP) return NIL;
+            return pmap_keys(m->value.pmap);
+        }
+        if (strcmp(sym, "vector->list") == 0) {
+            sExpr *v = eval(car(args));
+            if (type_of(v) != TYPE_PVEC) return NIL;
+            return pvec_to_list(v->value.pvec);
+        }
+        if (strcmp(sym, "string-length") == 0) {
+            sExpr *str = eval(car(args));
+            if (isstring(str)) return create_int((long)string_length(str));
+            if (type_of(str) == TYPE_BUILDER) {
+                size_t len;
+                builder_data(str->value.builder, &len);
+                return create_int((long)len);
+            }
+            return NIL;
+        }
+        if (strcmp(sym, "string-append") == 0) {
+            sExpr *strings = NIL;
+            sExpr *tail = NIL;
+            for (sExpr *cur = args; !isnil(cur); cur = cdr(cur)) {
+                sExpr *cell = cons(eval(car(cur)), NIL);
+                if (isnil(strings)) strings = cell;
+                else tail->value.cons.cdr = cell;
+                tail = cell;
+            }
+            return string_append(strings);
+        }
+        if (strcmp(sym, "substring") == 0) {
+            sExpr *str = eval(car(args));
+            sExpr *start = eval(car(cdr(args)));
+            sExpr *end = isnil(cdr(cdr(args))) ? NIL : eval(car(cdr(cdr(args))));
+            if (!isstring(str) || type_of(start) != TYPE_INT) return NIL;
+            if (isnil(end)) return substring(str, start->value.integer, (long)string_length(str));
+            if (type_of(end) != TYPE_INT) return NIL;
+            return substring(str, start->value.integer, end->value.integer);
+        }
+        if (strcmp(sym, "make-string-builder") == 0) return create_builder();
+        if (strcmp(sym, "builder-append!") == 0) {
+            sExpr *b = eval(car(args));
+            sExpr *val = eval(car(cdr(args)));
+            if (type_of(b) != TYPE_BUILDER || !builder_append_value(b->value.builder, val)) return NIL;
+            return b;
+        }
+        if (strcmp(sym, "builder->string") == 0) {
+            sExpr *b = eval(car(args));
+            if (type_of(b) != TYPE_BUILDER) return NIL;
+            return builder_to_string(b->value.builder);
+        }
+        if (strcmp(sym, "lambda") == 0) return expr;
+        if (strcmp(sym, "delay") == 0) return make_promise(car(args));
+        if (strcmp(sym, "force") == 0) return force(eval(car(args)));
+        if (strcmp(sym, "stream-cons") == 0) return cons(eval(car(args)), make_promise(car(cdr(args))));
+        if (strcmp(sym, "stream-car") == 0) return car(eval(car(args)));
+        if (strcmp(sym, "stream-cdr") == 0) return stream_cdr(eval(car(args)));
+        if (strcmp(sym, "stream-map") == 0) {
+            sExpr *f = eval(car(args));
+            sExpr *src = car(cdr(args));
+            return stream_map(f, eval(src), fresh_stream(src));
+        }
+        if (strcmp(sym, "stream-filter") == 0) {
+            sExpr *pred = eval(car(args));
+            sExpr *src = car(cdr(args));
+            return stream_filter(pred, eval(src), fresh_stream(src));
+        }
+        if (strcmp(sym, "stream-take") == 0) {
+            sExpr *s = eval(car(args));
+            sExpr *n = eval(car(cdr(args)));
+            if (type_of(n) != TYPE_INT) return NIL;
+            return stream_take(s, n->value.integer, fresh_stream(car(args)));
+        }
+        if (strcmp(sym, "stream-fold") == 0) {
+            sExpr *f = eval(car(args));
+            sExpr *init = eval(car(cdr(args)));
+            sExpr *src = car(cdr(cdr(args)));
+            return stream_fold(f, init, eval(src), fresh_stream(src));
+        }
+        if (strcmp(sym, "stream->list") == 0) return stream_to_list(eval(car(args)), fresh_stream(car(args)));
+        if (strcmp(sym, "trace-dump") == 0) {
+            sExpr *path = eval(car(args));
+            if (!isstring(path)) return NIL;
+            return trace_dump(path->value.string) == 0 ? TRUE : NIL;
+        }
+        if (strcmp(sym, "make-generator") == 0) return make_generator(eval(car(args)));
+        if (strcmp(sym, "next") == 0) return generator_next(eval(car(args)));
+        if (strcmp(sym, "generator-done?") == 0) return generator_done(eval(car(args))) ? TRUE : NIL;
+        if (strcmp(sym, "file-lines") == 0) {
+            sExpr *path = eval(car(args));
+            if (!isstring(path)) return NIL;
+            return file_lines(path->value.string);
+        }
+        if (strcmp(sym, "file-forms") == 0) {
+            sExpr *path = eval(car(args));
+            if (!isstring(path)) return NIL;
+            return file_forms(path->value.string);
+        }
         if (strcmp(sym, "+") == 0) return add(eval(car(args)), eval(car(cdr(args))));
         if (strcmp(sym, "-") == 0) return sub(eval(car(args)), eval(car(cdr(args))));
         if (strcmp(sym, "*") == 0) return mul(eval(car(args)), eval(car(cdr(args))));
@@ -565,8 +1265,10 @@ sExpr* eval(sExpr *expr) {
         if (strcmp(sym, ">") == 0) return gt(eval(car(args)), eval(car(cdr(args))));
         if (strcmp(sym, "<=") == 0) return lte(eval(car(args)), eval(car(cdr(args))));
         if (strcmp(sym, ">=") == 0) return gte(eval(car(args)), eval(car(cdr(args))));
-        if (strcmp(sym, "=") == 0) return eq(eval(car(args)), eval(car(cdr(args))));
+        if (strcmp(sym, "=") == 0 || strcmp(sym, "eq") == 0) return eq(eval(car(args)), eval(car(cdr(args))));
         if (strcmp(sym, "not") == 0) return not_sExpr(eval(car(args)));
+        if (strcmp(sym, "equal") == 0) return equal(eval(car(args)), eval(car(cdr(args))));
+        if (strcmp(sym, "hash-cons") == 0) return hash_cons(eval(car(args)));
         if (strcmp(sym, "and") == 0) {
             sExpr* cur = args;
             sExpr* result = NIL;
@@ -605,35 +1307,22 @@ sExpr* eval(sExpr *expr) {
         }
     }
 
-     if (!isnil(lambda_expr) && issymbol(car(lambda_expr)) &&
-        strcmp(car(lambda_expr)->value.symbol, "lambda") == 0) {
-
-        sExpr* arg_names = car(cdr(lambda_expr));
-        sExpr* body = car(cdr(cdr(lambda_expr)));
+    if (sym != NULL) lambda_expr = lookup_stack(fn);
 
-        // Evaluate arguments
-        sExpr* evaled_args = NIL;
-        sExpr* tail = NIL;
-        sExpr* cur = args;
-        while (!isnil(cur)) {
-            sExpr* a = eval(car(cur));
-            if (isnil(evaled_args)) {
-                evaled_args = cons(a, NIL);
-                tail = evaled_args;
-            } else {
-                tail->value.cons.cdr = cons(a, NIL);
-                tail = tail->value.cons.cdr;
-            }
-            cur = cdr(cur);
-        }
+    if (ismacro(lambda_expr)) {
+        return eval(expand_in_place(expr, lambda_expr));
+    }
 
-        // Push environment, evaluate body, pop environment
-        push_env(arg_names, evaled_args);
-        sExpr* result = eval(body);
-        pop_env();
-        return result;
+    if (islambda(lambda_expr)) {
+        quicken_call(expr, lambda_expr);
+        return apply_lambda(lambda_expr, args);
     }
 
+    // The yield argument of a generator's function
+    if (type_of(lambda_expr) == TYPE_GENERATOR) return generator_yield(lambda_expr, eval(car(args)));
+
+    if (type_of(lambda_expr) == TYPE_NATIVE) return call_native(lambda_expr, args);
+
     printf("Unknown function: %s\n", sym ? sym : "???");
     return NIL;
 }
\ No newline at end of file
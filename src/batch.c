@@ -0,0 +1,222 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include "sexpr.h"
+
+// Pipelined batch mode
+//
+// yisp --batch reads forms from stdin like the REPL, one per line, but
+// without prompts, and overlaps the work on three threads:
+//   - a reader thread reads lines and parses them
+//   - the calling thread evaluates the parsed forms in order
+//   - a writer thread writes each form's output and flushes
+// Forms go from reader to evaluator, and output from evaluator to writer,
+// through bounded single-producer single-consumer rings.
+//
+// The evaluator still formats results itself: a later form may change a
+// value that was printed earlier (a hash table, a builder, quickened code),
+// so printing on another thread would race with it. Everything a form
+// prints goes to a memory stream that is handed to the writer in chunks,
+// which also keeps output in order. Only the parser runs off the evaluator's
+// thread, and it touches no shared state except with --hash-cons. With
+// --hash-cons, or with a single CPU where the stages couldn't overlap
+// anyway, batch mode runs them one after another instead.
+
+#define QUEUE_SIZE 1024
+#define CHUNK_SIZE (64 << 10)
+
+// Single producer, single consumer. A side that finds the ring full or
+// empty spins briefly, then backs off to sleeping. head and tail are on
+// separate cache lines so the two sides don't keep stealing each other's.
+typedef struct {
+    void *items[QUEUE_SIZE];
+    _Alignas(64) _Atomic size_t head;   // next slot to read
+    _Alignas(64) _Atomic size_t tail;   // next slot to write
+} Queue;
+
+typedef struct {
+    FILE *mem;
+    char *data;
+    size_t len;
+} Chunk;
+
+static char end_marker;
+#define END ((void *)&end_marker)
+
+#define SPINS 64
+#define YIELDS 64
+
+static void backoff(int *spins) {
+    if (++*spins < SPINS) return;
+    if (*spins < SPINS + YIELDS) {
+        sched_yield();
+        return;
+    }
+    struct timespec ts = { 0, 50000 };
+    nanosleep(&ts, NULL);
+}
+
+static void queue_push(Queue *q, void *item) {
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    int spins = 0;
+    while (tail - atomic_load_explicit(&q->head, memory_order_acquire) == QUEUE_SIZE) backoff(&spins);
+    q->items[tail % QUEUE_SIZE] = item;
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+}
+
+// NULL if the ring is empty
+static void *queue_try_pop(Queue *q) {
+    size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    if (head == atomic_load_explicit(&q->tail, memory_order_acquire)) return NULL;
+    void *item = q->items[head % QUEUE_SIZE];
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+    return item;
+}
+
+static void *queue_pop(Queue *q) {
+    void *item;
+    int spins = 0;
+    while (!(item = queue_try_pop(q))) backoff(&spins);
+    return item;
+}
+
+// Like queue_pop, but gives up with NULL where queue_pop would start
+// sleeping, so the caller can do its idle work first
+static void *queue_pop_busy(Queue *q) {
+    void *item;
+    int spins = 0;
+    while (!(item = queue_try_pop(q)) && spins < SPINS + YIELDS) backoff(&spins);
+    return item;
+}
+
+typedef struct {
+    FILE *in;
+    FILE *out;
+    Queue forms;
+    Queue output;
+} Pipeline;
+
+// Parses a line holding a form, or returns NULL for a blank one
+static sExpr *parse_line(char *line) {
+    line[strcspn(line, "\n")] = '\0';
+    if (line[0] == '\0') return NULL;
+    TokenStream ts = tokenize(line);
+    sExpr *form = ts.count > 0 ? parse_sexpr(&ts) : NULL;
+    free_tokens(&ts);
+    return form;
+}
+
+static void *reader_main(void *arg) {
+    Pipeline *p = arg;
+    char line[1024];
+    while (fgets(line, sizeof(line), p->in)) {
+        sExpr *form = parse_line(line);
+        if (form) queue_push(&p->forms, form);
+    }
+    queue_push(&p->forms, END);
+    return NULL;
+}
+
+// Flushes only when the evaluator has stopped producing for a while, so
+// output from a run of quick forms is written in large blocks
+static void *writer_main(void *arg) {
+    Pipeline *p = arg;
+    for (;;) {
+        Chunk *c = queue_pop_busy(&p->output);
+        if (!c) {
+            fflush(p->out);
+            c = queue_pop(&p->output);
+        }
+        if (c == END) break;
+        fwrite(c->data, 1, c->len, p->out);
+        free(c->data);
+        free(c);
+    }
+    fflush(p->out);
+    return NULL;
+}
+
+// Starts collecting what the evaluator prints into a new chunk
+static Chunk *open_chunk(void) {
+    Chunk *c = malloc(sizeof(Chunk));
+    c->mem = open_memstream(&c->data, &c->len);
+    stdout = c->mem;
+    return c;
+}
+
+static void hand_off(Pipeline *p, Chunk *c) {
+    fclose(c->mem);
+    queue_push(&p->output, c);
+}
+
+static int run_sequential(FILE *in, FILE *out, int (*run_form)(sExpr *form)) {
+    FILE *saved = stdout;
+    stdout = out;
+    int status = 0;
+    char line[1024];
+    while (fgets(line, sizeof(line), in)) {
+        sExpr *form = parse_line(line);
+        if (form && !run_form(form)) status = 1;
+    }
+    fflush(out);
+    stdout = saved;
+    return status;
+}
+
+// Runs every form in `in`, writing what each prints to out. run_form
+// evaluates and prints one form, returning 0 if it failed. Returns 1 if any
+// form failed.
+int run_batch(FILE *in, FILE *out, int (*run_form)(sExpr *form)) {
+    if (hash_cons_reader || sysconf(_SC_NPROCESSORS_ONLN) < 2) return run_sequential(in, out, run_form);
+
+    Pipeline *p = calloc(1, sizeof(Pipeline));
+    p->in = in;
+    p->out = out;
+    pthread_t reader, writer;
+    if (pthread_create(&writer, NULL, writer_main, p) != 0) {
+        free(p);
+        return run_sequential(in, out, run_form);
+    }
+    if (pthread_create(&reader, NULL, reader_main, p) != 0) {
+        queue_push(&p->output, END);
+        pthread_join(writer, NULL);
+        free(p);
+        return run_sequential(in, out, run_form);
+    }
+
+    // Output is handed over in chunks: whenever the evaluator has to wait
+    // for the reader for more than a moment, and whenever a chunk gets large
+    int status = 0;
+    FILE *saved = stdout;
+    fflush(saved);
+    Chunk *c = NULL;
+    for (;;) {
+        sExpr *form = queue_pop_busy(&p->forms);
+        if (!form && c) {
+            hand_off(p, c);
+            c = NULL;
+        }
+        if (!form) form = queue_pop(&p->forms);
+        if (form == END) break;
+
+        if (!c) c = open_chunk();
+        if (!run_form(form)) status = 1;
+        if (ftell(stdout) >= CHUNK_SIZE) {
+            hand_off(p, c);
+            c = NULL;
+        }
+    }
+    if (c) hand_off(p, c);
+    stdout = saved;
+    queue_push(&p->output, END);
+
+    pthread_join(reader, NULL);
+    pthread_join(writer, NULL);
+    free(p);
+    return status;
+}
@@ -0,0 +1,134 @@
+// fail() may longjmp from a generator's stack back to the main one, which
+// the fortified longjmp rejects
+#undef _FORTIFY_SOURCE
+#define _GNU_SOURCE         // pthread_getattr_np
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <time.h>
+#include <pthread.h>
+#include "sexpr.h"
+
+// Evaluation budgets
+//
+// eval_bounded evaluates one top-level form under eval_limits: a number of
+// steps (lambda applications and loop iterations), a wall-clock deadline, a
+// number of bytes allocated and a call depth. The counters are bumped and
+// checked at lambda applications, macro expansions and loop iterations only,
+// so a form that runs without limits pays a single flag test there. Going
+// over a limit longjmps back to eval_bounded, which pops every frame the form
+// pushed and ends any generator it was running.
+//
+// Whatever limits are set, a form under a budget also stops with an error
+// before it runs out of C stack, which a deep enough recursion would do long
+// before using up its steps or time.
+
+Budget eval_limits = { 0, 0, 0, 0 };
+int budget_active = 0;
+
+static struct {
+    long steps;
+    long depth;
+    size_t start_bytes;
+    double deadline;
+    jmp_buf *unwind;
+    const char *error;
+} run;
+
+// Room left below the deepest check for the work up to the next one
+#define STACK_MARGIN (256 << 10)
+
+static _Thread_local char *thread_stack_low = NULL;
+
+// Lowest usable address of the C stack in use, or NULL if unknown
+static char *stack_low(void) {
+    char *low = generator_stack_low();
+    if (low) return low;
+    if (!thread_stack_low) {
+        pthread_attr_t attr;
+        void *addr;
+        size_t size;
+        if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+            if (pthread_attr_getstack(&attr, &addr, &size) == 0) thread_stack_low = addr;
+            pthread_attr_destroy(&attr);
+        }
+    }
+    return thread_stack_low;
+}
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static void fail(const char *error) {
+    run.error = error;
+    longjmp(*run.unwind, 1);
+}
+
+void budget_step(void) {
+    run.steps++;
+    if (eval_limits.max_steps && run.steps > eval_limits.max_steps) {
+        fail("step limit exceeded");
+    }
+    if (eval_limits.max_bytes && allocated_bytes - run.start_bytes > eval_limits.max_bytes) {
+        fail("memory limit exceeded");
+    }
+    // Reading the clock costs more than the rest, so only every 1024 steps
+    if (eval_limits.max_ms && (run.steps & 1023) == 0 && now_ms() > run.deadline) {
+        fail("time limit exceeded");
+    }
+}
+
+void budget_enter(void) {
+    run.depth++;
+    if (eval_limits.max_depth && run.depth > eval_limits.max_depth) {
+        fail("recursion depth limit exceeded");
+    }
+    char here;
+    char *low = stack_low();
+    if (low && &here - low < STACK_MARGIN) fail("stack limit exceeded");
+    budget_step();
+}
+
+void budget_leave(void) {
+    run.depth--;
+}
+
+static int any_limit(void) {
+    return eval_limits.max_steps || eval_limits.max_ms ||
+           eval_limits.max_bytes || eval_limits.max_depth;
+}
+
+// Evaluates form under eval_limits. Returns NULL and sets *error if a
+// limit was hit.
+sExpr *eval_bounded(sExpr *form, const char **error) {
+    *error = NULL;
+    if (!any_limit() || budget_active) return eval(form); // nested: outer budget applies
+
+    jmp_buf unwind;
+    StackMark mark = stack_mark();
+    int trace_depth = trace_mark();
+    run.steps = 0;
+    run.depth = 0;
+    run.start_bytes = allocated_bytes;
+    run.deadline = now_ms() + (double)eval_limits.max_ms;
+    run.unwind = &unwind;
+    run.error = NULL;
+
+    sExpr *volatile result = NULL;
+    if (setjmp(unwind) == 0) {
+        budget_active = 1;
+        result = eval(form);
+    } else {
+        stack_restore(mark);
+        generators_unwind();
+        trace_unwind(trace_depth);
+        *error = run.error;
+    }
+    budget_active = 0;
+    run.unwind = NULL;
+    return result;
+}
@@ -0,0 +1,607 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include "sexpr.h"
+
+// Compiler to C
+//
+// Translates a script into a C file that links against the runtime. Every
+// (define name (lambda ...)) becomes a C function, and top-level forms become
+// statements in main() that print their results just like running the script.
+//
+// Compiled code calls the runtime directly (add, lt, set, ...) and calls other
+// compiled functions as C functions. Arithmetic and comparisons built only
+// from parameters and integer literals get an unboxed fast path: one guard
+// checks that the parameters are integers, then the whole expression is
+// computed on longs. Anything the compiler doesn't handle natively (strings,
+// hash tables, loops, ...) falls back to eval, so every form compiles.
+//
+// Each function pushes a frame for its parameters, as a lambda call does:
+// with dynamic scoping, the functions it calls and the forms it hands to eval
+// can read and set them by name. Parameters are therefore read from the frame
+// (get_local) rather than kept in C variables, which would miss a set.
+
+typedef enum { C_BOXED, C_BOOL } CKind;
+
+typedef struct {
+    char *code;
+    CKind kind;    // C_BOXED: sExpr*, C_BOOL: C int truth value
+} CExpr;
+
+typedef struct {
+    const char *name;
+    sExpr *lambda;
+    sExpr *params;
+    int arity;
+    int id;
+} CFunction;
+
+typedef struct {
+    StringBuilder *consts;    // initializers for K[]
+    int nconsts;
+    CFunction *fns;
+    int nfns;
+    int known_fns;            // functions callable directly from this point
+    // Per function being compiled
+    sExpr *params;
+    int params_const;         // K index of params, or -1 at top level
+    int ntemps;
+} Compiler;
+
+static char *fmt(const char *f, ...) {
+    va_list ap;
+    va_start(ap, f);
+    int n = vsnprintf(NULL, 0, f, ap);
+    va_end(ap);
+
+    char *out = malloc((size_t)n + 1);
+    va_start(ap, f);
+    vsnprintf(out, (size_t)n + 1, f, ap);
+    va_end(ap);
+    return out;
+}
+
+static void emit(StringBuilder *b, const char *f, ...) {
+    va_list ap;
+    va_start(ap, f);
+    int n = vsnprintf(NULL, 0, f, ap);
+    va_end(ap);
+
+    char *text = malloc((size_t)n + 1);
+    va_start(ap, f);
+    vsnprintf(text, (size_t)n + 1, f, ap);
+    va_end(ap);
+    builder_append(b, text, (size_t)n);
+    free(text);
+}
+
+static int is_call_to(sExpr *e, const char *name) {
+    return type_of(e) == TYPE_CONS && issymbol(car(e)) && strcmp(car(e)->value.symbol, name) == 0;
+}
+
+static int list_length(sExpr *e) {
+    int n = 0;
+    for (; type_of(e) == TYPE_CONS; e = cdr(e)) n++;
+    return n;
+}
+
+// C string literal for s
+static char *c_string(const char *s, size_t len) {
+    StringBuilder *b = builder_new();
+    builder_append(b, "\"", 1);
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)s[i];
+        if (c == '"' || c == '\\') emit(b, "\\%c", c);
+        else if (c < 32 || c >= 127) emit(b, "\\%03o", c);
+        else builder_append(b, (const char *)&c, 1);
+    }
+    builder_append(b, "\"", 1);
+    size_t n;
+    char *out = strdup(builder_data(b, &n));
+    free_builder(b);
+    return out;
+}
+
+// C expression that rebuilds value at startup
+static char *construct(sExpr *value) {
+    switch (type_of(value)) {
+        case TYPE_NIL:
+            return strdup("NIL");
+        case TYPE_INT:
+            return fmt("create_int(%ldL)", value->value.integer);
+        case TYPE_DOUBLE:
+            return fmt("create_double(%.17g)", value->value.dbl);
+        case TYPE_STRING: {
+            char *lit = c_string(value->value.string, string_length(value));
+            char *out = fmt("create_string_len(%s, %zu)", lit, string_length(value));
+            free(lit);
+            return out;
+        }
+        case TYPE_SYMBOL: {
+            if (value == TRUE) return strdup("TRUE");
+            char *lit = c_string(value->value.symbol, strlen(value->value.symbol));
+            char *out = fmt("create_symbol(%s)", lit);
+            free(lit);
+            return out;
+        }
+        case TYPE_CONS: {
+            char *a = construct(car(value));
+            char *d = construct(cdr(value));
+            char *out = fmt("cons(%s, %s)", a, d);
+            free(a);
+            free(d);
+            return out;
+        }
+        default:
+            // Tables and builders never appear in source text
+            return strdup("NIL");
+    }
+}
+
+static int add_const(Compiler *c, sExpr *value) {
+    char *init = construct(value);
+    emit(c->consts, "    K[%d] = %s;\n", c->nconsts, init);
+    free(init);
+    return c->nconsts++;
+}
+
+static CFunction *find_fn(Compiler *c, sExpr *sym) {
+    if (!issymbol(sym)) return NULL;
+    for (int i = 0; i < c->known_fns; i++) {
+        if (strcmp(c->fns[i].name, sym->value.symbol) == 0) return &c->fns[i];
+    }
+    return NULL;
+}
+
+static int param_index(Compiler *c, sExpr *sym) {
+    if (!issymbol(sym)) return -1;
+    int i = 0;
+    for (sExpr *p = c->params; !isnil(p); p = cdr(p), i++) {
+        if (issymbol(car(p)) && strcmp(car(p)->value.symbol, sym->value.symbol) == 0) return i;
+    }
+    return -1;
+}
+
+static char *box(CExpr e) {
+    if (e.kind == C_BOXED) return e.code;
+    char *out = fmt("((%s) ? TRUE : NIL)", e.code);
+    free(e.code);
+    return out;
+}
+
+static char *truth(CExpr e) {
+    if (e.kind == C_BOOL) return e.code;
+    char *out = fmt("!isnil(%s)", e.code);
+    free(e.code);
+    return out;
+}
+
+static CExpr boxed(char *code) { return (CExpr){ code, C_BOXED }; }
+static CExpr boolean(char *code) { return (CExpr){ code, C_BOOL }; }
+
+static CExpr compile_expr(Compiler *c, sExpr *expr);
+
+// Anything not compiled natively: hand the original form to eval, which finds
+// the parameters in the function's frame
+static CExpr fallback(Compiler *c, sExpr *expr) {
+    return boxed(fmt("eval(K[%d])", add_const(c, expr)));
+}
+
+// --- Unboxed integer trees ---
+
+static const char *arith_op(sExpr *expr) {
+    if (type_of(expr) != TYPE_CONS || !issymbol(car(expr)) || list_length(expr) != 3) return NULL;
+    const char *s = car(expr)->value.symbol;
+    if (strcmp(s, "+") == 0) return "+";
+    if (strcmp(s, "-") == 0) return "-";
+    if (strcmp(s, "*") == 0) return "*";
+    return NULL;
+}
+
+// Integer literals, parameters, and + - * over them
+static int int_tree(Compiler *c, sExpr *expr) {
+    if (type_of(expr) == TYPE_INT) return 1;
+    if (param_index(c, expr) >= 0) return 1;
+    if (!arith_op(expr)) return 0;
+    return int_tree(c, car(cdr(expr))) && int_tree(c, car(cdr(cdr(expr))));
+}
+
+// Atoms, quoted data and integer trees: evaluating one changes nothing
+static int side_effect_free(Compiler *c, sExpr *expr) {
+    return type_of(expr) != TYPE_CONS || is_call_to(expr, "quote") || int_tree(c, expr);
+}
+
+static void tree_params(Compiler *c, sExpr *expr, int *used) {
+    int i = param_index(c, expr);
+    if (i >= 0) used[i] = 1;
+    else if (type_of(expr) == TYPE_CONS) {
+        tree_params(c, car(cdr(expr)), used);
+        tree_params(c, car(cdr(cdr(expr))), used);
+    }
+}
+
+static char *unboxed(Compiler *c, sExpr *expr) {
+    if (type_of(expr) == TYPE_INT) return fmt("%ldL", expr->value.integer);
+    int i = param_index(c, expr);
+    if (i >= 0) return fmt("get_local(%d)->value.integer", i);
+
+    char *a = unboxed(c, car(cdr(expr)));
+    char *b = unboxed(c, car(cdr(cdr(expr))));
+    char *out = fmt("(%s %s %s)", a, arith_op(expr), b);
+    free(a);
+    free(b);
+    return out;
+}
+
+// "type_of(a0) == TYPE_INT && ..." for the parameters in both trees
+static char *int_guard(Compiler *c, sExpr *x, sExpr *y) {
+    int n = list_length(c->params);
+    int *used = calloc((size_t)n + 1, sizeof(int));
+    tree_params(c, x, used);
+    if (y) tree_params(c, y, used);
+
+    StringBuilder *b = builder_new();
+    int first = 1;
+    for (int i = 0; i < n; i++) {
+        if (!used[i]) continue;
+        emit(b, "%stype_of(get_local(%d)) == TYPE_INT", first ? "" : " && ", i);
+        first = 0;
+    }
+    free(used);
+    size_t len;
+    char *out = strdup(first ? "1" : builder_data(b, &len));
+    free_builder(b);
+    return out;
+}
+
+// --- Builtins ---
+
+static const char *binary_runtime(const char *sym) {
+    static const char *table[][2] = {
+        {"+", "add"}, {"-", "sub"}, {"*", "mul"}, {"/", "divide"}, {"%", "mod"},
+        {"<", "lt"}, {">", "gt"}, {"<=", "lte"}, {">=", "gte"}, {"=", "eq"}, {"eq", "eq"},
+        {NULL, NULL}
+    };
+    for (int i = 0; table[i][0]; i++) {
+        if (strcmp(table[i][0], sym) == 0) return table[i][1];
+    }
+    return NULL;
+}
+
+static const char *c_compare(const char *sym) {
+    if (strcmp(sym, "<") == 0) return "<";
+    if (strcmp(sym, ">") == 0) return ">";
+    if (strcmp(sym, "<=") == 0) return "<=";
+    if (strcmp(sym, ">=") == 0) return ">=";
+    if (strcmp(sym, "=") == 0 || strcmp(sym, "eq") == 0) return "==";
+    return NULL;
+}
+
+static CExpr compile_binary(Compiler *c, const char *sym, sExpr *args) {
+    sExpr *x = car(args);
+    sExpr *y = car(cdr(args));
+    const char *fn = binary_runtime(sym);
+    const char *cmp = c_compare(sym);
+
+    // C leaves the order of a call's arguments open, so operands that could
+    // have side effects are evaluated into temporaries first, left to right.
+    // The unboxed path below only ever has operands that can't.
+    char *a = box(compile_expr(c, x));
+    char *b = box(compile_expr(c, y));
+    char *generic;
+    if (side_effect_free(c, x) && side_effect_free(c, y)) {
+        generic = fmt("%s(%s, %s)", fn, a, b);
+    } else {
+        int ta = ++c->ntemps;
+        int tb = ++c->ntemps;
+        generic = fmt("(t%d = %s, t%d = %s, %s(t%d, t%d))", ta, a, tb, b, fn, ta, tb);
+    }
+    free(a);
+    free(b);
+
+    int fast_arith = (strcmp(sym, "+") == 0 || strcmp(sym, "-") == 0 || strcmp(sym, "*") == 0);
+    if ((fast_arith || cmp) && c->params_const >= 0 && int_tree(c, x) && int_tree(c, y)) {
+        char *guard = int_guard(c, x, y);
+        char *ux = unboxed(c, x);
+        char *uy = unboxed(c, y);
+        CExpr out;
+        if (cmp) {
+            out = boolean(fmt("((%s) ? (%s %s %s) : !isnil(%s))", guard, ux, cmp, uy, generic));
+        } else {
+            out = boxed(fmt("((%s) ? create_int(%s %s %s) : %s)", guard, ux, sym, uy, generic));
+        }
+        free(guard);
+        free(ux);
+        free(uy);
+        free(generic);
+        return out;
+    }
+
+    if (cmp) {
+        CExpr out = boolean(fmt("!isnil(%s)", generic));
+        free(generic);
+        return out;
+    }
+    return boxed(generic);
+}
+
+static CExpr compile_if(Compiler *c, sExpr *args) {
+    char *test = truth(compile_expr(c, car(args)));
+    char *then_branch = box(compile_expr(c, car(cdr(args))));
+    char *else_branch = box(compile_expr(c, car(cdr(cdr(args)))));
+    CExpr out = boxed(fmt("((%s) ? %s : %s)", test, then_branch, else_branch));
+    free(test);
+    free(then_branch);
+    free(else_branch);
+    return out;
+}
+
+static CExpr compile_cond(Compiler *c, sExpr *clauses) {
+    if (isnil(clauses)) return boxed(strdup("NIL"));
+
+    // A 't style default clause needs no test
+    sExpr *test_form = car(car(clauses));
+    if (is_call_to(test_form, "quote") && !isnil(car(cdr(test_form)))) {
+        return compile_expr(c, car(cdr(car(clauses))));
+    }
+
+    char *test = truth(compile_expr(c, car(car(clauses))));
+    char *result = box(compile_expr(c, car(cdr(car(clauses)))));
+    char *rest = box(compile_cond(c, cdr(clauses)));
+    CExpr out = boxed(fmt("((%s) ? %s : %s)", test, result, rest));
+    free(test);
+    free(result);
+    free(rest);
+    return out;
+}
+
+// (and a b c): value of c, or NIL as soon as one is NIL
+static CExpr compile_and(Compiler *c, sExpr *args) {
+    if (isnil(args)) return boxed(strdup("NIL"));
+    int t = ++c->ntemps;
+    char *first = box(compile_expr(c, car(args)));
+    char *out;
+    if (isnil(cdr(args))) {
+        out = fmt("(t%d = %s, isnil(t%d) ? NIL : t%d)", t, first, t, t);
+    } else {
+        char *rest = box(compile_and(c, cdr(args)));
+        out = fmt("(t%d = %s, isnil(t%d) ? NIL : %s)", t, first, t, rest);
+        free(rest);
+    }
+    free(first);
+    return boxed(out);
+}
+
+static CExpr compile_or(Compiler *c, sExpr *args) {
+    StringBuilder *b = builder_new();
+    builder_append(b, "(0", 2);
+    for (; !isnil(args); args = cdr(args)) {
+        char *t = truth(compile_expr(c, car(args)));
+        emit(b, " || %s", t);
+        free(t);
+    }
+    builder_append(b, ")", 1);
+    size_t len;
+    CExpr out = boolean(strdup(builder_data(b, &len)));
+    free_builder(b);
+    return out;
+}
+
+// Arguments go into temporaries first so they're evaluated left to right
+static CExpr compile_call(Compiler *c, CFunction *fn, sExpr *args) {
+    StringBuilder *b = builder_new();
+    StringBuilder *call = builder_new();
+    builder_append(b, "(", 1);
+    emit(call, "yf%d(", fn->id);
+
+    int i = 0;
+    for (; !isnil(args); args = cdr(args), i++) {
+        int t = ++c->ntemps;
+        char *a = box(compile_expr(c, car(args)));
+        emit(b, "t%d = %s, ", t, a);
+        emit(call, "%st%d", i ? ", " : "", t);
+        free(a);
+    }
+    builder_append(call, ")", 1);
+
+    size_t len;
+    emit(b, "%s)", builder_data(call, &len));
+    CExpr out = boxed(strdup(builder_data(b, &len)));
+    free_builder(b);
+    free_builder(call);
+    return out;
+}
+
+static CExpr compile_expr(Compiler *c, sExpr *expr) {
+    switch (type_of(expr)) {
+        case TYPE_NIL:
+            return boxed(strdup("NIL"));
+        case TYPE_SYMBOL: {
+            int i = param_index(c, expr);
+            if (i >= 0) return boxed(fmt("get_local(%d)", i));
+            return boxed(fmt("eval(K[%d])", add_const(c, expr)));
+        }
+        case TYPE_CONS:
+            break;
+        default:
+            return boxed(fmt("K[%d]", add_const(c, expr)));
+    }
+
+    sExpr *macro = macro_for_call(expr);
+    if (macro) return compile_expr(c, macroexpand(expr));
+
+    sExpr *head = car(expr);
+    sExpr *args = cdr(expr);
+    if (!issymbol(head)) return fallback(c, expr);
+    const char *sym = head->value.symbol;
+    int nargs = list_length(args);
+
+    if (strcmp(sym, "quote") == 0) return boxed(fmt("K[%d]", add_const(c, car(args))));
+    if (strcmp(sym, "if") == 0) return compile_if(c, args);
+    if (strcmp(sym, "cond") == 0) return compile_cond(c, args);
+    if (strcmp(sym, "and") == 0) return compile_and(c, args);
+    if (strcmp(sym, "or") == 0) return compile_or(c, args);
+    if (strcmp(sym, "not") == 0) {
+        char *a = box(compile_expr(c, car(args)));
+        CExpr out = boolean(fmt("(%s == NIL)", a));
+        free(a);
+        return out;
+    }
+    if (strcmp(sym, "set") == 0) {
+        // A parameter or let variable of a call in progress first, as in eval
+        int t = ++c->ntemps;
+        int k = add_const(c, car(args));
+        char *v = box(compile_expr(c, car(cdr(args))));
+        CExpr out = boxed(fmt("(t%d = %s, assign_local(K[%d], t%d) ? t%d : set(K[%d], t%d))",
+                              t, v, k, t, t, k, t));
+        free(v);
+        return out;
+    }
+    if (binary_runtime(sym) && nargs == 2) return compile_binary(c, sym, args);
+
+    CFunction *fn = param_index(c, head) < 0 ? find_fn(c, head) : NULL;
+    if (fn && fn->arity == nargs) return compile_call(c, fn, args);
+
+    return fallback(c, expr);
+}
+
+// --- Driver ---
+
+static int is_function_define(sExpr *form) {
+    return is_call_to(form, "define") && issymbol(car(cdr(form))) &&
+           is_call_to(car(cdr(cdr(form))), "lambda");
+}
+
+// Names assigned more than once can change at run time, so they aren't
+// compiled into direct calls
+static int bound_once(sExpr *forms, sExpr *name) {
+    int count = 0;
+    for (; !isnil(forms); forms = cdr(forms)) {
+        sExpr *form = car(forms);
+        if ((is_call_to(form, "define") || is_call_to(form, "set") || is_call_to(form, "defmacro")) &&
+            issymbol(car(cdr(form))) && strcmp(car(cdr(form))->value.symbol, name->value.symbol) == 0) {
+            count++;
+        }
+    }
+    return count == 1;
+}
+
+static void emit_function(Compiler *c, StringBuilder *out, CFunction *fn) {
+    c->params = fn->params;
+    c->params_const = add_const(c, fn->params);
+    c->ntemps = 0;
+    char *body = box(compile_expr(c, car(cdr(cdr(fn->lambda)))));
+
+    emit(out, "// %s\nstatic sExpr *yf%d(", fn->name, fn->id);
+    for (int i = 0; i < fn->arity; i++) emit(out, "%ssExpr *a%d", i ? ", " : "", i);
+    emit(out, "%s) {\n", fn->arity ? "" : "void");
+    if (c->ntemps) {
+        emit(out, "    sExpr ");
+        for (int i = 1; i <= c->ntemps; i++) emit(out, "%s*t%d", i > 1 ? ", " : "", i);
+        emit(out, ";\n");
+    }
+    if (fn->arity == 0) {
+        emit(out, "    return %s;\n}\n\n", body);
+        free(body);
+        return;
+    }
+    emit(out, "    open_frame(K[%d], %d);\n", c->params_const, fn->arity);
+    for (int i = 0; i < fn->arity; i++) emit(out, "    bind_local(a%d);\n", i);
+    emit(out, "    sExpr *result = %s;\n    pop_env();\n    return result;\n}\n\n", body);
+    free(body);
+}
+
+int compile_to_c(const char *src_path, const char *out_path) {
+    sExpr *forms = load_forms(src_path, 0);
+    if (!forms) {
+        fprintf(stderr, "Bad file: %s\n", src_path);
+        return -1;
+    }
+
+    Compiler c = {0};
+    c.consts = builder_new();
+    c.params = NIL;
+    c.params_const = -1;
+
+    // Macros and definitions are evaluated now so macro calls can be
+    // expanded at compile time
+    int nforms = list_length(forms);
+    c.fns = calloc((size_t)nforms + 1, sizeof(CFunction));
+    for (sExpr *it = forms; !isnil(it); it = cdr(it)) {
+        sExpr *form = car(it);
+        if (is_call_to(form, "defmacro") || is_call_to(form, "define")) eval(form);
+        if (is_function_define(form) && bound_once(forms, car(cdr(form)))) {
+            CFunction *fn = &c.fns[c.nfns];
+            fn->name = car(cdr(form))->value.symbol;
+            fn->lambda = optimize(car(cdr(cdr(form))));
+            fn->params = car(cdr(fn->lambda));
+            fn->arity = list_length(fn->params);
+            fn->id = c.nfns++;
+        }
+    }
+
+    StringBuilder *fns = builder_new();
+    c.known_fns = c.nfns;
+    for (int i = 0; i < c.nfns; i++) emit_function(&c, fns, &c.fns[i]);
+
+    // Top-level forms run in order; a function can be called directly only
+    // once its define has run
+    StringBuilder *body = builder_new();
+    c.params = NIL;
+    c.params_const = -1;
+    c.ntemps = 0;
+    c.known_fns = 0;
+    int next_fn = 0;
+    for (sExpr *it = forms; !isnil(it); it = cdr(it)) {
+        sExpr *form = optimize(car(it));
+        char *code;
+        if (next_fn < c.nfns && is_function_define(form) &&
+            strcmp(car(cdr(form))->value.symbol, c.fns[next_fn].name) == 0) {
+            CFunction *fn = &c.fns[next_fn++];
+            int name = add_const(&c, car(cdr(form)));
+            int lambda = add_const(&c, fn->lambda);
+            code = fmt("set(K[%d], K[%d])", name, lambda);
+            c.known_fns = next_fn;
+        } else {
+            code = box(compile_expr(&c, form));
+        }
+        emit(body, "    print_sExpr(%s);\n    printf(\"\\n\");\n", code);
+        free(code);
+    }
+
+    FILE *f = fopen(out_path, "w");
+    if (!f) {
+        fprintf(stderr, "Cannot write %s\n", out_path);
+        return -1;
+    }
+
+    size_t len;
+    fprintf(f, "// Generated by yisp --compile-c from %s\n", src_path);
+    fprintf(f, "#include <stdio.h>\n#include <stdlib.h>\n#include <string.h>\n#include \"sexpr.h\"\n\n");
+    fprintf(f, "static sExpr *K[%d];\n\n", c.nconsts ? c.nconsts : 1);
+    for (int i = 0; i < c.nfns; i++) {
+        fprintf(f, "static sExpr *yf%d(", i);
+        for (int j = 0; j < c.fns[i].arity; j++) fprintf(f, "%ssExpr *", j ? ", " : "");
+        fprintf(f, "%s);\n", c.fns[i].arity ? "" : "void");
+    }
+    fprintf(f, "\n%s", builder_data(fns, &len));
+    fprintf(f, "static void init_constants(void) {\n%s}\n\n", builder_data(c.consts, &len));
+    fprintf(f, "int main(void) {\n");
+    fprintf(f, "    NIL = malloc(sizeof(sExpr));\n    NIL->type = TYPE_NIL;\n\n");
+    fprintf(f, "    TRUE = malloc(sizeof(sExpr));\n    TRUE->type = TYPE_SYMBOL;\n");
+    fprintf(f, "    TRUE->value.symbol = strdup(\"t\");\n\n");
+    fprintf(f, "    global_env = create_env();\n    init_constants();\n\n");
+    if (c.ntemps) {
+        fprintf(f, "    sExpr ");
+        for (int i = 1; i <= c.ntemps; i++) fprintf(f, "%s*t%d", i > 1 ? ", " : "", i);
+        fprintf(f, ";\n");
+    }
+    fprintf(f, "%s    return 0;\n}\n", builder_data(body, &len));
+
+    free_builder(fns);
+    free_builder(body);
+    free_builder(c.consts);
+    free(c.fns);
+    return fclose(f) == 0 ? 0 : -1;
+}
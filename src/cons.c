@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "sexpr.h"
+
+// Cons cells
+//
+// A cons is only its car and cdr: two words, 16 bytes, with no type field.
+// sExpr puts value before type, so a cons cell has the layout of the front
+// of a full sExpr and ->value.cons works on it unchanged. The type comes
+// from where the cell lives instead: every compact cell is allocated in one
+// large reserved region, and type_of() answers TYPE_CONS for any address in
+// it with a single compare. Types must therefore be read with type_of(),
+// never ->type.
+//
+// Each thread (the batch reader parses on its own) claims chunks of the
+// region and hands out cells from them in address order, so cells made one
+// after another, like the spine of a list being read or built, sit next to
+// each other in memory. Freed cells go on a per-thread free list. The region
+// is only reserved, so untouched parts cost nothing. If it can't be reserved
+// or fills up, cons falls back to full-size cells, which carry their own
+// type like any other value.
+
+#define REGION_SIZE ((size_t)1 << 36)
+#define CHUNK_SIZE ((size_t)1 << 16)
+#define CELL_SIZE sizeof(((sExpr *)0)->value)
+
+char *cons_region = NULL;
+size_t cons_region_size = 0;
+
+static pthread_once_t reserved = PTHREAD_ONCE_INIT;
+static _Atomic size_t claimed = 0;         // bytes of the region handed to threads
+static _Thread_local char *next_cell = NULL;
+static _Thread_local char *chunk_end = NULL;
+static _Thread_local sExpr *free_cells = NULL;  // linked through car
+
+static void reserve(void) {
+    // Ask for less if the address space is limited
+    for (size_t size = REGION_SIZE; size >= CHUNK_SIZE << 4; size >>= 2) {
+        void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (mem != MAP_FAILED) {
+            cons_region = mem;
+            cons_region_size = size;
+            return;
+        }
+    }
+}
+
+static sExpr *full_cell(void) {
+    sExpr *e = malloc(sizeof(sExpr));
+    e->type = TYPE_CONS;
+    allocated_bytes += sizeof(sExpr);
+    return e;
+}
+
+// Claims a new chunk and takes its first cell
+static sExpr *refill(void) {
+    pthread_once(&reserved, reserve);
+    size_t offset = atomic_fetch_add(&claimed, CHUNK_SIZE);
+    if (!cons_region || offset + CHUNK_SIZE > cons_region_size) return full_cell();
+    next_cell = cons_region + offset + CELL_SIZE;
+    chunk_end = cons_region + offset + CHUNK_SIZE;
+    allocated_bytes += CELL_SIZE;
+    return (sExpr *)(cons_region + offset);
+}
+
+sExpr *alloc_cons(void) {
+    sExpr *e;
+    if (free_cells) {
+        e = free_cells;
+        free_cells = e->value.cons.car;
+    } else if (next_cell < chunk_end) {
+        e = (sExpr *)next_cell;
+        next_cell += CELL_SIZE;
+    } else {
+        return refill();
+    }
+    allocated_bytes += CELL_SIZE;
+    return e;
+}
+
+// Frees the cell of any value (not what it points to)
+void free_cell(sExpr *e) {
+    if (!is_compact_cons(e)) {
+        free(e);
+        return;
+    }
+    e->value.cons.car = free_cells;
+    free_cells = e;
+}
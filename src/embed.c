@@ -0,0 +1,229 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sexpr.h"
+#include "libyisp.h"
+
+// Embedding API (see libyisp.h) and native functions
+//
+// A C function registered by the host is a value of type TYPE_NATIVE bound
+// to its name in the global environment, so Lisp finds and calls it the way
+// it finds a lambda. A function handle caches what its name was bound to
+// and, like a quickened call site, looks the name up again only once
+// global_epoch says some global function was redefined. Calling it copies
+// the arguments into a slot frame and runs the body: no cons cells, no
+// parsing, no name lookup.
+
+struct Native {
+    NativeFn fn;
+    void *ctx;
+    char *name;
+};
+
+struct yisp_function {
+    sExpr *name;
+    sExpr *fn;          // lambda or native, NULL if name isn't a function now
+    long epoch;         // global_epoch when fn was looked up
+};
+
+#define NATIVE_ARGS 8
+
+static const char *last_error = NULL;
+
+sExpr *create_native(const char *name, NativeFn fn, void *ctx) {
+    Native *n = malloc(sizeof(Native));
+    n->fn = fn;
+    n->ctx = ctx;
+    n->name = strdup(name);
+    sExpr *e = alloc_sExpr(TYPE_NATIVE);
+    e->value.native = n;
+    return e;
+}
+
+const char *native_name(Native *n) {
+    return n->name;
+}
+
+void free_native(Native *n) {
+    free(n->name);
+    free(n);
+}
+
+sExpr *apply_native(sExpr *native, sExpr **args, int n) {
+    Native *f = native->value.native;
+    sExpr *result = f->fn(args, n, f->ctx);
+    return result ? result : NIL;
+}
+
+// Evaluates the arguments of a call and passes their values to native
+sExpr *call_native(sExpr *native, sExpr *arg_forms) {
+    sExpr *small[NATIVE_ARGS];
+    int n = 0;
+    for (sExpr *a = arg_forms; type_of(a) == TYPE_CONS; a = cdr(a)) n++;
+    sExpr **args = n <= NATIVE_ARGS ? small : malloc(sizeof(sExpr *) * n);
+    int i = 0;
+    for (sExpr *a = arg_forms; type_of(a) == TYPE_CONS; a = cdr(a)) args[i++] = eval(car(a));
+    sExpr *result = apply_native(native, args, n);
+    if (args != small) free(args);
+    return result;
+}
+
+// The interpreter
+
+int yisp_init(void) {
+    if (NIL) return 0;
+    NIL = malloc(sizeof(sExpr));
+    NIL->type = TYPE_NIL;
+
+    TRUE = malloc(sizeof(sExpr));
+    TRUE->type = TYPE_SYMBOL;
+    TRUE->value.symbol = strdup("t");
+
+    global_env = create_env();
+    return 0;
+}
+
+static sExpr *eval_forms(sExpr *forms) {
+    sExpr *result = NIL;
+    last_error = NULL;
+    for (; !isnil(forms); forms = cdr(forms)) {
+        result = eval_bounded(optimize_toplevel(car(forms)), &last_error);
+        if (!result) return NULL;
+    }
+    return result;
+}
+
+yisp_value *yisp_eval(const char *source) {
+    return eval_forms(parse_forms(source));
+}
+
+yisp_value *yisp_load(const char *path) {
+    sExpr *forms = load_forms(path, 1);
+    if (!forms) {
+        last_error = "cannot read file";
+        return NULL;
+    }
+    return eval_forms(forms);
+}
+
+const char *yisp_error(void) {
+    return last_error;
+}
+
+// Function handles
+
+static sExpr *function_value(sExpr *name) {
+    sExpr *v = lookup(name);
+    return islambda(v) || type_of(v) == TYPE_NATIVE ? v : NULL;
+}
+
+yisp_function *yisp_function_get(const char *name) {
+    sExpr *sym = create_symbol(name);
+    sExpr *fn = function_value(sym);
+    if (!fn) {
+        free_sExpr(sym);
+        return NULL;
+    }
+    yisp_function *f = malloc(sizeof(yisp_function));
+    f->name = sym;
+    f->fn = fn;
+    f->epoch = global_epoch;
+    return f;
+}
+
+void yisp_function_free(yisp_function *fn) {
+    free_sExpr(fn->name);
+    free(fn);
+}
+
+yisp_value *yisp_call(yisp_function *fn, yisp_value **args, int nargs) {
+    if (fn->epoch != global_epoch) {
+        fn->fn = function_value(fn->name);
+        fn->epoch = global_epoch;
+    }
+    if (!fn->fn) return NULL;
+    return apply_values(fn->fn, args, nargs);
+}
+
+int yisp_register(const char *name, yisp_native fn, void *ctx) {
+    set(create_symbol(name), create_native(name, fn, ctx));
+    return 0;
+}
+
+// Values
+
+yisp_value *yisp_nil(void) {
+    return NIL;
+}
+
+yisp_value *yisp_true(void) {
+    return TRUE;
+}
+
+yisp_value *yisp_from_long(long value) {
+    return create_int(value);
+}
+
+yisp_value *yisp_from_double(double value) {
+    return create_double(value);
+}
+
+yisp_value *yisp_from_string(const char *value) {
+    return create_string(value);
+}
+
+yisp_value *yisp_symbol(const char *name) {
+    return create_symbol(name);
+}
+
+yisp_value *yisp_cons(yisp_value *car, yisp_value *cdr) {
+    return cons(car, cdr);
+}
+
+yisp_type yisp_type_of(yisp_value *v) {
+    switch (type_of(v)) {
+        case TYPE_NIL: return YISP_NIL;
+        case TYPE_INT: return YISP_INT;
+        case TYPE_DOUBLE: return YISP_DOUBLE;
+        case TYPE_STRING: return YISP_STRING;
+        case TYPE_SYMBOL: return YISP_SYMBOL;
+        case TYPE_CONS: return YISP_LIST;
+        default: return YISP_OTHER;
+    }
+}
+
+int yisp_is_true(yisp_value *v) {
+    return sExpr_to_bool(v);
+}
+
+int yisp_to_long(yisp_value *v, long *out) {
+    if (type_of(v) != TYPE_INT) return -1;
+    *out = v->value.integer;
+    return 0;
+}
+
+int yisp_to_double(yisp_value *v, double *out) {
+    if (type_of(v) == TYPE_INT) *out = (double)v->value.integer;
+    else if (type_of(v) == TYPE_DOUBLE) *out = v->value.dbl;
+    else return -1;
+    return 0;
+}
+
+int yisp_to_string(yisp_value *v, const char **out) {
+    if (type_of(v) == TYPE_STRING) *out = v->value.string;
+    else if (type_of(v) == TYPE_SYMBOL) *out = v->value.symbol;
+    else return -1;
+    return 0;
+}
+
+yisp_value *yisp_car(yisp_value *v) {
+    return car(v);
+}
+
+yisp_value *yisp_cdr(yisp_value *v) {
+    return cdr(v);
+}
+
+void yisp_print(yisp_value *v) {
+    print_sExpr(v);
+}
@@ -0,0 +1,194 @@
+// The context switches below longjmp between stacks, which the fortified
+// longjmp rejects as jumping into an unused frame
+#undef _FORTIFY_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "sexpr.h"
+
+// Generators
+//
+// (make-generator f) makes a coroutine that calls (f yield) the first time
+// it is resumed with (next gen). Calling (yield v) in f suspends it and makes
+// next return v; the following next resumes it where it stopped. When f
+// returns, next returns () from then on.
+//
+// Each generator runs on its own C stack and its own EvalStack of call
+// frames, so a suspended generator keeps its frames while the caller keeps
+// pushing and popping its own. The C stack is reserved up front but backed by
+// memory only as it is touched, so it costs a few pages until it's used
+// deeply, with a guard page below it. Stacks of finished generators are kept
+// for reuse, since faulting in fresh pages costs more than everything else
+// a short-lived generator does. makecontext is only used to start the
+// generator; switches after that are _setjmp/_longjmp, which don't save the
+// signal mask and so don't make a system call.
+//
+// Parameters of the calls in progress that f mentions are captured when the
+// generator is made, as for delay.
+
+#define GEN_STACK_SIZE (8 << 20)
+#define SPARE_STACKS 16
+
+typedef enum { GEN_NEW, GEN_SUSPENDED, GEN_RUNNING, GEN_DONE } GenState;
+
+struct Generator {
+    sExpr *self;            // the generator value, passed to f as yield
+    sExpr *fn;
+    sExpr *params;          // captured bindings for fn
+    sExpr *values;
+    GenState state;
+    sExpr *transfer;        // value passed by yield
+    EvalStack *frames;
+    EvalStack *caller_frames;
+    Generator *outer;       // generator that resumed this one, if any
+    char *cstack;           // mapping, including the guard page
+    ucontext_t start;
+    jmp_buf self_jb;        // where the generator is suspended
+    jmp_buf caller_jb;      // where next was called
+};
+
+static Generator *running = NULL;   // innermost generator being run
+static long page_size = 0;
+static char *spare_stacks[SPARE_STACKS];
+static int nspare = 0;
+
+// Lowest usable address of the running generator's C stack, or NULL when
+// none is running
+char *generator_stack_low(void) {
+    return running && running->cstack ? running->cstack + page_size : NULL;
+}
+
+sExpr *make_generator(sExpr *fn) {
+    Generator *g = calloc(1, sizeof(Generator));
+    g->fn = fn;
+    g->params = NIL;
+    g->values = NIL;
+    capture_locals(fn, &g->params, &g->values);
+    g->state = GEN_NEW;
+    g->transfer = NIL;
+
+    sExpr *e = alloc_sExpr(TYPE_GENERATOR);
+    e->value.generator = g;
+    g->self = e;
+    return e;
+}
+
+// Releases the stacks of a generator that won't run again. Must not be
+// called while running on g's own C stack.
+static void finish(Generator *g) {
+    g->state = GEN_DONE;
+    if (g->cstack && nspare < SPARE_STACKS) spare_stacks[nspare++] = g->cstack;
+    else if (g->cstack) munmap(g->cstack, GEN_STACK_SIZE + page_size);
+    if (g->frames) eval_stack_free(g->frames);
+    g->cstack = NULL;
+    g->frames = NULL;
+    g->fn = g->params = g->values = NIL;
+}
+
+void free_generator(Generator *g) {
+    if (g->state == GEN_RUNNING) return; // still on its stack
+    finish(g);
+    free(g);
+}
+
+int generator_done(sExpr *gen) {
+    return type_of(gen) != TYPE_GENERATOR || gen->value.generator->state == GEN_DONE;
+}
+
+// Entry point on the generator's own stack
+static void generator_main(void) {
+    Generator *g = running;
+    if (!isnil(g->params)) push_env(g->params, g->values);
+    apply_values(g->fn, &g->self, 1);
+
+    g->state = GEN_DONE;
+    g->transfer = NIL;
+    _longjmp(g->caller_jb, 1);
+}
+
+static char *new_stack(void) {
+    if (nspare > 0) return spare_stacks[--nspare];
+    if (!page_size) page_size = sysconf(_SC_PAGESIZE);
+    char *mem = mmap(NULL, GEN_STACK_SIZE + page_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem == MAP_FAILED) return NULL;
+    mprotect(mem, page_size, PROT_NONE);  // stacks grow down into the guard
+    return mem;
+}
+
+static int start(Generator *g) {
+    char *mem = new_stack();
+    if (!mem) return -1;
+    g->cstack = mem;
+    g->frames = eval_stack_new();
+
+    getcontext(&g->start);
+    g->start.uc_stack.ss_sp = mem + page_size;
+    g->start.uc_stack.ss_size = GEN_STACK_SIZE;
+    g->start.uc_link = NULL;
+    makecontext(&g->start, generator_main, 0);
+    return 0;
+}
+
+// Runs gen until it yields or returns; the yielded value, or () once done
+sExpr *generator_next(sExpr *gen) {
+    if (type_of(gen) != TYPE_GENERATOR) return NIL;
+    Generator *g = gen->value.generator;
+    if (g->state == GEN_DONE) return NIL;
+    if (g->state == GEN_RUNNING) {
+        printf("next: generator is already running\n");
+        return NIL;
+    }
+    if (g->state == GEN_NEW && start(g) < 0) {
+        printf("next: cannot allocate a generator stack\n");
+        finish(g);
+        return NIL;
+    }
+
+    GenState was = g->state;
+    g->state = GEN_RUNNING;
+    g->outer = running;
+    running = g;
+    g->caller_frames = eval_stack_switch(g->frames);
+
+    if (_setjmp(g->caller_jb) == 0) {
+        if (was == GEN_NEW) setcontext(&g->start);
+        else _longjmp(g->self_jb, 1);
+    }
+
+    // Back from a yield, or from the end of fn
+    running = g->outer;
+    eval_stack_switch(g->caller_frames);
+    sExpr *value = g->transfer;
+    g->transfer = NIL;
+    if (g->state == GEN_DONE) finish(g);
+    return value;
+}
+
+// Suspends gen, which must be the generator running, and hands value to next
+sExpr *generator_yield(sExpr *gen, sExpr *value) {
+    Generator *g = gen->value.generator;
+    if (g != running) {
+        printf("yield: not inside this generator\n");
+        return NIL;
+    }
+    g->transfer = value;
+    g->state = GEN_SUSPENDED;
+    if (_setjmp(g->self_jb) == 0) _longjmp(g->caller_jb, 1);
+    return NIL;
+}
+
+// An evaluation budget ran out and unwound past every running generator,
+// whose C stacks now hold nothing; they end as if they had returned
+void generators_unwind(void) {
+    while (running) {
+        Generator *g = running;
+        running = g->outer;
+        g->transfer = NIL;
+        finish(g);
+    }
+}
@@ -0,0 +1,255 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "sexpr.h"
+
+// Hash tables
+//
+// Open addressing with linear probing, keyed by eq: numbers compare by value
+// (so 10 and 10.0 are the same key), strings and symbols by text. Growing
+// doesn't rehash everything at once; the old bucket array is kept and a few of
+// its buckets are moved over on every operation until it is empty.
+
+#define MIN_CAPACITY 8
+#define MIGRATE_STEP 8
+
+typedef struct {
+    sExpr *key;     // NULL = never used, TOMBSTONE = removed
+    sExpr *value;
+} HashEntry;
+
+struct HashTable {
+    HashEntry *entries;
+    size_t cap;
+    size_t used;        // live entries + tombstones in entries
+    size_t count;       // live entries in both arrays
+    HashEntry *old;     // array being migrated away from, or NULL
+    size_t old_cap;
+    size_t old_live;    // live entries still in old
+    size_t migrated;    // buckets of old already moved
+};
+
+static sExpr tombstone;
+#define TOMBSTONE (&tombstone)
+
+static uint64_t mix(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    return x;
+}
+
+// Hash consistent with eq(). Returns 0 and leaves *out alone for values eq
+// can never match (conses, tables), which therefore can't be keys.
+int hash_key(sExpr *key, uint64_t *out) {
+    switch (type_of(key)) {
+        case TYPE_INT:
+            *out = mix((uint64_t)key->value.integer);
+            return 1;
+        case TYPE_DOUBLE: {
+            double d = key->value.dbl;
+            if (d > -9.2e18 && d < 9.2e18 && d == (double)(long)d) {
+                *out = mix((uint64_t)(long)d); // same bucket as the equal int
+            } else {
+                uint64_t bits;
+                memcpy(&bits, &d, sizeof(bits));
+                *out = mix(bits);
+            }
+            return 1;
+        }
+        case TYPE_STRING:
+            *out = string_hash(key);
+            return 1;
+        case TYPE_SYMBOL:
+            *out = fnv1a(FNV_INIT ^ 2, key->value.symbol, strlen(key->value.symbol));
+            return 1;
+        case TYPE_NIL:
+            *out = 0;
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static int same_key(sExpr *a, sExpr *b) {
+    return a == b || sExpr_to_bool(eq(a, b));
+}
+
+// Slot holding key, or NULL
+static HashEntry *find(HashEntry *entries, size_t cap, sExpr *key, uint64_t h) {
+    if (!entries) return NULL;
+    size_t i = h & (cap - 1);
+    while (entries[i].key) {
+        if (entries[i].key != TOMBSTONE && same_key(entries[i].key, key)) {
+            return &entries[i];
+        }
+        i = (i + 1) & (cap - 1);
+    }
+    return NULL;
+}
+
+// Stores into the first free slot; the caller has checked key is absent
+static void place(HashEntry *entries, size_t cap, sExpr *key, sExpr *value, uint64_t h) {
+    size_t i = h & (cap - 1);
+    while (entries[i].key && entries[i].key != TOMBSTONE) i = (i + 1) & (cap - 1);
+    entries[i].key = key;
+    entries[i].value = value;
+}
+
+static void migrate(HashTable *t, size_t steps) {
+    while (t->old && steps--) {
+        HashEntry *e = &t->old[t->migrated++];
+        if (e->key && e->key != TOMBSTONE) {
+            uint64_t h;
+            hash_key(e->key, &h);
+            place(t->entries, t->cap, e->key, e->value, h);
+            t->used++;
+            t->old_live--;
+            e->key = TOMBSTONE;  // lookups and hash_each still read old
+        }
+        if (t->migrated == t->old_cap) {
+            free(t->old);
+            t->old = NULL;
+            t->old_cap = t->old_live = t->migrated = 0;
+        }
+    }
+}
+
+// Starts moving to a fresh array sized for the live entries. Tombstones are
+// dropped along the way.
+static void start_resize(HashTable *t) {
+    migrate(t, (size_t)-1); // finish any previous resize first
+
+    size_t cap = MIN_CAPACITY;
+    while (cap < (t->count + 1) * 2) cap *= 2;
+
+    t->old = t->entries;
+    t->old_cap = t->cap;
+    t->old_live = t->count;
+    t->migrated = 0;
+    t->entries = calloc(cap, sizeof(HashEntry));
+    t->cap = cap;
+    t->used = 0;
+}
+
+HashTable *hash_new(size_t capacity) {
+    HashTable *t = calloc(1, sizeof(HashTable));
+    size_t cap = MIN_CAPACITY;
+    while (cap < capacity * 2) cap *= 2;
+    t->entries = calloc(cap, sizeof(HashEntry));
+    t->cap = cap;
+    return t;
+}
+
+void hash_free(HashTable *t) {
+    free(t->entries);
+    free(t->old);
+    free(t);
+}
+
+sExpr *hash_get(HashTable *t, sExpr *key) {
+    uint64_t h;
+    if (!hash_key(key, &h)) return NULL;
+    migrate(t, MIGRATE_STEP);
+
+    HashEntry *e = find(t->entries, t->cap, key, h);
+    if (!e) e = find(t->old, t->old_cap, key, h);
+    return e ? e->value : NULL;
+}
+
+int hash_set(HashTable *t, sExpr *key, sExpr *value) {
+    uint64_t h;
+    if (!hash_key(key, &h)) return -1;
+    migrate(t, MIGRATE_STEP);
+
+    HashEntry *e = find(t->entries, t->cap, key, h);
+    if (e) {
+        e->value = value;
+        return 0;
+    }
+
+    // Still in the old array: take it out so the key lives in one place
+    e = find(t->old, t->old_cap, key, h);
+    if (e) {
+        e->key = TOMBSTONE;
+        t->count--;
+        t->old_live--;
+    }
+
+    // Entries still in old will be placed here too, so they count
+    if ((t->used + t->old_live + 1) * 4 > t->cap * 3) start_resize(t);
+    place(t->entries, t->cap, key, value, h);
+    t->used++;
+    t->count++;
+    return 0;
+}
+
+int hash_remove(HashTable *t, sExpr *key) {
+    uint64_t h;
+    if (!hash_key(key, &h)) return 0;
+    migrate(t, MIGRATE_STEP);
+
+    HashEntry *e = find(t->entries, t->cap, key, h);
+    if (!e) {
+        e = find(t->old, t->old_cap, key, h);
+        if (e) t->old_live--;
+    }
+    if (!e) return 0;
+
+    e->key = TOMBSTONE;
+    e->value = NULL;
+    t->count--;
+    return 1;
+}
+
+size_t hash_count(HashTable *t) {
+    return t->count;
+}
+
+// Calls fn on every live entry, in no particular order
+void hash_each(HashTable *t, void (*fn)(sExpr *key, sExpr *value, void *ctx), void *ctx) {
+    HashEntry *arrays[2] = { t->entries, t->old };
+    size_t caps[2] = { t->cap, t->old_cap };
+    for (int a = 0; a < 2; a++) {
+        for (size_t i = 0; arrays[a] && i < caps[a]; i++) {
+            HashEntry *e = &arrays[a][i];
+            if (e->key && e->key != TOMBSTONE) fn(e->key, e->value, ctx);
+        }
+    }
+}
+
+static void push_key(sExpr *key, sExpr *value, void *ctx) {
+    (void)value;
+    sExpr **list = ctx;
+    *list = cons(key, *list);
+}
+
+sExpr *hash_keys(HashTable *t) {
+    sExpr *keys = NIL;
+    hash_each(t, push_key, &keys);
+    return keys;
+}
+
+sExpr *create_hash(size_t capacity) {
+    sExpr *e = alloc_sExpr(TYPE_HASH);
+    e->value.hash = hash_new(capacity);
+    return e;
+}
+
+static void print_entry(sExpr *key, sExpr *value, void *ctx) {
+    int *first = ctx;
+    printf(*first ? "(" : " (");
+    print_sExpr(key);
+    printf(" . ");
+    print_sExpr(value);
+    printf(")");
+    *first = 0;
+}
+
+void print_hash(HashTable *t) {
+    int first = 1;
+    printf("#hash(");
+    hash_each(t, print_entry, &first);
+    printf(")");
+}
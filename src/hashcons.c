@@ -0,0 +1,273 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "sexpr.h"
+
+// Hash-consing
+//
+// (hash-cons x) returns the canonical copy of x: structurally equal trees
+// of numbers, strings, symbols and conses all come back as the same object.
+// With --hash-cons the reader does this to everything it parses, so
+// repeated sublists and atoms in a data file are stored once.
+//
+// Canonical trees are shared and must be treated as immutable. free_sExpr
+// leaves them alone, and macro calls inside them are expanded without being
+// cached in place. The interpreter doesn't reclaim anything, so the table
+// never has anything to drop and simply keeps its entries.
+
+int hash_cons_reader = 0;
+
+static struct {
+    sExpr **slots;
+    size_t cap;
+    size_t count;
+} table;
+
+static uint64_t mix(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    return x;
+}
+
+static int consable(sExpr *e) {
+    switch (type_of(e)) {
+        case TYPE_INT: case TYPE_DOUBLE: case TYPE_STRING:
+        case TYPE_SYMBOL: case TYPE_CONS:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// Conses are hashed by the addresses of their (already canonical) children
+static uint64_t node_hash(sExpr *e) {
+    uint64_t bits;
+    switch (type_of(e)) {
+        case TYPE_INT:
+            return mix((uint64_t)e->value.integer);
+        case TYPE_DOUBLE:
+            memcpy(&bits, &e->value.dbl, sizeof(bits));
+            return mix(bits ^ 1);
+        case TYPE_STRING:
+            return string_hash(e);
+        case TYPE_SYMBOL:
+            return fnv1a(FNV_INIT, e->value.symbol, strlen(e->value.symbol)) ^ 2;
+        case TYPE_CONS:
+            return mix((uint64_t)(uintptr_t)e->value.cons.car * 31 ^
+                       (uint64_t)(uintptr_t)e->value.cons.cdr);
+        default:
+            return 0;
+    }
+}
+
+static int node_equal(sExpr *a, sExpr *b) {
+    if (type_of(a) != type_of(b)) return 0;
+    switch (type_of(a)) {
+        case TYPE_INT:
+            return a->value.integer == b->value.integer;
+        case TYPE_DOUBLE:
+            return memcmp(&a->value.dbl, &b->value.dbl, sizeof(double)) == 0;
+        case TYPE_STRING:
+            return string_equal(a, b);
+        case TYPE_SYMBOL:
+            return strcmp(a->value.symbol, b->value.symbol) == 0;
+        case TYPE_CONS:
+            return a->value.cons.car == b->value.cons.car &&
+                   a->value.cons.cdr == b->value.cons.cdr;
+        default:
+            return 0;
+    }
+}
+
+// Slot holding a node equal to e, or the empty slot where it would go
+static sExpr **find_slot(sExpr *e) {
+    size_t i = node_hash(e) & (table.cap - 1);
+    while (table.slots[i] && !node_equal(table.slots[i], e)) i = (i + 1) & (table.cap - 1);
+    return &table.slots[i];
+}
+
+static void insert(sExpr *e) {
+    if ((table.count + 1) * 4 > table.cap * 3) {
+        sExpr **old = table.slots;
+        size_t old_cap = table.cap;
+        table.cap = old_cap ? old_cap * 2 : 1024;
+        table.slots = calloc(table.cap, sizeof(sExpr *));
+        for (size_t i = 0; i < old_cap; i++) {
+            if (old[i]) *find_slot(old[i]) = old[i];
+        }
+        free(old);
+    }
+    *find_slot(e) = e;
+    table.count++;
+}
+
+int is_hash_consed(sExpr *e) {
+    if (table.count == 0 || !consable(e)) return 0;
+    return *find_slot(e) == e;
+}
+
+// The canonical node equal to e, whose children are already canonical.
+// A fresh node is entered as is; otherwise a copy is entered so the
+// caller's cell never becomes shared.
+static sExpr *intern_node(sExpr *e, int fresh) {
+    if (table.count > 0) {
+        sExpr *found = *find_slot(e);
+        if (found) return found;
+    }
+    if (!fresh && type_of(e) == TYPE_CONS) e = cons(e->value.cons.car, e->value.cons.cdr);
+    insert(e);
+    return e;
+}
+
+typedef struct {
+    sExpr *node;
+    int children_done;
+} Visit;
+
+// Post-order walk with heap stacks. Results are pairs of (node, canonical?)
+// so a cons holding something that can't be shared is left unshared too.
+// If fresh, root was just built by the reader: nothing else refers to it, so
+// its cells are reused or freed rather than copied.
+static sExpr *canonicalize(sExpr *root, int fresh) {
+    size_t vcap = 64, rcap = 64, nv = 0, nr = 0;
+    Visit *visits = malloc(sizeof(Visit) * vcap);
+    sExpr **results = malloc(sizeof(sExpr *) * rcap);
+    char *shared = malloc(rcap);
+
+    visits[nv++] = (Visit){ root, 0 };
+    while (nv > 0) {
+        if (nv + 2 > vcap) {
+            vcap *= 2;
+            visits = realloc(visits, sizeof(Visit) * vcap);
+        }
+        if (nr + 1 > rcap) {
+            rcap *= 2;
+            results = realloc(results, sizeof(sExpr *) * rcap);
+            shared = realloc(shared, rcap);
+        }
+
+        Visit v = visits[--nv];
+        sExpr *e = v.node;
+        sExpr *out = e;
+        int ok = 1;
+
+        if (isnil(e)) {
+            out = NIL;
+        } else if (type_of(e) == TYPE_CONS && !v.children_done) {
+            visits[nv++] = (Visit){ e, 1 };
+            visits[nv++] = (Visit){ e->value.cons.cdr, 0 };
+            visits[nv++] = (Visit){ e->value.cons.car, 0 };
+            continue;
+        } else if (type_of(e) == TYPE_CONS) {
+            sExpr *cdr_c = results[--nr];
+            int cdr_ok = shared[nr];
+            sExpr *car_c = results[--nr];
+            int car_ok = shared[nr];
+            ok = car_ok && cdr_ok;
+
+            if (ok && fresh) {
+                e->value.cons.car = car_c;
+                e->value.cons.cdr = cdr_c;
+                out = intern_node(e, 1);
+                if (out != e) free_cell(e);
+            } else if (ok) {
+                sExpr tmp;
+                tmp.type = TYPE_CONS;
+                tmp.value.cons.car = car_c;
+                tmp.value.cons.cdr = cdr_c;
+                out = intern_node(&tmp, 0);
+            } else if (fresh) {
+                e->value.cons.car = car_c;
+                e->value.cons.cdr = cdr_c;
+            } else if (car_c != e->value.cons.car || cdr_c != e->value.cons.cdr) {
+                out = cons(car_c, cdr_c);
+            }
+        } else if (consable(e)) {
+            out = intern_node(e, 1);
+            if (fresh && out != e) free_sExpr(e);
+        } else {
+            ok = 0;
+        }
+
+        results[nr] = out;
+        shared[nr++] = (char)ok;
+    }
+
+    sExpr *result = results[0];
+    free(visits);
+    free(results);
+    free(shared);
+    return result;
+}
+
+sExpr *hash_cons(sExpr *e) {
+    return canonicalize(e, 0);
+}
+
+// For the reader: e is freshly parsed and owned by the caller
+sExpr *hash_cons_fresh(sExpr *e) {
+    return canonicalize(e, 1);
+}
+
+typedef struct {
+    sExpr **items;          // pairs still to compare
+    size_t n, cap;
+    int same;
+    PMap *other;            // map whose entries push_entry looks up
+} EqualWork;
+
+static void push_pair(EqualWork *w, sExpr *a, sExpr *b) {
+    if (w->n + 2 > w->cap) {
+        w->cap *= 2;
+        w->items = realloc(w->items, sizeof(sExpr *) * w->cap);
+    }
+    w->items[w->n++] = a;
+    w->items[w->n++] = b;
+}
+
+// Pairs a value of one map with the value of the same key in the other
+static void push_entry(sExpr *key, sExpr *value, void *ctx) {
+    EqualWork *w = ctx;
+    sExpr *other = w->same ? pmap_get(w->other, key) : NULL;
+    if (other) push_pair(w, value, other);
+    else w->same = 0;
+}
+
+// Structural equality: same types and values all the way down. Two
+// different canonical nodes can't be equal, so canonical data compares by
+// pointer. Persistent vectors are equal if their elements are, and
+// persistent maps if they have the same keys (by eq) with equal values.
+sExpr *equal(sExpr *a, sExpr *b) {
+    EqualWork w = { malloc(sizeof(sExpr *) * 64), 0, 64, 1, NULL };
+    push_pair(&w, a, b);
+
+    while (w.n > 0 && w.same) {
+        b = w.items[--w.n];
+        a = w.items[--w.n];
+        if (type_of(a) == TYPE_QUICK) a = quick_symbol(a);
+        if (type_of(b) == TYPE_QUICK) b = quick_symbol(b);
+        if (a == b) continue;
+        if (type_of(a) != type_of(b) || (is_hash_consed(a) && is_hash_consed(b))) {
+            w.same = 0;
+        } else if (type_of(a) == TYPE_CONS) {
+            push_pair(&w, a->value.cons.cdr, b->value.cons.cdr);
+            push_pair(&w, a->value.cons.car, b->value.cons.car);
+        } else if (type_of(a) == TYPE_PVEC) {
+            size_t n = pvec_count(a->value.pvec);
+            w.same = n == pvec_count(b->value.pvec);
+            for (size_t i = 0; w.same && i < n; i++) {
+                push_pair(&w, pvec_nth(a->value.pvec, i), pvec_nth(b->value.pvec, i));
+            }
+        } else if (type_of(a) == TYPE_PMAP) {
+            w.same = pmap_count(a->value.pmap) == pmap_count(b->value.pmap);
+            w.other = b->value.pmap;
+            if (w.same) pmap_each(a->value.pmap, push_entry, &w);
+        } else {
+            w.same = type_of(a) == TYPE_NIL || (consable(a) && node_equal(a, b));
+        }
+    }
+    free(w.items);
+    return w.same ? TRUE : NIL;
+}
@@ -0,0 +1,644 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "sexpr.h"
+
+// Heap images
+//
+// An image is a flat table of records, one per reachable object. Pointers are
+// written as record indices, so the file is relocatable: loading allocates
+// every object in one block and turns index i into &block[i] as it goes.
+//
+//   magic[8] | u64 count | u64 root | records...
+//
+// Index 0 is NIL and index 1 is TRUE, so the singletons keep their identity.
+// Hash tables and persistent maps are written as their key/value index pairs
+// and rebuilt once every record is in place, since hashing a key needs its
+// contents. Persistent vectors are written as their element indices and
+// rebuilt the same way, so sharing between versions isn't kept.
+
+#define IMAGE_MAGIC "YISPIMG1"
+#define FIRST_INDEX 2
+
+typedef struct {
+    sExpr **keys;
+    uint32_t *vals;
+    size_t cap;
+    size_t count;
+} PtrMap;
+
+static size_t ptr_hash(sExpr *p) {
+    uintptr_t x = (uintptr_t)p;
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    return (size_t)x;
+}
+
+static void ptrmap_put(PtrMap *m, sExpr *key, uint32_t val);
+
+static void ptrmap_grow(PtrMap *m) {
+    PtrMap old = *m;
+    m->cap = old.cap ? old.cap * 2 : 1024;
+    m->count = 0;
+    m->keys = calloc(m->cap, sizeof(sExpr *));
+    m->vals = malloc(m->cap * sizeof(uint32_t));
+    for (size_t i = 0; i < old.cap; i++) {
+        if (old.keys[i]) ptrmap_put(m, old.keys[i], old.vals[i]);
+    }
+    free(old.keys);
+    free(old.vals);
+}
+
+static void ptrmap_put(PtrMap *m, sExpr *key, uint32_t val) {
+    if ((m->count + 1) * 2 > m->cap) ptrmap_grow(m);
+    size_t i = ptr_hash(key) & (m->cap - 1);
+    while (m->keys[i] && m->keys[i] != key) i = (i + 1) & (m->cap - 1);
+    if (!m->keys[i]) m->count++;
+    m->keys[i] = key;
+    m->vals[i] = val;
+}
+
+static int ptrmap_get(PtrMap *m, sExpr *key, uint32_t *val) {
+    if (!m->cap) return 0;
+    size_t i = ptr_hash(key) & (m->cap - 1);
+    while (m->keys[i]) {
+        if (m->keys[i] == key) {
+            *val = m->vals[i];
+            return 1;
+        }
+        i = (i + 1) & (m->cap - 1);
+    }
+    return 0;
+}
+
+// Objects in index order, plus the pointer -> index map
+typedef struct {
+    sExpr **items;
+    size_t count;
+    size_t cap;
+    PtrMap index;
+} ObjTable;
+
+static uint32_t objtable_add(ObjTable *t, sExpr *e) {
+    uint32_t idx;
+    if (e == NIL) return 0;
+    if (e == TRUE) return 1;
+    if (ptrmap_get(&t->index, e, &idx)) return idx;
+
+    if (t->count >= t->cap) {
+        t->cap = t->cap ? t->cap * 2 : 1024;
+        t->items = realloc(t->items, t->cap * sizeof(sExpr *));
+    }
+    idx = (uint32_t)(t->count + FIRST_INDEX);
+    t->items[t->count++] = e;
+    ptrmap_put(&t->index, e, idx);
+    return idx;
+}
+
+// Numbers every object reachable from root. Iterative, so long lists and deep
+// trees don't touch the C stack; the table itself doubles as the work queue.
+static void add_entry(sExpr *key, sExpr *value, void *ctx) {
+    objtable_add(ctx, key);
+    objtable_add(ctx, value);
+}
+
+static void collect(ObjTable *t, sExpr *root) {
+    objtable_add(t, root);
+    for (size_t i = 0; i < t->count; i++) {
+        sExpr *e = t->items[i];
+        if (type_of(e) == TYPE_CONS) {
+            objtable_add(t, e->value.cons.car);
+            objtable_add(t, e->value.cons.cdr);
+        } else if (type_of(e) == TYPE_HASH) {
+            hash_each(e->value.hash, add_entry, t);
+        } else if (type_of(e) == TYPE_PMAP) {
+            pmap_each(e->value.pmap, add_entry, t);
+        } else if (type_of(e) == TYPE_PVEC) {
+            for (size_t k = 0; k < pvec_count(e->value.pvec); k++) {
+                objtable_add(t, pvec_nth(e->value.pvec, k));
+            }
+        }
+    }
+}
+
+static void write_u32(FILE *f, uint32_t v) { fwrite(&v, sizeof(v), 1, f); }
+static void write_u64(FILE *f, uint64_t v) { fwrite(&v, sizeof(v), 1, f); }
+
+static void write_text(FILE *f, const char *s, size_t len) {
+    write_u32(f, (uint32_t)len);
+    fwrite(s, 1, len, f);
+}
+
+typedef struct {
+    FILE *f;
+    ObjTable *t;
+} EntryWriter;
+
+static void write_entry(sExpr *key, sExpr *value, void *ctx) {
+    EntryWriter *w = ctx;
+    write_u32(w->f, objtable_add(w->t, key));
+    write_u32(w->f, objtable_add(w->t, value));
+}
+
+int write_sexpr_records(FILE *f, sExpr *root) {
+    ObjTable t = {0};
+    collect(&t, root);
+
+    uint32_t root_idx = objtable_add(&t, root);
+    write_u64(f, t.count);
+    write_u64(f, root_idx);
+
+    for (size_t i = 0; i < t.count; i++) {
+        sExpr *e = t.items[i];
+        uint8_t type = (uint8_t)type_of(e);
+        // A promise may hold an open file or C state, a generator its own
+        // stack, and a native a C function pointer, so all are saved as ()
+        if (type_of(e) == TYPE_PROMISE || type_of(e) == TYPE_GENERATOR || type_of(e) == TYPE_NATIVE) type = TYPE_NIL;
+        if (type_of(e) == TYPE_QUICK) type = TYPE_SYMBOL;
+        fwrite(&type, 1, 1, f);
+        switch (type_of(e)) {
+            case TYPE_INT:
+                write_u64(f, (uint64_t)e->value.integer);
+                break;
+            case TYPE_DOUBLE:
+                fwrite(&e->value.dbl, sizeof(double), 1, f);
+                break;
+            case TYPE_STRING:
+                write_text(f, e->value.string, string_length(e));
+                break;
+            case TYPE_SYMBOL:
+                write_text(f, e->value.symbol, strlen(e->value.symbol));
+                break;
+            case TYPE_QUICK: // saved as the symbol it replaced
+                write_text(f, quick_symbol(e)->value.symbol, strlen(quick_symbol(e)->value.symbol));
+                break;
+            case TYPE_BUILDER: {
+                size_t len;
+                const char *data = builder_data(e->value.builder, &len);
+                write_text(f, data, len);
+                break;
+            }
+            case TYPE_CONS:
+                write_u32(f, objtable_add(&t, e->value.cons.car));
+                write_u32(f, objtable_add(&t, e->value.cons.cdr));
+                break;
+            case TYPE_HASH: {
+                EntryWriter w = { f, &t };
+                write_u32(f, (uint32_t)hash_count(e->value.hash));
+                hash_each(e->value.hash, write_entry, &w);
+                break;
+            }
+            case TYPE_PMAP: {
+                EntryWriter w = { f, &t };
+                write_u32(f, (uint32_t)pmap_count(e->value.pmap));
+                pmap_each(e->value.pmap, write_entry, &w);
+                break;
+            }
+            case TYPE_PVEC:
+                write_u32(f, (uint32_t)pvec_count(e->value.pvec));
+                for (size_t k = 0; k < pvec_count(e->value.pvec); k++) {
+                    write_u32(f, objtable_add(&t, pvec_nth(e->value.pvec, k)));
+                }
+                break;
+            case TYPE_NIL:
+            case TYPE_PROMISE:
+            case TYPE_GENERATOR:
+            case TYPE_NATIVE:
+                break;
+        }
+    }
+
+    free(t.items);
+    free(t.index.keys);
+    free(t.index.vals);
+    return ferror(f) ? -1 : 0;
+}
+
+// Cursor over a mapped image
+typedef struct {
+    const unsigned char *p;
+    const unsigned char *end;
+} Reader;
+
+static int read_bytes(Reader *r, void *out, size_t n) {
+    if ((size_t)(r->end - r->p) < n) return -1;
+    memcpy(out, r->p, n);
+    r->p += n;
+    return 0;
+}
+
+// Points *data at the next length-prefixed text, left in place in the image
+static int read_text(Reader *r, const char **data, uint32_t *len) {
+    if (read_bytes(r, len, sizeof(*len)) < 0) return -1;
+    if ((size_t)(r->end - r->p) < *len) return -1;
+    *data = (const char *)r->p;
+    r->p += *len;
+    return 0;
+}
+
+// Rebuilds the object graph from records starting at *pos. Every object lives
+// in a single block allocated up front, so forward references are fixed up in
+// the same pass. Returns NULL on a truncated or corrupt table.
+sExpr *read_sexpr_records(const unsigned char **pos, const unsigned char *end) {
+    Reader r = { *pos, end };
+    uint64_t count, root_idx;
+    if (read_bytes(&r, &count, sizeof(count)) < 0) return NULL;
+    if (read_bytes(&r, &root_idx, sizeof(root_idx)) < 0) return NULL;
+    // Every record takes at least a byte, which also keeps count * sizeof(sExpr)
+    // from overflowing
+    if (count > (uint64_t)(r.end - r.p)) return NULL;
+    if (root_idx >= count + FIRST_INDEX) return NULL;
+
+    sExpr *block = count ? malloc(count * sizeof(sExpr)) : NULL;
+    if (count && !block) return NULL;
+
+    // Index runs of every table, map and vector, filled in after the main pass
+    uint32_t *pairs = NULL;
+    size_t npairs = 0, pairs_cap = 0;
+
+#define RESOLVE(idx) ((idx) == 0 ? NIL : (idx) == 1 ? TRUE : &block[(idx) - FIRST_INDEX])
+
+    for (uint64_t i = 0; i < count; i++) {
+        sExpr *e = &block[i];
+        const char *text;
+        uint32_t len;
+        uint8_t type;
+        if (read_bytes(&r, &type, 1) < 0) goto corrupt;
+        e->type = (sExprType)type;
+        switch (type_of(e)) {
+            case TYPE_INT: {
+                uint64_t v;
+                if (read_bytes(&r, &v, sizeof(v)) < 0) goto corrupt;
+                e->value.integer = (long)v;
+                break;
+            }
+            case TYPE_DOUBLE:
+                if (read_bytes(&r, &e->value.dbl, sizeof(double)) < 0) goto corrupt;
+                break;
+            case TYPE_STRING:
+                if (read_text(&r, &text, &len) < 0) goto corrupt;
+                e->value.string = alloc_string(text, len);
+                break;
+            case TYPE_SYMBOL:
+                if (read_text(&r, &text, &len) < 0) goto corrupt;
+                e->value.symbol = strndup(text, len);
+                break;
+            case TYPE_BUILDER:
+                if (read_text(&r, &text, &len) < 0) goto corrupt;
+                e->value.builder = builder_new();
+                builder_append(e->value.builder, text, len);
+                break;
+            case TYPE_CONS: {
+                uint32_t a, d;
+                if (read_bytes(&r, &a, sizeof(a)) < 0) goto corrupt;
+                if (read_bytes(&r, &d, sizeof(d)) < 0) goto corrupt;
+                if (a >= count + FIRST_INDEX || d >= count + FIRST_INDEX) goto corrupt;
+                e->value.cons.car = RESOLVE(a);
+                e->value.cons.cdr = RESOLVE(d);
+                break;
+            }
+            case TYPE_HASH:
+            case TYPE_PMAP:
+            case TYPE_PVEC: {
+                uint32_t n;
+                size_t width = type_of(e) == TYPE_PVEC ? 1 : 2;    // indices per item
+                if (read_bytes(&r, &n, sizeof(n)) < 0) goto corrupt;
+                if ((size_t)(r.end - r.p) / (width * sizeof(uint32_t)) < n) goto corrupt;
+                if (npairs + 1 + width * n > pairs_cap) {
+                    pairs_cap = (npairs + 1 + width * n) * 2;
+                    pairs = realloc(pairs, pairs_cap * sizeof(uint32_t));
+                }
+                if (type_of(e) == TYPE_HASH) e->value.hash = hash_new(n);
+                pairs[npairs++] = n;
+                for (uint32_t k = 0; k < width * n; k++) {
+                    uint32_t idx;
+                    if (read_bytes(&r, &idx, sizeof(idx)) < 0) goto corrupt;
+                    if (idx >= count + FIRST_INDEX) goto corrupt;
+                    pairs[npairs++] = idx;
+                }
+                break;
+            }
+            case TYPE_NIL:
+                break;
+            default:
+                goto corrupt;
+        }
+    }
+
+    // Collections appear in record order, matching the order of their runs
+    size_t p = 0;
+    for (uint64_t i = 0; i < count && p < npairs; i++) {
+        sExpr *e = &block[i];
+        if (type_of(e) == TYPE_HASH) {
+            uint32_t n = pairs[p++];
+            for (uint32_t k = 0; k < n; k++, p += 2) {
+                hash_set(e->value.hash, RESOLVE(pairs[p]), RESOLVE(pairs[p + 1]));
+            }
+        } else if (type_of(e) == TYPE_PMAP) {
+            uint32_t n = pairs[p++];
+            sExpr *m = make_transient(create_pmap());
+            for (uint32_t k = 0; k < n; k++, p += 2) pmap_assoc(m, RESOLVE(pairs[p]), RESOLVE(pairs[p + 1]));
+            e->value.pmap = make_persistent(m)->value.pmap;
+        } else if (type_of(e) == TYPE_PVEC) {
+            uint32_t n = pairs[p++];
+            sExpr *v = make_transient(create_pvec());
+            for (uint32_t k = 0; k < n; k++, p++) pvec_conj(v, RESOLVE(pairs[p]));
+            e->value.pvec = make_persistent(v)->value.pvec;
+        }
+    }
+    free(pairs);
+
+    *pos = r.p;
+    return RESOLVE(root_idx);
+
+corrupt:
+    // Strings and tables already read are leaked; the block is never handed out
+    free(pairs);
+    free(block);
+    return NULL;
+#undef RESOLVE
+}
+
+// Maps a whole file read-only. Returns NULL on failure.
+const unsigned char *map_file(const char *path, size_t *size) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+
+    void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return NULL;
+
+    *size = (size_t)st.st_size;
+    return data;
+}
+
+void unmap_file(const unsigned char *data, size_t size) {
+    munmap((void *)data, size);
+}
+
+// The global frame with functions as written, since the image doesn't
+// record what was inlined where
+static sExpr *as_written(sExpr *frame) {
+    sExpr *head = NIL;
+    sExpr *tail = NIL;
+    for (sExpr *v = car(cdr(frame)); type_of(v) == TYPE_CONS; v = cdr(v)) {
+        sExpr *cell = cons(inline_source(car(v)), NIL);
+        if (isnil(head)) head = cell;
+        else tail->value.cons.cdr = cell;
+        tail = cell;
+    }
+    return cons(car(frame), cons(head, cdr(cdr(frame))));
+}
+
+// Writes the global frame (not any frames pushed by an in-progress call)
+int save_image(const char *path) {
+    sExpr *env_iter = global_env;
+    while (!isnil(cdr(env_iter))) env_iter = cdr(env_iter);
+
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        printf("save-image: cannot open %s\n", path);
+        return -1;
+    }
+
+    fwrite(IMAGE_MAGIC, 1, 8, f);
+    int status = write_sexpr_records(f, cons(as_written(car(env_iter)), NIL));
+    if (fclose(f) != 0) status = -1;
+    if (status < 0) printf("save-image: write to %s failed\n", path);
+    return status;
+}
+
+int load_image(const char *path) {
+    size_t size;
+    const unsigned char *data = map_file(path, &size);
+    if (!data) {
+        fprintf(stderr, "Bad image: %s\n", path);
+        return -1;
+    }
+
+    if (size < 8 || memcmp(data, IMAGE_MAGIC, 8) != 0) {
+        fprintf(stderr, "Not a Yisp image: %s\n", path);
+        unmap_file(data, size);
+        return -1;
+    }
+
+    const unsigned char *pos = data + 8;
+    sExpr *env = read_sexpr_records(&pos, data + size);
+    unmap_file(data, size);
+
+    if (!env || type_of(env) != TYPE_CONS) {
+        fprintf(stderr, "Corrupt image: %s\n", path);
+        return -1;
+    }
+
+    global_env = env;
+    global_epoch++; // every global function may have changed
+    return 0;
+}
+
+// Form caches
+//
+// (load "file") also writes <file>.yc next to the source, holding the parsed
+// top-level forms as image records behind a hash of the source text:
+//
+//   magic[8] | u64 source hash | u64 source length | records...
+//
+// A later load reuses the cache only when both match, so editing the source
+// invalidates it automatically. Scripts run from the command line are parsed
+// without one, so running a script leaves nothing behind.
+
+#define CACHE_MAGIC "YISPFRM1"
+
+static char *cache_path(const char *path) {
+    size_t len = strlen(path);
+    char *out = malloc(len + 4);
+    memcpy(out, path, len);
+    memcpy(out + len, ".yc", 4);
+    return out;
+}
+
+static sExpr *read_cache(const char *cpath, uint64_t hash, uint64_t len) {
+    size_t size;
+    const unsigned char *data = map_file(cpath, &size);
+    if (!data) return NULL;
+
+    sExpr *forms = NULL;
+    uint64_t header[2];
+    if (size >= 8 + sizeof(header) && memcmp(data, CACHE_MAGIC, 8) == 0) {
+        memcpy(header, data + 8, sizeof(header));
+        if (header[0] == hash && header[1] == len) {
+            const unsigned char *pos = data + 8 + sizeof(header);
+            forms = read_sexpr_records(&pos, data + size);
+        }
+    }
+    unmap_file(data, size);
+    return forms;
+}
+
+// Written to a temporary name first so a concurrent reader never sees a
+// half-written cache. Failure just means the next load parses again.
+static void write_cache(const char *cpath, uint64_t hash, uint64_t len, sExpr *forms) {
+    size_t plen = strlen(cpath);
+    char *tmp = malloc(plen + 5);
+    memcpy(tmp, cpath, plen);
+    memcpy(tmp + plen, ".tmp", 5);
+
+    FILE *f = fopen(tmp, "wb");
+    if (f) {
+        uint64_t header[2] = { hash, len };
+        fwrite(CACHE_MAGIC, 1, 8, f);
+        fwrite(header, sizeof(header), 1, f);
+        int status = write_sexpr_records(f, forms);
+        if (fclose(f) != 0) status = -1;
+        if (status == 0) rename(tmp, cpath);
+        else remove(tmp);
+    }
+    free(tmp);
+}
+
+// Appends the forms in text[0, len) to the list ending at *tail
+static void parse_span(const char *text, size_t len, sExpr **head, sExpr **tail) {
+    char *span = malloc(len + 1);
+    memcpy(span, text, len);
+    span[len] = '\0';
+    TokenStream ts = tokenize(span);
+    while (ts.pos < ts.count) {
+        sExpr *cell = cons(parse_sexpr(&ts), NIL);
+        if (isnil(*head)) *head = cell;
+        else (*tail)->value.cons.cdr = cell;
+        *tail = cell;
+    }
+    free_tokens(&ts);
+    free(span);
+}
+
+static void report(const char *name, int line, char paren) {
+    if (name) fprintf(stderr, "%s:%d: unmatched %c\n", name, line, paren);
+    else fprintf(stderr, "line %d: unmatched %c\n", line, paren);
+}
+
+// Parses every top-level form in text. An unmatched paren is reported
+// with its line, named after name if given, and skipped: a form still open
+// when a line starts with '(' in its first column, or at the end of the
+// text, is dropped and parsing picks up at that line, and a stray ')' is
+// ignored. Returns the number of unmatched parens in *errors if not NULL.
+static sExpr *parse_text(const char *text, const char *name, int *errors) {
+    sExpr *head = NIL;
+    sExpr *tail = NIL;
+    const char *seg = text;     // start of the text not parsed yet
+    const char *form = NULL;    // '(' of the open top-level form
+    int form_line = 0, line = 1, depth = 0, in_string = 0, bad = 0;
+
+    for (const char *p = text; *p; p++) {
+        if (*p == '\n') {
+            line++;
+            if (depth > 0 && !in_string && p[1] == '(') {
+                report(name, form_line, '(');
+                bad++;
+                parse_span(seg, (size_t)(form - seg), &head, &tail);
+                seg = p + 1;
+                depth = 0;
+            }
+        } else if (*p == '"') {
+            in_string = !in_string;
+        } else if (in_string) {
+            continue;
+        } else if (*p == '(') {
+            if (depth++ == 0) {
+                form = p;
+                form_line = line;
+            }
+        } else if (*p == ')') {
+            if (depth > 0) {
+                depth--;
+                continue;
+            }
+            report(name, line, ')');
+            bad++;
+            parse_span(seg, (size_t)(p - seg), &head, &tail);
+            seg = p + 1;
+        }
+    }
+    if (depth > 0) {
+        report(name, form_line, '(');
+        bad++;
+        parse_span(seg, (size_t)(form - seg), &head, &tail);
+    } else {
+        parse_span(seg, strlen(seg), &head, &tail);
+    }
+    if (errors) *errors = bad;
+    return head;
+}
+
+sExpr *parse_forms(const char *text) {
+    return parse_text(text, NULL, NULL);
+}
+
+// Returns the list of top-level forms in path, or NULL if it can't be read.
+// With cache set, goes through <path>.yc.
+sExpr *load_forms(const char *path, int cache) {
+    FILE *f = fopen(path, "rb");
+    if (!f) return NULL;
+
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if (size < 0) {
+        fclose(f);
+        return NULL;
+    }
+
+    char *text = malloc((size_t)size + 1);
+    size_t got = fread(text, 1, (size_t)size, f);
+    fclose(f);
+    text[got] = '\0';
+
+    int errors;
+    if (!cache) {
+        sExpr *forms = parse_text(text, path, &errors);
+        free(text);
+        return forms;
+    }
+
+    uint64_t hash = fnv1a(FNV_INIT, text, got);
+    char *cpath = cache_path(path);
+
+    // A source with unmatched parens isn't cached, so they are reported on
+    // every load
+    sExpr *forms = read_cache(cpath, hash, got);
+    if (!forms) {
+        forms = parse_text(text, path, &errors);
+        if (!errors) write_cache(cpath, hash, got, forms);
+    } else if (hash_cons_reader) {
+        forms = hash_cons(forms);
+    }
+
+    free(cpath);
+    free(text);
+    return forms;
+}
+
+// Evaluates every form in path, returning the last result
+sExpr *load_file(const char *path) {
+    sExpr *forms = load_forms(path, 1);
+    if (!forms) {
+        printf("load: cannot read %s\n", path);
+        return NIL;
+    }
+
+    sExpr *result = NIL;
+    for (; !isnil(forms); forms = cdr(forms)) result = eval(optimize_toplevel(car(forms)));
+    return result;
+}
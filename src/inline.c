@@ -0,0 +1,490 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sexpr.h"
+
+// Inlining
+//
+// When define binds a lambda, calls in its body to small global functions
+// are replaced by the callee's body, so they push no frame and look nothing
+// up. A callee qualifies if its body makes at most INLINE_MAX_CALLS calls,
+// all to the side-effect-free builtins in leaf_builtins. That rules out
+// recursion, and it is also required by dynamic scoping: anything the
+// callee called could read its parameters by name, and once inlined those
+// names are gone. A callee whose own calls were inlined qualifies by what
+// is left.
+//
+// Parameters are renamed, never bound under their own names, so the
+// caller's variables can't be captured. Literal arguments are substituted
+// for their parameter. So are variables and expressions without side
+// effects, unless an argument with side effects could change them first;
+// such an expression is bound once if it's used more than once. An
+// argument with side effects is substituted only if it's the only one that
+// isn't a literal and is used exactly once, outside any branch. The rest
+// are bound by a let to fresh names like x~3, in argument order. Since the
+// callee's body has no side effects, nothing observable moves.
+//
+// Each function changed by inlining or optimizing keeps its source as
+// written. When a callee is redefined, or its name becomes a parameter
+// somewhere (so a call frame could rebind it), the caller is compiled again
+// from its source and redefined, which in turn recompiles its own callers.
+// Printing a function, as define's result or otherwise, and saving it in
+// an image use the source, so neither shows the rewritten code.
+
+#define INLINE_MAX_CALLS 32
+
+// The builtins an inlinable body may call
+static const char *leaf_builtins[] = {
+    "+", "-", "*", "/", "%", "<", ">", "<=", ">=", "=", "eq", "not", "equal",
+    "and", "or", "if", "cond", "quote", "string-length", "string-append",
+    "substring", "hash-get", "get", "nth", "map-count", "vector-count", NULL
+};
+
+// Every name eval handles before looking for a function. A global function
+// with one of these names is never called, so it must not be inlined.
+static const char *builtins[] = {
+    "quote", "quasiquote", "defmacro", "macroexpand", "set", "define", "let",
+    "let*", "while", "dotimes", "dolist", "do", "save-image", "reload", "load",
+    "make-hash", "hash-get", "hash-set!", "hash-remove!", "hash-count",
+    "hash-keys", "hash-map", "vector", "assoc", "assoc!", "dissoc", "dissoc!",
+    "conj", "conj!", "get", "nth", "map-count", "vector-count", "transient",
+    "persistent!", "map-keys", "vector->list", "string-length",
+    "string-append", "substring", "make-string-builder", "builder-append!",
+    "builder->string", "lambda", "delay", "force", "stream-cons", "stream-car",
+    "stream-cdr", "stream-map", "stream-filter", "stream-take", "stream-fold",
+    "stream->list", "trace-dump", "make-generator", "next", "generator-done?",
+    "file-lines", "file-forms", "+", "-", "*", "/", "%", "<", ">", "<=", ">=",
+    "=", "eq", "not", "equal", "hash-cons", "and", "or", "if", "cond", NULL
+};
+
+typedef struct {
+    sExpr *name;        // the caller
+    sExpr *source;      // its lambda as written
+    sExpr *compiled;    // what name was bound to
+    sExpr *callees;     // names of the functions inlined into it
+} Inlined;
+
+static struct {
+    Inlined *items;
+    size_t count;
+    size_t cap;
+} records;
+
+static int fresh_names = 0;
+
+static int in_list(const char **names, const char *name) {
+    for (int i = 0; names[i]; i++) {
+        if (strcmp(names[i], name) == 0) return 1;
+    }
+    return 0;
+}
+
+// The symbol a code atom stands for, seeing through quick nodes
+static sExpr *plain(sExpr *e) {
+    return type_of(e) == TYPE_QUICK ? quick_symbol(e) : e;
+}
+
+static int is_named(sExpr *e, const char *name) {
+    e = plain(e);
+    return issymbol(e) && strcmp(e->value.symbol, name) == 0;
+}
+
+static int same_name(sExpr *a, sExpr *b) {
+    return strcmp(a->value.symbol, b->value.symbol) == 0;
+}
+
+static int member(sExpr *name, sExpr *names) {
+    for (; type_of(names) == TYPE_CONS; names = cdr(names)) {
+        if (same_name(car(names), name)) return 1;
+    }
+    return 0;
+}
+
+static int length(sExpr *list) {
+    int n = 0;
+    for (; type_of(list) == TYPE_CONS; list = cdr(list)) n++;
+    return n;
+}
+
+// Copies code, turning quick nodes back into their symbols
+static sExpr *copy_code(sExpr *e) {
+    if (type_of(e) == TYPE_QUICK) return create_symbol(quick_symbol(e)->value.symbol);
+    if (type_of(e) != TYPE_CONS) return e;
+    return cons(copy_code(car(e)), copy_code(cdr(e)));
+}
+
+// Nonzero if e only calls leaf builtins, counting its calls against *calls
+static int is_leaf(sExpr *e, int *calls) {
+    if (type_of(e) != TYPE_CONS) return 1;
+    if (--*calls < 0) return 0;
+    sExpr *op = plain(car(e));
+    if (!issymbol(op) || !in_list(leaf_builtins, op->value.symbol)) return 0;
+    if (strcmp(op->value.symbol, "quote") == 0) return 1;
+    int clauses = strcmp(op->value.symbol, "cond") == 0;
+    for (sExpr *a = cdr(e); type_of(a) == TYPE_CONS; a = cdr(a)) {
+        if (!clauses) {
+            if (!is_leaf(car(a), calls)) return 0;
+            continue;
+        }
+        if (type_of(car(a)) != TYPE_CONS || --*calls < 0) return 0;
+        for (sExpr *f = car(a); type_of(f) == TYPE_CONS; f = cdr(f)) {
+            if (!is_leaf(car(f), calls)) return 0;
+        }
+    }
+    return 1;
+}
+
+static int is_pure(sExpr *e) {
+    int calls = 1 << 20;
+    return is_leaf(e, &calls);
+}
+
+static int is_literal(sExpr *e) {
+    return isnil(e) || isnumber(e) || isstring(e) || (type_of(e) == TYPE_CONS && is_named(car(e), "quote"));
+}
+
+// Counts the uses of param in a leaf body. *branched is set if any of them
+// might not be evaluated.
+static void count_uses(sExpr *e, sExpr *param, int branch, int *uses, int *branched) {
+    if (type_of(e) != TYPE_CONS) {
+        e = plain(e);
+        if (issymbol(e) && same_name(e, param)) {
+            (*uses)++;
+            if (branch) *branched = 1;
+        }
+        return;
+    }
+    if (is_named(car(e), "quote")) return;
+    // Only the first test of a cond, and the first argument of if, and and
+    // or, are always evaluated
+    int cond = is_named(car(e), "cond");
+    int first_only = cond || is_named(car(e), "if") || is_named(car(e), "and") || is_named(car(e), "or");
+    int i = 0;
+    for (sExpr *a = cdr(e); type_of(a) == TYPE_CONS; a = cdr(a), i++) {
+        if (!cond) {
+            count_uses(car(a), param, branch || (first_only && i > 0), uses, branched);
+            continue;
+        }
+        int j = 0;
+        for (sExpr *f = car(a); type_of(f) == TYPE_CONS; f = cdr(f), j++) {
+            count_uses(car(f), param, branch || i > 0 || j > 0, uses, branched);
+        }
+    }
+}
+
+// Copies a leaf body, replacing each parameter with its form in values
+static sExpr *substitute(sExpr *e, sExpr *params, sExpr **values) {
+    if (type_of(e) != TYPE_CONS) {
+        e = plain(e);
+        if (!issymbol(e)) return e;
+        int i = 0;
+        for (sExpr *p = params; type_of(p) == TYPE_CONS; p = cdr(p), i++) {
+            if (same_name(car(p), e)) return values[i];
+        }
+        return create_symbol(e->value.symbol);
+    }
+    sExpr *op = create_symbol(plain(car(e))->value.symbol);
+    if (strcmp(op->value.symbol, "quote") == 0) return cons(op, cdr(e));
+    int cond = strcmp(op->value.symbol, "cond") == 0;
+
+    sExpr *head = NIL;
+    sExpr *tail = NIL;
+    for (sExpr *a = cdr(e); type_of(a) == TYPE_CONS; a = cdr(a)) {
+        sExpr *form;
+        if (cond) {
+            form = NIL;
+            sExpr *last = NIL;
+            for (sExpr *f = car(a); type_of(f) == TYPE_CONS; f = cdr(f)) {
+                sExpr *cell = cons(substitute(car(f), params, values), NIL);
+                if (isnil(form)) form = cell;
+                else last->value.cons.cdr = cell;
+                last = cell;
+            }
+        } else {
+            form = substitute(car(a), params, values);
+        }
+        sExpr *cell = cons(form, NIL);
+        if (isnil(head)) head = cell;
+        else tail->value.cons.cdr = cell;
+        tail = cell;
+    }
+    return cons(op, head);
+}
+
+static sExpr *fresh_name(sExpr *param) {
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%s~%d", param->value.symbol, ++fresh_names);
+    return create_symbol(buf);
+}
+
+// The body of callee with args in place of its parameters
+static sExpr *expand(sExpr *callee, sExpr *args) {
+    sExpr *params = car(cdr(callee));
+    sExpr *body = car(cdr(cdr(callee)));
+    int n = length(params);
+    sExpr *small[8];
+    sExpr **values = n <= 8 ? small : malloc(sizeof(sExpr *) * n);
+
+    int impure = 0;
+    int unplaced = 0;   // arguments that aren't literals
+    for (sExpr *a = args; type_of(a) == TYPE_CONS; a = cdr(a)) {
+        if (!is_pure(car(a))) impure++;
+        if (!is_literal(car(a))) unplaced++;
+    }
+
+    sExpr *bindings = NIL;
+    sExpr *tail = NIL;
+    sExpr *p = params;
+    for (int i = 0; i < n; i++, p = cdr(p), args = cdr(args)) {
+        sExpr *arg = car(args);
+        int uses = 0, branched = 0;
+        count_uses(body, car(p), 0, &uses, &branched);
+
+        int in_place;
+        if (is_literal(arg)) in_place = 1;
+        else if (!impure) in_place = issymbol(arg) || uses <= 1;
+        else in_place = unplaced == 1 && uses == 1 && !branched;
+
+        if (in_place) {
+            values[i] = arg;
+            continue;
+        }
+        values[i] = fresh_name(car(p));
+        sExpr *cell = cons(cons(values[i], cons(arg, NIL)), NIL);
+        if (isnil(bindings)) bindings = cell;
+        else tail->value.cons.cdr = cell;
+        tail = cell;
+    }
+
+    sExpr *result = substitute(body, params, values);
+    if (values != small) free(values);
+    if (isnil(bindings)) return result;
+    return cons(create_symbol("let"), cons(bindings, cons(result, NIL)));
+}
+
+static Inlined *record_for(sExpr *name) {
+    for (size_t i = 0; i < records.count; i++) {
+        if (same_name(records.items[i].name, name)) return &records.items[i];
+    }
+    return NULL;
+}
+
+// Nonzero if fn has, directly or not, had the function name inlined into it
+static int has_inlined(sExpr *fn, sExpr *name, int depth) {
+    Inlined *r = record_for(fn);
+    if (!r || lookup_global(r->name) != r->compiled || depth > 64) return 0;
+    for (sExpr *c = r->callees; type_of(c) == TYPE_CONS; c = cdr(c)) {
+        if (same_name(car(c), name) || has_inlined(car(c), name, depth + 1)) return 1;
+    }
+    return 0;
+}
+
+// The global function a call in caller's body can be replaced by, or NULL.
+// bound holds the names the call is in the scope of.
+static sExpr *inlinable(sExpr *name, sExpr *call, sExpr *caller, sExpr *bound) {
+    if (!issymbol(name) || in_list(builtins, name->value.symbol)) return NULL;
+    if (same_name(name, caller) || member(name, bound) || is_param_name(name)) return NULL;
+    if (lookup_local(name)) return NULL;
+
+    sExpr *fn = lookup_global(name);
+    if (!islambda(fn) || length(car(cdr(fn))) != length(cdr(call))) return NULL;
+    for (sExpr *p = car(cdr(fn)); type_of(p) == TYPE_CONS; p = cdr(p)) {
+        if (!issymbol(car(p))) return NULL;
+    }
+    int calls = INLINE_MAX_CALLS;
+    if (!is_leaf(car(cdr(cdr(fn))), &calls)) return NULL;
+    // Nor if its body holds the caller's, or a function the call's scope
+    // rebinds
+    if (has_inlined(name, caller, 0)) return NULL;
+    for (sExpr *b = bound; type_of(b) == TYPE_CONS; b = cdr(b)) {
+        if (has_inlined(name, car(b), 0)) return NULL;
+    }
+    return fn;
+}
+
+typedef struct {
+    sExpr *caller;
+    sExpr *callees;
+} Pass;
+
+static sExpr *inline_form(Pass *pass, sExpr *e, sExpr *bound);
+
+// Inlines each form of a list, returning the list itself if none changed
+static sExpr *inline_list(Pass *pass, sExpr *forms, sExpr *bound) {
+    sExpr *head = NIL;
+    sExpr *tail = NIL;
+    int changed = 0;
+    for (sExpr *it = forms; type_of(it) == TYPE_CONS; it = cdr(it)) {
+        sExpr *form = inline_form(pass, car(it), bound);
+        if (form != car(it)) changed = 1;
+        sExpr *cell = cons(form, NIL);
+        if (isnil(head)) head = cell;
+        else tail->value.cons.cdr = cell;
+        tail = cell;
+    }
+    return changed ? head : forms;
+}
+
+static sExpr *with_names(sExpr *params, sExpr *bound) {
+    for (; type_of(params) == TYPE_CONS; params = cdr(params)) {
+        sExpr *name = param_name(car(params));
+        if (issymbol(name)) bound = cons(name, bound);
+    }
+    return bound;
+}
+
+// (let bindings body...): inits are inlined in the enclosing scope (or, for
+// let*, with the names before them), the body with every name bound
+static sExpr *inline_let(Pass *pass, sExpr *e, sExpr *bound, int sequential) {
+    sExpr *head = NIL;
+    sExpr *tail = NIL;
+    sExpr *inner = bound;
+    for (sExpr *b = car(cdr(e)); type_of(b) == TYPE_CONS; b = cdr(b)) {
+        sExpr *binding = car(b);
+        if (type_of(binding) == TYPE_CONS) {
+            sExpr *init = inline_form(pass, car(cdr(binding)), sequential ? inner : bound);
+            if (init != car(cdr(binding))) binding = cons(car(binding), cons(init, NIL));
+        }
+        inner = with_names(cons(car(b), NIL), inner);
+        sExpr *cell = cons(binding, NIL);
+        if (isnil(head)) head = cell;
+        else tail->value.cons.cdr = cell;
+        tail = cell;
+    }
+    sExpr *body = inline_list(pass, cdr(cdr(e)), inner);
+    return cons(car(e), cons(head, body));
+}
+
+// (dotimes (var count [result]) body...) and dolist
+static sExpr *inline_loop(Pass *pass, sExpr *e, sExpr *bound) {
+    sExpr *spec = car(cdr(e));
+    sExpr *inner = cons(car(spec), bound);
+    sExpr *count = inline_form(pass, car(cdr(spec)), bound);
+    sExpr *result = inline_list(pass, cdr(cdr(spec)), inner);
+    spec = cons(car(spec), cons(count, result));
+    return cons(car(e), cons(spec, inline_list(pass, cdr(cdr(e)), inner)));
+}
+
+// (do ((var init [step]) ...) (test result...) body...)
+static sExpr *inline_do(Pass *pass, sExpr *e, sExpr *bound) {
+    sExpr *inner = with_names(car(cdr(e)), bound);
+    sExpr *head = NIL;
+    sExpr *tail = NIL;
+    for (sExpr *v = car(cdr(e)); type_of(v) == TYPE_CONS; v = cdr(v)) {
+        sExpr *spec = car(v);
+        if (type_of(spec) == TYPE_CONS) {
+            sExpr *init = inline_form(pass, car(cdr(spec)), bound);
+            spec = cons(car(spec), cons(init, inline_list(pass, cdr(cdr(spec)), inner)));
+        }
+        sExpr *cell = cons(spec, NIL);
+        if (isnil(head)) head = cell;
+        else tail->value.cons.cdr = cell;
+        tail = cell;
+    }
+    sExpr *end = inline_list(pass, car(cdr(cdr(e))), inner);
+    sExpr *body = inline_list(pass, cdr(cdr(cdr(e))), inner);
+    return cons(car(e), cons(head, cons(end, body)));
+}
+
+static sExpr *inline_form(Pass *pass, sExpr *e, sExpr *bound) {
+    if (type_of(e) != TYPE_CONS) return e;
+    sExpr *op = plain(car(e));
+    if (!issymbol(op)) return inline_list(pass, e, bound);
+    const char *sym = op->value.symbol;
+
+    if (strcmp(sym, "quote") == 0 || strcmp(sym, "quasiquote") == 0 ||
+        strcmp(sym, "define") == 0 || strcmp(sym, "defmacro") == 0 || macro_for_call(e)) {
+        return e;
+    }
+    if (strcmp(sym, "lambda") == 0) {
+        sExpr *body = inline_list(pass, cdr(cdr(e)), with_names(car(cdr(e)), bound));
+        return body == cdr(cdr(e)) ? e : cons(op, cons(car(cdr(e)), body));
+    }
+    if (strcmp(sym, "set") == 0) {
+        sExpr *value = inline_list(pass, cdr(cdr(e)), bound);
+        return value == cdr(cdr(e)) ? e : cons(op, cons(car(cdr(e)), value));
+    }
+    if (strcmp(sym, "let") == 0 || strcmp(sym, "let*") == 0) {
+        return inline_let(pass, e, bound, sym[3] == '*');
+    }
+    if (strcmp(sym, "dotimes") == 0 || strcmp(sym, "dolist") == 0) return inline_loop(pass, e, bound);
+    if (strcmp(sym, "do") == 0) return inline_do(pass, e, bound);
+    if (strcmp(sym, "cond") == 0) {
+        sExpr *head = NIL;
+        sExpr *tail = NIL;
+        int changed = 0;
+        for (sExpr *c = cdr(e); type_of(c) == TYPE_CONS; c = cdr(c)) {
+            sExpr *clause = inline_list(pass, car(c), bound);
+            if (clause != car(c)) changed = 1;
+            sExpr *cell = cons(clause, NIL);
+            if (isnil(head)) head = cell;
+            else tail->value.cons.cdr = cell;
+            tail = cell;
+        }
+        return changed ? cons(op, head) : e;
+    }
+
+    sExpr *args = inline_list(pass, cdr(e), bound);
+    sExpr *callee = inlinable(op, e, pass->caller, bound);
+    if (callee) {
+        if (!member(op, pass->callees)) pass->callees = cons(op, pass->callees);
+        return expand(callee, args);
+    }
+    return args == cdr(e) ? e : cons(car(e), args);
+}
+
+// Inlines calls in lambda, the new definition of name, and optimizes it
+sExpr *inline_calls(sExpr *name, sExpr *lambda) {
+    Inlined *old = record_for(name);
+    if (old) *old = records.items[--records.count];
+
+    Pass pass = { name, NIL };
+    sExpr *compiled = optimize(issymbol(name) ? inline_form(&pass, lambda, NIL) : lambda);
+    if (dump_optimized && compiled != lambda) {
+        printf("; optimized: ");
+        print_sExpr(compiled);
+        printf("\n");
+    }
+    if (compiled == lambda) return compiled;
+
+    if (records.count == records.cap) {
+        records.cap = records.cap ? records.cap * 2 : 16;
+        records.items = realloc(records.items, sizeof(Inlined) * records.cap);
+    }
+    Inlined *r = &records.items[records.count++];
+    r->name = name;
+    r->source = copy_code(lambda);
+    r->compiled = compiled;
+    r->callees = pass.callees;
+    return compiled;
+}
+
+// Recompiles the callers name was inlined into
+void inline_invalidate(sExpr *name) {
+    if (records.count == 0 || !issymbol(name)) return;
+    size_t n = 0;
+    Inlined *stale = malloc(sizeof(Inlined) * records.count);
+    for (size_t i = 0; i < records.count;) {
+        Inlined *r = &records.items[i];
+        if (member(name, r->callees)) {
+            stale[n++] = *r;
+            *r = records.items[--records.count];
+        } else {
+            i++;
+        }
+    }
+    for (size_t i = 0; i < n; i++) {
+        // A caller bound to something else since needs nothing
+        if (lookup_global(stale[i].name) != stale[i].compiled) continue;
+        set(stale[i].name, inline_calls(stale[i].name, stale[i].source));
+    }
+    free(stale);
+}
+
+// The lambda value was compiled from, or value itself
+sExpr *inline_source(sExpr *value) {
+    for (size_t i = 0; i < records.count; i++) {
+        if (records.items[i].compiled == value) return records.items[i].source;
+    }
+    return value;
+}
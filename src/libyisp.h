@@ -0,0 +1,87 @@
+#ifndef LIBYISP_H
+#define LIBYISP_H
+
+// libyisp: Yisp embedded in a C program
+//
+// Build with make lib, which makes libyisp.a and libyisp.so, and include
+// only this header. The interpreter's state is global, as in the yisp
+// binary, so a process has one interpreter and must use it from one thread
+// at a time.
+//
+// Values are owned by the interpreter. Nothing is ever reclaimed, so a host
+// may keep any value it was handed for as long as it likes.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define YISP_API __attribute__((visibility("default")))
+
+typedef struct sExpr yisp_value;
+typedef struct yisp_function yisp_function;
+
+// A C function callable from Lisp: args are the evaluated arguments. It
+// may return NULL for ().
+typedef yisp_value *(*yisp_native)(yisp_value **args, int nargs, void *ctx);
+
+typedef enum {
+    YISP_NIL,
+    YISP_INT,
+    YISP_DOUBLE,
+    YISP_STRING,
+    YISP_SYMBOL,
+    YISP_LIST,
+    YISP_OTHER,     // tables, collections, promises, generators, natives
+} yisp_type;
+
+// Sets up the interpreter. Returns 0; calling it again does nothing.
+YISP_API int yisp_init(void);
+
+// Evaluates every form in source and returns the last value, or () if
+// there are none. Returns NULL if an evaluation limit was hit; yisp_error
+// then says which.
+YISP_API yisp_value *yisp_eval(const char *source);
+YISP_API yisp_value *yisp_load(const char *path);
+YISP_API const char *yisp_error(void);
+
+// A handle on the global function called name, or NULL if name isn't bound
+// to one. The handle follows later redefinitions of name. Free it with
+// yisp_function_free.
+YISP_API yisp_function *yisp_function_get(const char *name);
+YISP_API void yisp_function_free(yisp_function *fn);
+
+// Calls fn with nargs values, without building or parsing any source.
+// Returns NULL if fn's name is no longer bound to a function.
+YISP_API yisp_value *yisp_call(yisp_function *fn, yisp_value **args, int nargs);
+
+// Binds name to a C function, which Lisp code then calls like any other.
+// A name that is already a builtin keeps meaning the builtin.
+YISP_API int yisp_register(const char *name, yisp_native fn, void *ctx);
+
+// Making values
+YISP_API yisp_value *yisp_nil(void);
+YISP_API yisp_value *yisp_true(void);
+YISP_API yisp_value *yisp_from_long(long value);
+YISP_API yisp_value *yisp_from_double(double value);
+YISP_API yisp_value *yisp_from_string(const char *value);
+YISP_API yisp_value *yisp_symbol(const char *name);
+YISP_API yisp_value *yisp_cons(yisp_value *car, yisp_value *cdr);
+
+// Reading values. The yisp_to_ functions return 0 and store the value if
+// v has a matching type, and return -1 otherwise. Ints convert to double.
+YISP_API yisp_type yisp_type_of(yisp_value *v);
+YISP_API int yisp_is_true(yisp_value *v);
+YISP_API int yisp_to_long(yisp_value *v, long *out);
+YISP_API int yisp_to_double(yisp_value *v, double *out);
+YISP_API int yisp_to_string(yisp_value *v, const char **out);   // strings and symbols
+YISP_API yisp_value *yisp_car(yisp_value *v);
+YISP_API yisp_value *yisp_cdr(yisp_value *v);
+
+// Writes v as the REPL would print it
+YISP_API void yisp_print(yisp_value *v);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
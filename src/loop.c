@@ -0,0 +1,229 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sexpr.h"
+
+// Local variables and loops
+//
+//   (let ((name init) ...) body...)        inits see the enclosing scope
+//   (let* ((name init) ...) body...)       each init sees the names before it
+//   (while test body...)                   returns ()
+//   (dotimes (var count [result]) body...) var from 0 below count
+//   (dolist (var list [result]) body...)
+//   (do ((var init [step]) ...) (test result...) body...)
+//
+// Each form pushes one frame whose parameter list is its own binding list,
+// and loops rebind their variables in that frame's slots, so an iteration
+// pushes no frame, conses no argument list and doesn't deepen the C stack.
+// set on a loop or let variable changes it in place.
+//
+// Numbers are boxed, so a new counter value would normally take a new cell
+// each time round. dotimes reuses one cell instead when the body only
+// passes its variable to arithmetic, comparisons and string-length, which
+// never keep their arguments, and calls no function that could read it by
+// name. The stream builtins use the same test to free file lines.
+
+// Evaluates forms in order; the value of the last, or () if none
+sExpr *eval_body(sExpr *forms) {
+    sExpr *result = NIL;
+    for (; type_of(forms) == TYPE_CONS; forms = cdr(forms)) result = eval(car(forms));
+    return result;
+}
+
+static int length(sExpr *list) {
+    int n = 0;
+    for (; type_of(list) == TYPE_CONS; list = cdr(list)) n++;
+    return n;
+}
+
+static sExpr *init_form(sExpr *binding) {
+    return type_of(binding) == TYPE_CONS ? car(cdr(binding)) : NIL;
+}
+
+sExpr *eval_let(sExpr *args, int sequential) {
+    sExpr *bindings = car(args);
+    int n = length(bindings);
+
+    if (sequential) {
+        open_frame(bindings, n);
+        for (sExpr *b = bindings; type_of(b) == TYPE_CONS; b = cdr(b)) bind_local(eval(init_form(car(b))));
+    } else {
+        // All inits are evaluated before any name is bound
+        sExpr *small[8];
+        sExpr **values = n <= 8 ? small : malloc(sizeof(sExpr *) * n);
+        int i = 0;
+        for (sExpr *b = bindings; type_of(b) == TYPE_CONS; b = cdr(b)) values[i++] = eval(init_form(car(b)));
+        open_frame(bindings, n);
+        for (i = 0; i < n; i++) bind_local(values[i]);
+        if (values != small) free(values);
+    }
+
+    sExpr *result = eval_body(cdr(args));
+    pop_env();
+    return result;
+}
+
+sExpr *eval_while(sExpr *args) {
+    while (!isnil(eval(car(args)))) {
+        BUDGET_STEP();
+        eval_body(cdr(args));
+    }
+    return NIL;
+}
+
+// Builtins that never keep their arguments
+static const char *arith_ops[] = { "+", "-", "*", "/", "%", "<", ">", "<=", ">=", "=",
+                                   "eq", "equal", "string-length" };
+
+// Forms that evaluate their arguments without calling any function
+static const char *plain_forms[] = { "if", "and", "or", "not", "set" };
+
+static int in_names(sExpr *op, const char **list, size_t n) {
+    if (type_of(op) == TYPE_QUICK) op = quick_symbol(op);
+    if (!issymbol(op)) return 0;
+    for (size_t i = 0; i < n; i++) {
+        if (strcmp(op->value.symbol, list[i]) == 0) return 1;
+    }
+    return 0;
+}
+
+static int is_arith(sExpr *op) {
+    return in_names(op, arith_ops, sizeof(arith_ops) / sizeof(arith_ops[0]));
+}
+
+static int is_plain_form(sExpr *op) {
+    return in_names(op, plain_forms, sizeof(plain_forms) / sizeof(plain_forms[0]));
+}
+
+static int names(sExpr *e, sExpr *var) {
+    if (type_of(e) == TYPE_QUICK) e = quick_symbol(e);
+    return issymbol(e) && strcmp(e->value.symbol, var->value.symbol) == 0;
+}
+
+static int is_named(sExpr *op, const char *name) {
+    if (type_of(op) == TYPE_QUICK) op = quick_symbol(op);
+    return issymbol(op) && strcmp(op->value.symbol, name) == 0;
+}
+
+typedef struct {
+    sExpr **items;
+    size_t n, cap;
+} FormStack;
+
+static void push_form(FormStack *s, sExpr *form) {
+    if (s->n == s->cap) {
+        s->cap *= 2;
+        s->items = realloc(s->items, sizeof(sExpr *) * s->cap);
+    }
+    s->items[s->n++] = form;
+}
+
+static void push_forms(FormStack *s, sExpr *forms) {
+    for (; type_of(forms) == TYPE_CONS; forms = cdr(forms)) push_form(s, car(forms));
+}
+
+// Nonzero if nothing can keep the value of var past the forms in body:
+// every use of var is as an argument to arithmetic, and the body calls
+// nothing but arithmetic, since with dynamic scoping any function it
+// called could read var too
+int only_arith_uses(sExpr *body, sExpr *var) {
+    FormStack s = { malloc(sizeof(sExpr *) * 64), 0, 64 };
+    int ok = 1;
+    push_forms(&s, body);
+    while (s.n > 0 && ok) {
+        sExpr *e = s.items[--s.n];
+        if (type_of(e) != TYPE_CONS) {
+            ok = !names(e, var);
+            continue;
+        }
+        sExpr *op = car(e);
+        if (is_named(op, "quote")) continue;
+        if (is_arith(op)) {
+            for (sExpr *a = cdr(e); type_of(a) == TYPE_CONS; a = cdr(a)) {
+                if (!names(car(a), var)) push_form(&s, car(a));
+            }
+        } else if (is_named(op, "cond")) {
+            // Each clause is a list of forms, not a call
+            for (sExpr *c = cdr(e); type_of(c) == TYPE_CONS; c = cdr(c)) push_forms(&s, car(c));
+        } else if (is_plain_form(op)) {
+            push_forms(&s, cdr(e));
+        } else {
+            ok = 0;
+        }
+    }
+    free(s.items);
+    return ok;
+}
+
+sExpr *eval_dotimes(sExpr *args) {
+    sExpr *spec = car(args);
+    sExpr *body = cdr(args);
+    sExpr *count = eval(car(cdr(spec)));
+    if (type_of(count) != TYPE_INT) return NIL;
+
+    sExpr *counter = create_int(0);
+    int reuse = only_arith_uses(body, car(spec));
+    open_frame(spec, 1);
+    bind_local(counter);
+    for (long i = 0; i < count->value.integer; i++) {
+        BUDGET_STEP();
+        if (reuse) {
+            counter->value.integer = i;
+        } else if (i > 0) {
+            set_local(0, create_int(i));
+        }
+        eval_body(body);
+    }
+    set_local(0, count);
+    sExpr *result = eval(car(cdr(cdr(spec))));
+    pop_env();
+    return result;
+}
+
+sExpr *eval_dolist(sExpr *args) {
+    sExpr *spec = car(args);
+    sExpr *list = eval(car(cdr(spec)));
+    open_frame(spec, 1);
+    bind_local(NIL);
+    for (; type_of(list) == TYPE_CONS; list = cdr(list)) {
+        BUDGET_STEP();
+        set_local(0, car(list));
+        eval_body(cdr(args));
+    }
+    set_local(0, NIL);
+    sExpr *result = eval(car(cdr(cdr(spec))));
+    pop_env();
+    return result;
+}
+
+// Steps are all evaluated before any variable is updated
+sExpr *eval_do(sExpr *args) {
+    sExpr *bindings = car(args);
+    sExpr *end = car(cdr(args));
+    sExpr *body = cdr(cdr(args));
+    int n = length(bindings);
+
+    sExpr *small[8];
+    sExpr **values = n <= 8 ? small : malloc(sizeof(sExpr *) * n);
+    int i = 0;
+    for (sExpr *b = bindings; type_of(b) == TYPE_CONS; b = cdr(b)) values[i++] = eval(init_form(car(b)));
+    open_frame(bindings, n);
+    for (i = 0; i < n; i++) bind_local(values[i]);
+
+    while (isnil(eval(car(end)))) {
+        BUDGET_STEP();
+        eval_body(body);
+        i = 0;
+        for (sExpr *b = bindings; type_of(b) == TYPE_CONS; b = cdr(b), i++) {
+            sExpr *binding = car(b);
+            int has_step = type_of(binding) == TYPE_CONS && type_of(cdr(cdr(binding))) == TYPE_CONS;
+            values[i] = has_step ? eval(car(cdr(cdr(binding)))) : get_local(i);
+        }
+        for (i = 0; i < n; i++) set_local(i, values[i]);
+    }
+
+    sExpr *result = eval_body(cdr(end));
+    pop_env();
+    if (values != small) free(values);
+    return result;
+}
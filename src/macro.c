@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sexpr.h"
+
+// Macros
+//
+// (defmacro name (params) body) binds name to (macro (params) body). A call
+// to it evaluates body with the params bound to the unevaluated arguments,
+// and the resulting expansion replaces the call in place: the call-site cons
+// is overwritten with the expansion's car and cdr. Later evaluations of the
+// same code run the expansion directly. Redefining a macro therefore doesn't
+// affect call sites that have already been expanded.
+
+static int is_call_to(sExpr *e, const char *name) {
+    return type_of(e) == TYPE_CONS && issymbol(car(e)) && strcmp(car(e)->value.symbol, name) == 0;
+}
+
+int ismacro(sExpr *e) {
+    return is_call_to(e, "macro");
+}
+
+// The macro a call would invoke, or NULL
+sExpr *macro_for_call(sExpr *expr) {
+    if (type_of(expr) != TYPE_CONS || !issymbol(car(expr))) return NULL;
+    sExpr *def = lookup(car(expr));
+    return ismacro(def) ? def : NULL;
+}
+
+sExpr *expand_macro(sExpr *macro, sExpr *args) {
+    sExpr *params = car(cdr(macro));
+    sExpr *body = car(cdr(cdr(macro)));
+
+    BUDGET_ENTER();
+    push_env(params, args);
+    sExpr *expansion = eval(body);
+    pop_env();
+    BUDGET_LEAVE();
+    return expansion;
+}
+
+// Expands a macro call and overwrites the call with the result. An atom
+// can't be stored in a cons, and a hash-consed call may be shared with
+// other code, so those expansions are returned uncached.
+sExpr *expand_in_place(sExpr *expr, sExpr *macro) {
+    sExpr *expansion = expand_macro(macro, cdr(expr));
+    if (type_of(expansion) != TYPE_CONS || is_hash_consed(expr)) return expansion;
+
+    expr->value.cons.car = expansion->value.cons.car;
+    expr->value.cons.cdr = expansion->value.cons.cdr;
+    return expr;
+}
+
+// Expands form until it is no longer a macro call, without touching it
+sExpr *macroexpand(sExpr *form) {
+    sExpr *macro;
+    while ((macro = macro_for_call(form)) != NULL) {
+        form = expand_macro(macro, cdr(form));
+    }
+    return form;
+}
+
+static sExpr *quasi(sExpr *tmpl, int depth);
+
+static sExpr *list2(const char *sym, sExpr *x) {
+    return cons(create_symbol(sym), cons(x, NIL));
+}
+
+// Appends a copy of list to the result being built
+static void splice(sExpr **head, sExpr **tail, sExpr *list) {
+    for (; type_of(list) == TYPE_CONS; list = cdr(list)) {
+        sExpr *cell = cons(car(list), NIL);
+        if (isnil(*head)) *head = cell;
+        else (*tail)->value.cons.cdr = cell;
+        *tail = cell;
+    }
+}
+
+static sExpr *quasi_list(sExpr *tmpl, int depth) {
+    sExpr *head = NIL;
+    sExpr *tail = NIL;
+    sExpr *it = tmpl;
+
+    while (type_of(it) == TYPE_CONS) {
+        // (a . ,b) reads as (a unquote b)
+        if (it != tmpl && is_call_to(it, "unquote") && isnil(cdr(cdr(it)))) {
+            tail->value.cons.cdr = quasi(it, depth);
+            return head;
+        }
+
+        sExpr *elem = car(it);
+        if (depth == 1 && is_call_to(elem, "unquote-splicing")) {
+            splice(&head, &tail, eval(car(cdr(elem))));
+        } else {
+            sExpr *cell = cons(quasi(elem, depth), NIL);
+            if (isnil(head)) head = cell;
+            else tail->value.cons.cdr = cell;
+            tail = cell;
+        }
+        it = cdr(it);
+    }
+
+    if (!isnil(it)) {
+        if (isnil(head)) return quasi(it, depth);
+        tail->value.cons.cdr = quasi(it, depth);
+    }
+    return head;
+}
+
+// Builds the value of `tmpl. Nested quasiquotes raise the depth, and only
+// unquotes at depth 1 are evaluated.
+static sExpr *quasi(sExpr *tmpl, int depth) {
+    if (type_of(tmpl) != TYPE_CONS) return tmpl;
+
+    if (is_call_to(tmpl, "unquote")) {
+        if (depth == 1) return eval(car(cdr(tmpl)));
+        return list2("unquote", quasi(car(cdr(tmpl)), depth - 1));
+    }
+    if (is_call_to(tmpl, "quasiquote")) {
+        return list2("quasiquote", quasi(car(cdr(tmpl)), depth + 1));
+    }
+    return quasi_list(tmpl, depth);
+}
+
+sExpr *quasiquote(sExpr *tmpl) {
+    return quasi(tmpl, 1);
+}
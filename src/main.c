@@ -2,60 +2,142 @@
 #include <stdlib.h>
 #include <string.h>
 #include "sexpr.h"
+#include "libyisp.h"
 
 extern sExpr *NIL;
 extern sExpr *TRUE;
-extern sExpr *global_env;
 
-int main(int argc, char *argv[]) {
-    FILE *input = NULL;
+// Evaluates and prints one top-level form. Returns 0 if a budget ran out.
+static int run_form(sExpr *form) {
+    const char *error;
+    sExpr *result = eval_bounded(optimize_toplevel(form), &error);
+    if (!result) {
+        fflush(stdout);
+        fprintf(stderr, "error: %s\n", error);
+        return 0;
+    }
+    print_sExpr(result);
+    printf("\n");
+    return 1;
+}
 
-    NIL = malloc(sizeof(sExpr));
-    NIL->type = TYPE_NIL;
+// Parses and runs one line typed at the REPL
+static void repl_line(char *line) {
+    TokenStream ts = tokenize(line);
+    run_form(parse_sexpr(&ts));
+    free_tokens(&ts);
+}
 
-    TRUE = malloc(sizeof(sExpr));
-    TRUE->type = TYPE_SYMBOL;
-    TRUE->value.symbol = strdup("t");
+int main(int argc, char *argv[]) {
+    yisp_init();
 
-    global_env = create_env();
+    const char *script = NULL;
+    const char *compile_out = NULL;
+    const char *serve_path = NULL;
+    const char *client_path = NULL;
+    int workers = 4;
+    int timeout_secs = 10;
+    int compile = 0;
+    int watch = 0;
+    int batch = 0;
+    int status = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--image") == 0 && i + 1 < argc) {
+            if (load_image(argv[++i]) < 0) return 1;
+        } else if (strcmp(argv[i], "--dump-opt") == 0) {
+            dump_optimized = 1;
+        } else if (strcmp(argv[i], "--hash-cons") == 0) {
+            hash_cons_reader = 1;
+        } else if (strcmp(argv[i], "--batch") == 0) {
+            batch = 1;
+        } else if (strcmp(argv[i], "--watch") == 0) {
+            watch = 1;
+        } else if (strcmp(argv[i], "--compile-c") == 0) {
+            compile = 1;
+        } else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+            serve_path = argv[++i];
+        } else if (strcmp(argv[i], "--client") == 0 && i + 1 < argc) {
+            client_path = argv[++i];
+        } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            workers = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--timeout") == 0 && i + 1 < argc) {
+            timeout_secs = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--max-steps") == 0 && i + 1 < argc) {
+            eval_limits.max_steps = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--max-ms") == 0 && i + 1 < argc) {
+            eval_limits.max_ms = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--max-bytes") == 0 && i + 1 < argc) {
+            eval_limits.max_bytes = (size_t)atol(argv[++i]);
+        } else if (strcmp(argv[i], "--max-depth") == 0 && i + 1 < argc) {
+            eval_limits.max_depth = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace_start(argv[++i]);
+            atexit(trace_at_exit);
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            compile_out = argv[++i];
+        } else if (!script) {
+            script = argv[i];
+        } else {
+            fprintf(stderr, "Usage: %s [--image file] [--dump-opt] [--hash-cons] [--trace out.json] [limits] [script]\n"
+                            "       limits: --max-steps n --max-ms n --max-bytes n --max-depth n\n"
+                            "       %s --watch script\n"
+                            "       %s --batch [limits] < forms\n"
+                            "       %s --compile-c script -o out.c\n"
+                            "       %s --serve sock [--workers n] [--timeout secs] [prelude]\n"
+                            "       %s --client sock\n", argv[0], argv[0], argv[0], argv[0], argv[0], argv[0]);
+            return 1;
+        }
+    }
 
-    if (argc == 1) {
-        printf("Reading from stdin. Enter S-Expressions (Ctrl+C to quit):\n> ");
-        input = stdin;
-    } 
-    else if (argc == 2) {
-        input = fopen(argv[1], "r");
-        if (!input) {
-            fprintf(stderr, "Bad file: %s\n", argv[1]);
+    if (compile) {
+        if (!script || !compile_out) {
+            fprintf(stderr, "Usage: %s --compile-c script -o out.c\n", argv[0]);
             return 1;
         }
+        return compile_to_c(script, compile_out) == 0 ? 0 : 1;
     }
 
-    char buffer[1024];
-    while (fgets(buffer, sizeof(buffer), input)) {
-        buffer[strcspn(buffer, "\n")] = '\0';
-        if (strlen(buffer) == 0) {
-            if (input == stdin) printf("> ");
-            continue;
+    if (client_path) return run_client(client_path);
+    if (serve_path) return serve(serve_path, script, workers, timeout_secs) == 0 ? 0 : 1;
+
+    if (watch) {
+        if (!script) {
+            fprintf(stderr, "Usage: %s --watch script\n", argv[0]);
+            return 1;
         }
+        return watch_file(script, repl_line) == 0 ? 0 : 1;
+    }
 
-        TokenStream ts = tokenize(buffer);
-        sExpr *expr = parse_sexpr(&ts);
-        sExpr *result = eval(expr);
+    if (batch) return run_batch(stdin, stdout, run_form);
 
-        print_sExpr(result);
-        printf("\n");
+    if (script) {
+        sExpr *forms = load_forms(script, 0);
+        if (!forms) {
+            fprintf(stderr, "Bad file: %s\n", script);
+            return 1;
+        }
+        for (; !isnil(forms); forms = cdr(forms)) {
+            if (!run_form(car(forms))) status = 1;
+        }
+    } else {
+        printf("Reading from stdin. Enter S-Expressions (Ctrl+C to quit):\n> ");
 
-        if (input == stdin) printf("> ");
+        char buffer[1024];
+        while (fgets(buffer, sizeof(buffer), stdin)) {
+            buffer[strcspn(buffer, "\n")] = '\0';
+            if (strlen(buffer) == 0) {
+                printf("> ");
+                continue;
+            }
 
-        free_tokens(&ts);
+            repl_line(buffer);
+            printf("> ");
+        }
     }
 
-    if (input != stdin) fclose(input);
-
     free(TRUE->value.symbol);
     free(TRUE);
     free(NIL);
 
-    return 0;
+    return status;
 }
@@ -0,0 +1,177 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sexpr.h"
+
+// Optimizer
+//
+// Rewrites a parsed form into a cheaper equivalent before it is evaluated:
+//   - calls to pure builtins whose arguments are all literals are folded
+//   - 'x of a self-evaluating x becomes plain x
+//   - if with a constant test becomes the chosen branch
+//   - cond clauses with a constant false test are dropped, and everything
+//     after a constant true test (such as 't) is unreachable
+// Builtins can't be shadowed by user definitions, so folding them is safe.
+// The input form is never modified; rewritten parts are freshly consed.
+
+int dump_optimized = 0;
+
+static const char *pure_builtins[] = {
+    "+", "-", "*", "/", "%", "<", ">", "<=", ">=", "=", "eq", "not",
+    "string-length", NULL
+};
+
+static int is_call_to(sExpr *e, const char *name) {
+    return type_of(e) == TYPE_CONS && issymbol(car(e)) && strcmp(car(e)->value.symbol, name) == 0;
+}
+
+static int is_pure(const char *name) {
+    for (int i = 0; pure_builtins[i]; i++) {
+        if (strcmp(pure_builtins[i], name) == 0) return 1;
+    }
+    return 0;
+}
+
+// A form whose value is known without evaluating anything
+static int is_literal(sExpr *e) {
+    return isnil(e) || isnumber(e) || isstring(e) || is_call_to(e, "quote");
+}
+
+static sExpr *literal_value(sExpr *e) {
+    return is_call_to(e, "quote") ? car(cdr(e)) : e;
+}
+
+// Turns a value back into a form that evaluates to it
+static sExpr *make_literal(sExpr *value) {
+    if (isnil(value) || isnumber(value) || isstring(value)) return value;
+    return cons(create_symbol("quote"), cons(value, NIL));
+}
+
+// Optimizes each form of a list, returning the list itself if none changed
+static sExpr *optimize_list(sExpr *forms) {
+    sExpr *head = NIL;
+    sExpr *tail = NIL;
+    int changed = 0;
+    for (sExpr *it = forms; type_of(it) == TYPE_CONS; it = cdr(it)) {
+        sExpr *form = optimize(car(it));
+        if (form != car(it)) changed = 1;
+        sExpr *cell = cons(form, NIL);
+        if (isnil(head)) head = cell;
+        else tail->value.cons.cdr = cell;
+        tail = cell;
+    }
+    return changed ? head : forms;
+}
+
+// Rebuilds (fn a b) only when one of the parts changed
+static sExpr *rebuild2(sExpr *expr, sExpr *a, sExpr *b) {
+    sExpr *args = cdr(expr);
+    if (a == car(args) && b == car(cdr(args))) return expr;
+    return cons(car(expr), cons(a, cons(b, NIL)));
+}
+
+static sExpr *optimize_cond(sExpr *expr) {
+    sExpr *head = NIL;
+    sExpr *tail = NIL;
+    int changed = 0;
+    int last = 0;
+    for (sExpr *clauses = cdr(expr); !isnil(clauses) && !last; clauses = cdr(clauses)) {
+        sExpr *clause = car(clauses);
+        sExpr *test = optimize(car(clause));
+        sExpr *result = optimize(car(cdr(clause)));
+
+        if (is_literal(test)) {
+            if (isnil(literal_value(test))) {         // never taken
+                changed = 1;
+                continue;
+            }
+            if (isnil(head)) return result;           // always taken first
+            if (!isnil(cdr(clauses))) changed = 1;    // nothing after it runs
+            last = 1;
+        }
+
+        if (test != car(clause) || result != car(cdr(clause))) {
+            clause = cons(test, cons(result, NIL));
+            changed = 1;
+        }
+        sExpr *cell = cons(clause, NIL);
+        if (isnil(head)) head = cell;
+        else tail->value.cons.cdr = cell;
+        tail = cell;
+    }
+    if (isnil(head)) return NIL;
+    return changed ? cons(car(expr), head) : expr;
+}
+
+sExpr *optimize(sExpr *expr) {
+    if (type_of(expr) != TYPE_CONS) return expr;
+
+    sExpr *fn = car(expr);
+    sExpr *args = cdr(expr);
+
+    if (!issymbol(fn)) return optimize_list(expr);
+    const char *sym = fn->value.symbol;
+
+    if (strcmp(sym, "quote") == 0) {
+        sExpr *quoted = car(args);
+        return (isnumber(quoted) || isstring(quoted) || isnil(quoted)) ? quoted : expr;
+    }
+
+    // define is optimized by eval when it binds a lambda. Macro arguments
+    // are code for the macro to inspect, so they're left as written.
+    if (strcmp(sym, "define") == 0 || strcmp(sym, "defmacro") == 0 ||
+        strcmp(sym, "quasiquote") == 0 || macro_for_call(expr)) {
+        return expr;
+    }
+
+    if (strcmp(sym, "lambda") == 0 || strcmp(sym, "set") == 0) {
+        return rebuild2(expr, car(args), optimize(car(cdr(args))));
+    }
+
+    if (strcmp(sym, "if") == 0) {
+        sExpr *test = optimize(car(args));
+        sExpr *then_branch = optimize(car(cdr(args)));
+        sExpr *else_branch = optimize(car(cdr(cdr(args))));
+        if (is_literal(test)) {
+            return isnil(literal_value(test)) ? else_branch : then_branch;
+        }
+        if (test == car(args) && then_branch == car(cdr(args)) &&
+            else_branch == car(cdr(cdr(args)))) {
+            return expr;
+        }
+        return cons(fn, cons(test, cons(then_branch, cons(else_branch, NIL))));
+    }
+
+    if (strcmp(sym, "cond") == 0) return optimize_cond(expr);
+
+    sExpr *new_args = optimize_list(args);
+    if (is_pure(sym)) {
+        int all_literal = 1;
+        for (sExpr *a = new_args; !isnil(a); a = cdr(a)) {
+            if (!is_literal(car(a))) all_literal = 0;
+        }
+        if (all_literal) {
+            sExpr *quoted = NIL;
+            sExpr *tail = NIL;
+            for (sExpr *a = new_args; !isnil(a); a = cdr(a)) {
+                sExpr *cell = cons(make_literal(literal_value(car(a))), NIL);
+                if (isnil(quoted)) quoted = cell;
+                else tail->value.cons.cdr = cell;
+                tail = cell;
+            }
+            return make_literal(eval(cons(fn, quoted)));
+        }
+    }
+    return new_args == args ? expr : cons(fn, new_args);
+}
+
+// Optimizes a top-level form, printing the result when dumping is on
+sExpr *optimize_toplevel(sExpr *expr) {
+    sExpr *out = optimize(expr);
+    if (dump_optimized && out != expr) {
+        printf("; optimized: ");
+        print_sExpr(out);
+        printf("\n");
+    }
+    return out;
+}
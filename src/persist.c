@@ -0,0 +1,600 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "sexpr.h"
+
+// Persistent maps and vectors
+//
+// (hash-map k v ...) and (vector x ...) make immutable collections. assoc,
+// dissoc and conj return a new version and leave the old one as it was. The
+// two share everything except the path from the root to the change, so an
+// update costs O(log32 n) time and memory rather than a copy of the whole
+// collection.
+//
+// Maps are hash array mapped tries keyed by eq, like hash tables. Each level
+// takes 5 bits of the key's hash. A node keeps its entries and its children
+// in one compact array, selected by two bitmaps, so it holds only what is
+// present. Removing a key pulls a lone remaining entry back up into its
+// parent, which keeps the trie the same shape as if the key had never been
+// added. Keys whose 64-bit hashes are identical share a collision node at
+// the bottom.
+//
+// Vectors are 32-way tries indexed by position. The last 1 to 32 elements
+// are kept in a separate tail, so conj usually copies only the tail, and a
+// full tail is pushed into the trie as a leaf.
+//
+// (transient c) returns a mutable copy of c that assoc!, dissoc! and conj!
+// change in place, for building a large collection without making a version
+// per element. Nodes are tagged with the transient that made them: it writes
+// into its own nodes and copies anyone else's, so c and other versions are
+// never affected. (persistent! t) freezes t and returns it; no transient can
+// write its nodes after that.
+//
+// Versions share nodes, so freeing a collection frees only its header.
+
+#define BITS 5
+#define WIDTH (1 << BITS)
+#define MASK (WIDTH - 1)
+
+typedef struct MapNode {
+    uint32_t datamap;       // hash fragments stored here as key/value pairs
+    uint32_t nodemap;       // hash fragments stored in a child node
+    uint32_t ncollide;      // entries of a collision node, 0 otherwise
+    uint64_t edit;          // transient that may write this node, 0 if none
+    void *slots[];          // key, value, key, value..., then the children
+} MapNode;
+
+struct PMap {
+    MapNode *root;          // NULL when empty
+    size_t count;
+    uint64_t edit;          // nonzero while transient
+};
+
+typedef struct VecNode {
+    uint64_t edit;
+    void *slots[WIDTH];
+} VecNode;
+
+struct PVec {
+    VecNode *root;          // full leaves only
+    VecNode *tail;          // the last elements, NULL when empty
+    size_t count;
+    int shift;              // bits of the index used above the leaves
+    uint64_t edit;
+};
+
+static uint64_t last_edit = 0;
+
+static int same_key(sExpr *a, sExpr *b) {
+    return a == b || sExpr_to_bool(eq(a, b));
+}
+
+// Maps
+
+#define KEY(n, i) ((sExpr *)(n)->slots[2 * (i)])
+#define VAL(n, i) ((sExpr *)(n)->slots[2 * (i) + 1])
+
+static int entry_count(MapNode *n) {
+    return n->ncollide ? (int)n->ncollide : __builtin_popcount(n->datamap);
+}
+
+static int slot_count(MapNode *n) {
+    return 2 * entry_count(n) + __builtin_popcount(n->nodemap);
+}
+
+static int index_of(uint32_t map, uint32_t bit) {
+    return __builtin_popcount(map & (bit - 1));
+}
+
+static uint32_t bit_at(uint64_t h, int shift) {
+    return 1u << ((h >> shift) & MASK);
+}
+
+static MapNode *map_node(uint64_t edit, uint32_t datamap, uint32_t nodemap, int nslots) {
+    size_t size = sizeof(MapNode) + sizeof(void *) * nslots;
+    MapNode *n = malloc(size);
+    allocated_bytes += size;
+    n->datamap = datamap;
+    n->nodemap = nodemap;
+    n->ncollide = 0;
+    n->edit = edit;
+    return n;
+}
+
+// n itself if the transient edit owns it, otherwise a copy that it does
+static MapNode *map_editable(MapNode *n, uint64_t edit) {
+    if (edit && n->edit == edit) return n;
+    int k = slot_count(n);
+    MapNode *c = map_node(edit, n->datamap, n->nodemap, k);
+    c->ncollide = n->ncollide;
+    memcpy(c->slots, n->slots, sizeof(void *) * k);
+    return c;
+}
+
+// A node replaced by a resized copy is garbage if only the transient had it
+static void retire(MapNode *n, uint64_t edit) {
+    if (edit && n->edit == edit) free(n);
+}
+
+static MapNode *set_slot(MapNode *n, uint64_t edit, int i, void *value) {
+    MapNode *c = map_editable(n, edit);
+    c->slots[i] = value;
+    return c;
+}
+
+// Copy of n with an entry added at fragment bit
+static MapNode *insert_entry(MapNode *n, uint64_t edit, uint32_t bit, sExpr *key, sExpr *value) {
+    int i = 2 * index_of(n->datamap, bit), k = slot_count(n);
+    MapNode *c = map_node(edit, n->datamap | bit, n->nodemap, k + 2);
+    memcpy(c->slots, n->slots, sizeof(void *) * i);
+    c->slots[i] = key;
+    c->slots[i + 1] = value;
+    memcpy(c->slots + i + 2, n->slots + i, sizeof(void *) * (k - i));
+    retire(n, edit);
+    return c;
+}
+
+static MapNode *remove_entry(MapNode *n, uint64_t edit, uint32_t bit) {
+    int i = 2 * index_of(n->datamap, bit), k = slot_count(n);
+    MapNode *c = map_node(edit, n->datamap & ~bit, n->nodemap, k - 2);
+    memcpy(c->slots, n->slots, sizeof(void *) * i);
+    memcpy(c->slots + i, n->slots + i + 2, sizeof(void *) * (k - i - 2));
+    retire(n, edit);
+    return c;
+}
+
+// Copy of n with the entry at fragment bit replaced by child
+static MapNode *entry_to_child(MapNode *n, uint64_t edit, uint32_t bit, MapNode *child) {
+    int i = 2 * index_of(n->datamap, bit), k = slot_count(n);
+    int children = 2 * (entry_count(n) - 1);
+    int j = children + index_of(n->nodemap, bit);
+    MapNode *c = map_node(edit, n->datamap & ~bit, n->nodemap | bit, k - 1);
+    memcpy(c->slots, n->slots, sizeof(void *) * i);
+    memcpy(c->slots + i, n->slots + i + 2, sizeof(void *) * (children - i));
+    memcpy(c->slots + children, n->slots + children + 2, sizeof(void *) * (j - children));
+    c->slots[j] = child;
+    memcpy(c->slots + j + 1, n->slots + j + 2, sizeof(void *) * (k - j - 2));
+    retire(n, edit);
+    return c;
+}
+
+// Copy of n with the child at fragment bit replaced by its only entry
+static MapNode *child_to_entry(MapNode *n, uint64_t edit, uint32_t bit, sExpr *key, sExpr *value) {
+    int i = 2 * index_of(n->datamap, bit), k = slot_count(n);
+    int children = 2 * entry_count(n);
+    int j = children + index_of(n->nodemap, bit);
+    MapNode *c = map_node(edit, n->datamap | bit, n->nodemap & ~bit, k + 1);
+    memcpy(c->slots, n->slots, sizeof(void *) * i);
+    c->slots[i] = key;
+    c->slots[i + 1] = value;
+    memcpy(c->slots + i + 2, n->slots + i, sizeof(void *) * (children - i));
+    memcpy(c->slots + children + 2, n->slots + children, sizeof(void *) * (j - children));
+    memcpy(c->slots + j + 2, n->slots + j + 1, sizeof(void *) * (k - j - 1));
+    retire(n, edit);
+    return c;
+}
+
+// Subtree at level shift holding two entries with different keys
+static MapNode *map_pair(uint64_t edit, int shift, sExpr *k1, sExpr *v1, uint64_t h1,
+                         sExpr *k2, sExpr *v2, uint64_t h2) {
+    if (shift >= 64) {
+        MapNode *n = map_node(edit, 0, 0, 4);
+        n->ncollide = 2;
+        n->slots[0] = k1;
+        n->slots[1] = v1;
+        n->slots[2] = k2;
+        n->slots[3] = v2;
+        return n;
+    }
+    uint32_t b1 = bit_at(h1, shift), b2 = bit_at(h2, shift);
+    if (b1 == b2) {
+        MapNode *n = map_node(edit, 0, b1, 1);
+        n->slots[0] = map_pair(edit, shift + BITS, k1, v1, h1, k2, v2, h2);
+        return n;
+    }
+    MapNode *n = map_node(edit, b1 | b2, 0, 4);
+    int first = b1 < b2 ? 0 : 2;
+    n->slots[first] = k1;
+    n->slots[first + 1] = v1;
+    n->slots[2 - first] = k2;
+    n->slots[3 - first] = v2;
+    return n;
+}
+
+static MapNode *map_assoc(MapNode *n, uint64_t edit, int shift, sExpr *key, sExpr *value,
+                          uint64_t h, int *added) {
+    if (n->ncollide) {
+        for (uint32_t i = 0; i < n->ncollide; i++) {
+            if (!same_key(KEY(n, i), key)) continue;
+            return VAL(n, i) == value ? n : set_slot(n, edit, 2 * i + 1, value);
+        }
+        int k = 2 * n->ncollide;
+        MapNode *c = map_node(edit, 0, 0, k + 2);
+        c->ncollide = n->ncollide + 1;
+        memcpy(c->slots, n->slots, sizeof(void *) * k);
+        c->slots[k] = key;
+        c->slots[k + 1] = value;
+        retire(n, edit);
+        *added = 1;
+        return c;
+    }
+
+    uint32_t bit = bit_at(h, shift);
+    if (n->datamap & bit) {
+        int i = index_of(n->datamap, bit);
+        if (same_key(KEY(n, i), key)) {
+            return VAL(n, i) == value ? n : set_slot(n, edit, 2 * i + 1, value);
+        }
+        uint64_t other;
+        hash_key(KEY(n, i), &other);
+        MapNode *child = map_pair(edit, shift + BITS, KEY(n, i), VAL(n, i), other, key, value, h);
+        *added = 1;
+        return entry_to_child(n, edit, bit, child);
+    }
+    if (n->nodemap & bit) {
+        int j = 2 * entry_count(n) + index_of(n->nodemap, bit);
+        MapNode *child = n->slots[j];
+        MapNode *updated = map_assoc(child, edit, shift + BITS, key, value, h, added);
+        return updated == child ? n : set_slot(n, edit, j, updated);
+    }
+    *added = 1;
+    return insert_entry(n, edit, bit, key, value);
+}
+
+static int single_entry(MapNode *n) {
+    return n->ncollide ? n->ncollide == 1 : n->nodemap == 0 && __builtin_popcount(n->datamap) == 1;
+}
+
+// n without key; NULL if that leaves it empty. A child always holds at least
+// two entries, so only the root can become empty.
+static MapNode *map_dissoc(MapNode *n, uint64_t edit, int shift, sExpr *key, uint64_t h, int *removed) {
+    if (n->ncollide) {
+        for (uint32_t i = 0; i < n->ncollide; i++) {
+            if (!same_key(KEY(n, i), key)) continue;
+            int k = 2 * n->ncollide;
+            MapNode *c = map_node(edit, 0, 0, k - 2);
+            c->ncollide = n->ncollide - 1;
+            memcpy(c->slots, n->slots, sizeof(void *) * 2 * i);
+            memcpy(c->slots + 2 * i, n->slots + 2 * i + 2, sizeof(void *) * (k - 2 * i - 2));
+            retire(n, edit);
+            *removed = 1;
+            return c;
+        }
+        return n;
+    }
+
+    uint32_t bit = bit_at(h, shift);
+    if (n->datamap & bit) {
+        if (!same_key(KEY(n, index_of(n->datamap, bit)), key)) return n;
+        *removed = 1;
+        if (slot_count(n) == 2) {
+            retire(n, edit);
+            return NULL;
+        }
+        return remove_entry(n, edit, bit);
+    }
+    if (n->nodemap & bit) {
+        int j = 2 * entry_count(n) + index_of(n->nodemap, bit);
+        MapNode *child = n->slots[j];
+        MapNode *updated = map_dissoc(child, edit, shift + BITS, key, h, removed);
+        if (updated == child) return n;
+        if (single_entry(updated)) {
+            sExpr *k = KEY(updated, 0), *v = VAL(updated, 0);
+            retire(updated, edit);
+            return child_to_entry(n, edit, bit, k, v);
+        }
+        return set_slot(n, edit, j, updated);
+    }
+    return n;
+}
+
+static sExpr *map_find(MapNode *n, sExpr *key, uint64_t h) {
+    for (int shift = 0; n; shift += BITS) {
+        if (n->ncollide) {
+            for (uint32_t i = 0; i < n->ncollide; i++) {
+                if (same_key(KEY(n, i), key)) return VAL(n, i);
+            }
+            return NULL;
+        }
+        uint32_t bit = bit_at(h, shift);
+        if (n->datamap & bit) {
+            int i = index_of(n->datamap, bit);
+            return same_key(KEY(n, i), key) ? VAL(n, i) : NULL;
+        }
+        if (!(n->nodemap & bit)) return NULL;
+        n = n->slots[2 * entry_count(n) + index_of(n->nodemap, bit)];
+    }
+    return NULL;
+}
+
+static void map_walk(MapNode *n, void (*fn)(sExpr *key, sExpr *value, void *ctx), void *ctx) {
+    if (!n) return;
+    int entries = entry_count(n), k = slot_count(n);
+    for (int i = 0; i < entries; i++) fn(KEY(n, i), VAL(n, i), ctx);
+    for (int j = 2 * entries; j < k; j++) map_walk(n->slots[j], fn, ctx);
+}
+
+static sExpr *wrap_map(MapNode *root, size_t count, uint64_t edit) {
+    PMap *m = malloc(sizeof(PMap));
+    allocated_bytes += sizeof(PMap);
+    m->root = root;
+    m->count = count;
+    m->edit = edit;
+    sExpr *e = alloc_sExpr(TYPE_PMAP);
+    e->value.pmap = m;
+    return e;
+}
+
+sExpr *create_pmap(void) {
+    return wrap_map(NULL, 0, 0);
+}
+
+// A new version of map with key bound to value, or map itself updated if it
+// is transient. NULL if key can't be a key (see hash_key).
+sExpr *pmap_assoc(sExpr *map, sExpr *key, sExpr *value) {
+    uint64_t h;
+    if (!hash_key(key, &h)) return NULL;
+    PMap *m = map->value.pmap;
+    int added = 0;
+    MapNode *root;
+    if (m->root) {
+        root = map_assoc(m->root, m->edit, 0, key, value, h, &added);
+    } else {
+        root = map_node(m->edit, bit_at(h, 0), 0, 2);
+        root->slots[0] = key;
+        root->slots[1] = value;
+        added = 1;
+    }
+    if (m->edit) {
+        m->root = root;
+        m->count += added;
+        return map;
+    }
+    return root == m->root ? map : wrap_map(root, m->count + added, 0);
+}
+
+sExpr *pmap_dissoc(sExpr *map, sExpr *key) {
+    uint64_t h;
+    PMap *m = map->value.pmap;
+    if (!m->root || !hash_key(key, &h)) return map;
+    int removed = 0;
+    MapNode *root = map_dissoc(m->root, m->edit, 0, key, h, &removed);
+    if (m->edit) {
+        m->root = root;
+        m->count -= removed;
+        return map;
+    }
+    return removed ? wrap_map(root, m->count - 1, 0) : map;
+}
+
+// The value bound to key, or NULL
+sExpr *pmap_get(PMap *m, sExpr *key) {
+    uint64_t h;
+    if (!hash_key(key, &h)) return NULL;
+    return map_find(m->root, key, h);
+}
+
+size_t pmap_count(PMap *m) {
+    return m->count;
+}
+
+// Calls fn on every entry, in no particular order
+void pmap_each(PMap *m, void (*fn)(sExpr *key, sExpr *value, void *ctx), void *ctx) {
+    map_walk(m->root, fn, ctx);
+}
+
+static void push_key(sExpr *key, sExpr *value, void *ctx) {
+    (void)value;
+    sExpr **list = ctx;
+    *list = cons(key, *list);
+}
+
+sExpr *pmap_keys(PMap *m) {
+    sExpr *keys = NIL;
+    pmap_each(m, push_key, &keys);
+    return keys;
+}
+
+// Vectors
+
+static VecNode *vec_node(uint64_t edit) {
+    VecNode *n = calloc(1, sizeof(VecNode));
+    allocated_bytes += sizeof(VecNode);
+    n->edit = edit;
+    return n;
+}
+
+static VecNode *vec_editable(VecNode *n, uint64_t edit) {
+    if (edit && n->edit == edit) return n;
+    VecNode *c = vec_node(edit);
+    memcpy(c->slots, n->slots, sizeof(c->slots));
+    return c;
+}
+
+// Index of the first element in the tail
+static size_t tail_offset(size_t count) {
+    return count < WIDTH ? 0 : ((count - 1) >> BITS) << BITS;
+}
+
+// Chain of single-child nodes from level shift down to leaf
+static VecNode *new_path(uint64_t edit, int shift, VecNode *leaf) {
+    if (shift == 0) return leaf;
+    VecNode *n = vec_node(edit);
+    n->slots[0] = new_path(edit, shift - BITS, leaf);
+    return n;
+}
+
+// parent (at level shift, possibly NULL) with leaf added as the leaf that
+// ends at element count - 1
+static VecNode *push_tail(uint64_t edit, int shift, VecNode *parent, size_t count, VecNode *leaf) {
+    VecNode *n = parent ? vec_editable(parent, edit) : vec_node(edit);
+    size_t sub = ((count - 1) >> shift) & MASK;
+    if (shift == BITS) {
+        n->slots[sub] = leaf;
+    } else {
+        VecNode *child = n->slots[sub];
+        n->slots[sub] = child ? push_tail(edit, shift - BITS, child, count, leaf)
+                              : new_path(edit, shift - BITS, leaf);
+    }
+    return n;
+}
+
+static VecNode *vec_set(uint64_t edit, int shift, VecNode *n, size_t i, sExpr *x) {
+    VecNode *c = vec_editable(n, edit);
+    if (shift == 0) {
+        c->slots[i & MASK] = x;
+    } else {
+        size_t sub = (i >> shift) & MASK;
+        c->slots[sub] = vec_set(edit, shift - BITS, n->slots[sub], i, x);
+    }
+    return c;
+}
+
+static sExpr *wrap_vec(PVec *fields) {
+    PVec *v = malloc(sizeof(PVec));
+    allocated_bytes += sizeof(PVec);
+    *v = *fields;
+    sExpr *e = alloc_sExpr(TYPE_PVEC);
+    e->value.pvec = v;
+    return e;
+}
+
+// A transient takes the new fields in place; a persistent vector gets a new
+// version holding them
+static sExpr *vec_update(sExpr *vec, PVec *fields) {
+    if (vec->value.pvec->edit) {
+        *vec->value.pvec = *fields;
+        return vec;
+    }
+    return wrap_vec(fields);
+}
+
+sExpr *create_pvec(void) {
+    PVec v = { NULL, NULL, 0, BITS, 0 };
+    return wrap_vec(&v);
+}
+
+sExpr *pvec_conj(sExpr *vec, sExpr *x) {
+    PVec *v = vec->value.pvec;
+    PVec r = *v;
+    size_t in_tail = v->count - tail_offset(v->count);
+    if (in_tail < WIDTH) {
+        r.tail = v->tail ? vec_editable(v->tail, v->edit) : vec_node(v->edit);
+        r.tail->slots[in_tail] = x;
+    } else {
+        if ((v->count >> BITS) > ((size_t)1 << v->shift)) {
+            // The root is full: grow a level
+            r.root = vec_node(v->edit);
+            r.root->slots[0] = v->root;
+            r.root->slots[1] = new_path(v->edit, v->shift, v->tail);
+            r.shift += BITS;
+        } else {
+            r.root = push_tail(v->edit, v->shift, v->root, v->count, v->tail);
+        }
+        r.tail = vec_node(v->edit);
+        r.tail->slots[0] = x;
+    }
+    r.count++;
+    return vec_update(vec, &r);
+}
+
+// Element i replaced by x; i may be the count, to add at the end. NULL if i
+// is past that.
+sExpr *pvec_assoc(sExpr *vec, size_t i, sExpr *x) {
+    PVec *v = vec->value.pvec;
+    if (i == v->count) return pvec_conj(vec, x);
+    if (i > v->count) return NULL;
+    PVec r = *v;
+    if (i >= tail_offset(v->count)) {
+        r.tail = vec_editable(v->tail, v->edit);
+        r.tail->slots[i & MASK] = x;
+    } else {
+        r.root = vec_set(v->edit, v->shift, v->root, i, x);
+    }
+    return vec_update(vec, &r);
+}
+
+// Element i, or NULL if out of range
+sExpr *pvec_nth(PVec *v, size_t i) {
+    if (i >= v->count) return NULL;
+    if (i >= tail_offset(v->count)) return v->tail->slots[i & MASK];
+    VecNode *n = v->root;
+    for (int shift = v->shift; shift > 0; shift -= BITS) n = n->slots[(i >> shift) & MASK];
+    return n->slots[i & MASK];
+}
+
+size_t pvec_count(PVec *v) {
+    return v->count;
+}
+
+sExpr *pvec_to_list(PVec *v) {
+    sExpr *list = NIL;
+    for (size_t i = v->count; i > 0; i--) list = cons(pvec_nth(v, i - 1), list);
+    return list;
+}
+
+// Transients
+
+int is_transient(sExpr *coll) {
+    if (type_of(coll) == TYPE_PMAP) return coll->value.pmap->edit != 0;
+    if (type_of(coll) == TYPE_PVEC) return coll->value.pvec->edit != 0;
+    return 0;
+}
+
+// A transient copy of a persistent collection, or NULL
+sExpr *make_transient(sExpr *coll) {
+    if (is_transient(coll)) return NULL;
+    if (type_of(coll) == TYPE_PMAP) {
+        PMap *m = coll->value.pmap;
+        return wrap_map(m->root, m->count, ++last_edit);
+    }
+    if (type_of(coll) == TYPE_PVEC) {
+        PVec r = *coll->value.pvec;
+        r.edit = ++last_edit;
+        return wrap_vec(&r);
+    }
+    return NULL;
+}
+
+// Freezes a transient and returns it, or NULL if coll isn't one
+sExpr *make_persistent(sExpr *coll) {
+    if (!is_transient(coll)) return NULL;
+    if (type_of(coll) == TYPE_PMAP) coll->value.pmap->edit = 0;
+    else coll->value.pvec->edit = 0;
+    return coll;
+}
+
+void free_pmap(PMap *m) {
+    free(m);
+}
+
+void free_pvec(PVec *v) {
+    free(v);
+}
+
+static void print_entry(sExpr *key, sExpr *value, void *ctx) {
+    int *first = ctx;
+    printf(*first ? "(" : " (");
+    print_sExpr(key);
+    printf(" . ");
+    print_sExpr(value);
+    printf(")");
+    *first = 0;
+}
+
+void print_pmap(PMap *m) {
+    int first = 1;
+    printf("#map(");
+    pmap_each(m, print_entry, &first);
+    printf(")");
+}
+
+void print_pvec(PVec *v) {
+    printf("#vector(");
+    for (size_t i = 0; i < v->count; i++) {
+        if (i > 0) printf(" ");
+        print_sExpr(pvec_nth(v, i));
+    }
+    printf(")");
+}
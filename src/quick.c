@@ -0,0 +1,313 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "sexpr.h"
+
+// Quickening
+//
+// The first time eval runs certain calls, it replaces the operator symbol at
+// the call site with a quick node that remembers what the call turned out to
+// be, much as macro calls are replaced by their expansion:
+//   - arithmetic and comparisons on two arguments first run generically and
+//     record the operand types, then specialize to an int/int or
+//     double/double variant that skips type dispatch
+//   - if and set skip the builtin name lookup
+//   - a call to a global function caches the lambda, guarded by global_epoch
+// Symbol arguments of a quickened call that name a parameter of the running
+// lambda become quick nodes too, reading the parameter's slot directly.
+//
+// Every variant checks its assumption and falls back when it doesn't hold:
+// arithmetic on other types goes back to the generic variant (and stops
+// specializing after a few misses), a stale global call re-resolves or turns
+// back into a plain call, and a slot read from another frame does a normal
+// lookup. Printing, saving and comparing a quick node all see its symbol.
+
+#define MAX_MISSES 4
+
+typedef enum {
+    Q_ARITH, Q_ARITH_INT, Q_ARITH_DOUBLE,   // op on two arguments
+    Q_IF,
+    Q_SET,
+    Q_CALL,                                 // global function
+    Q_LOCAL                                 // parameter slot
+} QuickKind;
+
+typedef enum { OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_MOD, OP_LT, OP_GT, OP_LTE, OP_GTE, OP_EQ } Op;
+
+struct Quick {
+    QuickKind kind;
+    Op op;
+    sExpr *symbol;      // the symbol this node replaced
+    sExpr *target;      // Q_CALL: cached lambda
+    long epoch;         // Q_CALL: global_epoch when target was cached
+    sExpr *params;      // Q_LOCAL: parameter list of the frame
+    int slot;           // Q_LOCAL: index in that frame
+    int misses;
+};
+
+long global_epoch = 0;
+
+static const char *op_names[] = { "+", "-", "*", "/", "%", "<", ">", "<=", ">=", "=" };
+
+static sExpr *make_quick(QuickKind kind, sExpr *symbol) {
+    Quick *q = calloc(1, sizeof(Quick));
+    q->kind = kind;
+    q->symbol = symbol;
+    sExpr *e = alloc_sExpr(TYPE_QUICK);
+    e->value.quick = q;
+    return e;
+}
+
+void free_quick(Quick *q) {
+    free_sExpr(q->symbol);
+    free(q);
+}
+
+sExpr *quick_symbol(sExpr *e) {
+    return e->value.quick->symbol;
+}
+
+// Parameter names
+//
+// A global call can only be cached if no call frame could bind the same
+// name, and with dynamic scoping any frame might. So every name ever used
+// as a parameter is recorded, and functions with those names aren't cached.
+// Slot frames reuse their lambda's parameter list, so lists already seen
+// are remembered by address and cost one probe per call.
+
+static HashTable *param_names;
+static struct {
+    sExpr **keys;
+    size_t cap;
+    size_t count;
+} seen_lists;
+
+int is_param_name(sExpr *sym) {
+    return param_names && hash_get(param_names, sym) != NULL;
+}
+
+static void add_names(sExpr *params) {
+    if (!param_names) param_names = hash_new(64);
+    for (; type_of(params) == TYPE_CONS; params = cdr(params)) {
+        sExpr *name = param_name(car(params));
+        if (!issymbol(name) || hash_get(param_names, name)) continue;
+        hash_set(param_names, name, TRUE);
+        global_epoch++; // a cached call might be to this name
+        inline_invalidate(name);
+    }
+}
+
+static size_t ptr_slot(sExpr **keys, size_t cap, sExpr *p) {
+    size_t i = ((uintptr_t)p >> 4) * 0x9e3779b97f4a7c15ULL & (cap - 1);
+    while (keys[i] && keys[i] != p) i = (i + 1) & (cap - 1);
+    return i;
+}
+
+void note_params(sExpr *params, int stable) {
+    if (isnil(params)) return;
+    if (!stable) {
+        add_names(params);
+        return;
+    }
+    if (seen_lists.cap && seen_lists.keys[ptr_slot(seen_lists.keys, seen_lists.cap, params)]) return;
+
+    if ((seen_lists.count + 1) * 2 > seen_lists.cap) {
+        size_t cap = seen_lists.cap ? seen_lists.cap * 2 : 256;
+        sExpr **keys = calloc(cap, sizeof(sExpr *));
+        for (size_t i = 0; i < seen_lists.cap; i++) {
+            sExpr *k = seen_lists.keys[i];
+            if (k) keys[ptr_slot(keys, cap, k)] = k;
+        }
+        free(seen_lists.keys);
+        seen_lists.keys = keys;
+        seen_lists.cap = cap;
+    }
+    seen_lists.keys[ptr_slot(seen_lists.keys, seen_lists.cap, params)] = params;
+    seen_lists.count++;
+    add_names(params);
+}
+
+// Installing quick nodes
+
+// Shared (hash-consed) code can't be rewritten
+static int can_rewrite(sExpr *expr) {
+    return !is_hash_consed(expr);
+}
+
+// Replaces symbol arguments that name a parameter of the running lambda
+static void quicken_args(sExpr *args) {
+    for (; type_of(args) == TYPE_CONS; args = cdr(args)) {
+        sExpr *arg = car(args);
+        if (!issymbol(arg)) continue;
+        sExpr *params;
+        int slot = local_slot_of(arg, &params);
+        if (slot < 0) continue;
+        sExpr *q = make_quick(Q_LOCAL, arg);
+        q->value.quick->params = params;
+        q->value.quick->slot = slot;
+        args->value.cons.car = q;
+    }
+}
+
+static int op_of(const char *sym) {
+    for (int i = 0; i < (int)(sizeof(op_names) / sizeof(op_names[0])); i++) {
+        if (strcmp(sym, op_names[i]) == 0) return i;
+    }
+    return -1;
+}
+
+// Quickens a builtin call. Returns 0 if sym isn't one that is quickened.
+int quicken_builtin(sExpr *expr, const char *sym) {
+    if (!can_rewrite(expr)) return 0;
+    sExpr *q;
+    int op = op_of(sym);
+    if (op >= 0) {
+        q = make_quick(Q_ARITH, car(expr));
+        q->value.quick->op = (Op)op;
+    } else if (strcmp(sym, "if") == 0) {
+        q = make_quick(Q_IF, car(expr));
+    } else if (strcmp(sym, "set") == 0) {
+        q = make_quick(Q_SET, car(expr));
+    } else {
+        return 0;
+    }
+    expr->value.cons.car = q;
+    // set's first argument is the name being assigned, not a read of it
+    quicken_args(q->value.quick->kind == Q_SET ? cdr(cdr(expr)) : cdr(expr));
+    return 1;
+}
+
+// Quickens a call to the global function target, if its name can't be
+// rebound by a call frame
+void quicken_call(sExpr *expr, sExpr *target) {
+    sExpr *sym = car(expr);
+    if (!can_rewrite(expr) || is_param_name(sym) || lookup_local(sym)) return;
+    sExpr *q = make_quick(Q_CALL, sym);
+    q->value.quick->target = target;
+    q->value.quick->epoch = global_epoch;
+    expr->value.cons.car = q;
+    quicken_args(cdr(expr));
+}
+
+// Turns a call site back into its original form
+static sExpr *unquicken(sExpr *expr) {
+    sExpr *q = car(expr);
+    expr->value.cons.car = q->value.quick->symbol;
+    q->value.quick->symbol = NULL;
+    return expr;
+}
+
+// Running quick nodes
+
+static sExpr *generic_op(Op op, sExpr *a, sExpr *b) {
+    switch (op) {
+        case OP_ADD: return add(a, b);
+        case OP_SUB: return sub(a, b);
+        case OP_MUL: return mul(a, b);
+        case OP_DIV: return divide(a, b);
+        case OP_MOD: return mod(a, b);
+        case OP_LT:  return lt(a, b);
+        case OP_GT:  return gt(a, b);
+        case OP_LTE: return lte(a, b);
+        case OP_GTE: return gte(a, b);
+        case OP_EQ:  return eq(a, b);
+    }
+    return NIL;
+}
+
+static sExpr *int_op(Op op, long x, long y) {
+    switch (op) {
+        case OP_ADD: return create_int(x + y);
+        case OP_SUB: return create_int(x - y);
+        case OP_MUL: return create_int(x * y);
+        case OP_DIV: return y == 0 ? NIL : create_double((double)x / (double)y);
+        case OP_MOD: return y == 0 ? NIL : create_int(x % y);
+        case OP_LT:  return x < y ? TRUE : NIL;
+        case OP_GT:  return x > y ? TRUE : NIL;
+        case OP_LTE: return x <= y ? TRUE : NIL;
+        case OP_GTE: return x >= y ? TRUE : NIL;
+        case OP_EQ:  return x == y ? TRUE : NIL;
+    }
+    return NIL;
+}
+
+static sExpr *double_op(Op op, double x, double y) {
+    switch (op) {
+        case OP_ADD: return create_double(x + y);
+        case OP_SUB: return create_double(x - y);
+        case OP_MUL: return create_double(x * y);
+        case OP_DIV: return y == 0 ? NIL : create_double(x / y);
+        case OP_MOD: return NIL;
+        case OP_LT:  return x < y ? TRUE : NIL;
+        case OP_GT:  return x > y ? TRUE : NIL;
+        case OP_LTE: return x <= y ? TRUE : NIL;
+        case OP_GTE: return x >= y ? TRUE : NIL;
+        case OP_EQ:  return x == y ? TRUE : NIL;
+    }
+    return NIL;
+}
+
+static sExpr *run_arith(Quick *q, sExpr *args) {
+    sExpr *a = eval(car(args));
+    sExpr *b = eval(car(cdr(args)));
+    int ints = type_of(a) == TYPE_INT && type_of(b) == TYPE_INT;
+    int doubles = type_of(a) == TYPE_DOUBLE && type_of(b) == TYPE_DOUBLE;
+
+    if (q->kind == Q_ARITH_INT) {
+        if (ints) return int_op(q->op, a->value.integer, b->value.integer);
+        q->kind = Q_ARITH;
+        q->misses++;
+    } else if (q->kind == Q_ARITH_DOUBLE) {
+        if (doubles) return double_op(q->op, a->value.dbl, b->value.dbl);
+        q->kind = Q_ARITH;
+        q->misses++;
+    } else if (q->misses < MAX_MISSES) {
+        if (ints) q->kind = Q_ARITH_INT;
+        else if (doubles && q->op != OP_MOD) q->kind = Q_ARITH_DOUBLE;
+    }
+    return generic_op(q->op, a, b);
+}
+
+// Evaluates a call whose operator has been quickened
+sExpr *eval_quick_call(sExpr *expr) {
+    Quick *q = car(expr)->value.quick;
+    sExpr *args = cdr(expr);
+
+    switch (q->kind) {
+        case Q_ARITH:
+        case Q_ARITH_INT:
+        case Q_ARITH_DOUBLE:
+            return run_arith(q, args);
+
+        case Q_IF:
+            if (!isnil(eval(car(args)))) return eval(car(cdr(args)));
+            return eval(car(cdr(cdr(args))));
+
+        case Q_SET: {
+            sExpr *val = eval(car(cdr(args)));
+            if (assign_local(car(args), val)) return val;
+            return set(car(args), val);
+        }
+
+        case Q_CALL:
+            if (q->epoch != global_epoch) {
+                sExpr *target = is_param_name(q->symbol) ? NULL : lookup_stack(q->symbol);
+                if (!target || !islambda(target)) return eval(unquicken(expr));
+                q->target = target;
+                q->epoch = global_epoch;
+            }
+            return apply_lambda(q->target, args);
+
+        case Q_LOCAL:
+            break;
+    }
+    return eval(unquicken(expr));
+}
+
+// Evaluates a quick node in argument position
+sExpr *eval_quick_ref(sExpr *e) {
+    Quick *q = e->value.quick;
+    sExpr *val = local_slot(q->params, q->slot);
+    return val ? val : eval(q->symbol);
+}
@@ -0,0 +1,381 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include "sexpr.h"
+
+// Incremental reload
+//
+// (reload "file") splits the file into its top-level forms without parsing
+// it, and hashes the text of each form (with runs of whitespace outside
+// strings counted as one space, so reindenting changes nothing). Hashes are
+// remembered per file, and on the next reload only forms whose hash is new
+// are parsed and evaluated. Moving a form around doesn't count as a change.
+//
+// To keep the globals consistent, a form that mentions a name bound by a
+// re-evaluated define, set or defmacro is re-evaluated too, after it in
+// file order. Functions look globals up when they run, so most of these are
+// defines, which only store their lambda again; the point is forms like
+// (set table (build 100)) whose value was computed from an older version.
+//
+// Bindings made by forms that were deleted from the file are left alone.
+//
+// --watch file reloads the file whenever it is written, using inotify on
+// its directory since many editors replace the file rather than write it.
+
+typedef struct {
+    uint64_t hash;
+    char **refs;        // sorted, distinct symbol names in the form
+    int nrefs;
+    char *binds;        // global the form defines or sets, if any
+} FormInfo;
+
+typedef struct LoadedFile {
+    char *path;
+    FormInfo *forms;
+    int count;
+    struct LoadedFile *next;
+} LoadedFile;
+
+static LoadedFile *loaded = NULL;
+
+typedef struct {
+    size_t start;
+    size_t end;
+} Span;
+
+static size_t skip_string(const char *text, size_t i) {
+    for (i++; text[i] && text[i] != '"'; i++) {}
+    return text[i] ? i + 1 : i;
+}
+
+// Finds the next top-level form at or after *pos; 0 at the end of text
+static int next_span(const char *text, size_t *pos, Span *span) {
+    size_t i = *pos;
+    while (isspace((unsigned char)text[i])) i++;
+    if (!text[i]) return 0;
+    span->start = i;
+
+    // Quote prefixes belong to the form after them
+    while (text[i] == '\'' || text[i] == '`' || text[i] == ',' || text[i] == '@') i++;
+    while (isspace((unsigned char)text[i])) i++;
+
+    if (text[i] == '(') {
+        int depth = 0;
+        while (text[i]) {
+            if (text[i] == '"') {
+                i = skip_string(text, i);
+                continue;
+            }
+            if (text[i] == '(') depth++;
+            else if (text[i] == ')') depth--;
+            i++;
+            if (depth == 0) break;
+        }
+    } else if (text[i] == '"') {
+        i = skip_string(text, i);
+    } else if (text[i] == ')') {
+        i++; // stray; the parser will complain about it
+    } else {
+        while (text[i] && !isspace((unsigned char)text[i]) && text[i] != '(' && text[i] != ')') i++;
+    }
+    span->end = i;
+    *pos = i;
+    return 1;
+}
+
+static uint64_t span_hash(const char *text, Span s) {
+    uint64_t h = FNV_INIT;
+    int in_string = 0;
+    for (size_t i = s.start; i < s.end; i++) {
+        unsigned char c = (unsigned char)text[i];
+        if (c == '"') in_string = !in_string;
+        if (!in_string && isspace(c)) {
+            while (i + 1 < s.end && isspace((unsigned char)text[i + 1])) i++;
+            c = ' ';
+        }
+        h = fnv1a(h, &c, 1);
+    }
+    return h;
+}
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static int refers_to(FormInfo *info, const char *name) {
+    return bsearch(&name, info->refs, (size_t)info->nrefs, sizeof(char *), compare_names) != NULL;
+}
+
+// Records the symbols in form and the global it binds
+static void describe(sExpr *form, FormInfo *info) {
+    size_t cap = 64, n = 0, nrefs = 0, refs_cap = 16;
+    sExpr **stack = malloc(sizeof(sExpr *) * cap);
+    char **refs = malloc(sizeof(char *) * refs_cap);
+    stack[n++] = form;
+    while (n > 0) {
+        sExpr *e = stack[--n];
+        if (issymbol(e)) {
+            if (nrefs == refs_cap) {
+                refs_cap *= 2;
+                refs = realloc(refs, sizeof(char *) * refs_cap);
+            }
+            refs[nrefs++] = e->value.symbol;
+        } else if (type_of(e) == TYPE_CONS) {
+            if (n + 2 > cap) {
+                cap *= 2;
+                stack = realloc(stack, sizeof(sExpr *) * cap);
+            }
+            stack[n++] = e->value.cons.cdr;
+            stack[n++] = e->value.cons.car;
+        }
+    }
+    free(stack);
+
+    qsort(refs, nrefs, sizeof(char *), compare_names);
+    size_t kept = 0;
+    for (size_t i = 0; i < nrefs; i++) {
+        if (kept == 0 || strcmp(refs[kept - 1], refs[i]) != 0) refs[kept++] = refs[i];
+    }
+    for (size_t i = 0; i < kept; i++) refs[i] = strdup(refs[i]);
+    info->refs = refs;
+    info->nrefs = (int)kept;
+
+    info->binds = NULL;
+    sExpr *head = type_of(form) == TYPE_CONS ? car(form) : NIL;
+    sExpr *name = type_of(form) == TYPE_CONS ? car(cdr(form)) : NIL;
+    if (issymbol(head) && issymbol(name) &&
+        (strcmp(head->value.symbol, "define") == 0 || strcmp(head->value.symbol, "set") == 0 ||
+         strcmp(head->value.symbol, "defmacro") == 0)) {
+        info->binds = strdup(name->value.symbol);
+    }
+}
+
+static void free_info(FormInfo *info) {
+    for (int i = 0; i < info->nrefs; i++) free(info->refs[i]);
+    free(info->refs);
+    free(info->binds);
+}
+
+static char *read_text(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) return NULL;
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char *text = malloc(size > 0 ? (size_t)size + 1 : 1);
+    size_t n = size > 0 ? fread(text, 1, (size_t)size, f) : 0;
+    text[n] = '\0';
+    fclose(f);
+    return text;
+}
+
+static LoadedFile *file_record(const char *path) {
+    for (LoadedFile *lf = loaded; lf; lf = lf->next) {
+        if (strcmp(lf->path, path) == 0) return lf;
+    }
+    LoadedFile *lf = calloc(1, sizeof(LoadedFile));
+    lf->path = strdup(path);
+    lf->next = loaded;
+    loaded = lf;
+    return lf;
+}
+
+typedef struct {
+    uint64_t hash;
+    int index;
+} OldForm;
+
+static int compare_old(const void *a, const void *b) {
+    const OldForm *x = a, *y = b;
+    if (x->hash != y->hash) return x->hash < y->hash ? -1 : 1;
+    return x->index - y->index;
+}
+
+// Index of an unclaimed old form with this hash, or -1. old is sorted by
+// hash, and by position among equal hashes.
+static int claim_old(OldForm *old, int n, char *claimed, uint64_t hash) {
+    int lo = 0, hi = n;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (old[mid].hash < hash) lo = mid + 1;
+        else hi = mid;
+    }
+    for (; lo < n && old[lo].hash == hash; lo++) {
+        if (!claimed[old[lo].index]) {
+            claimed[old[lo].index] = 1;
+            return old[lo].index;
+        }
+    }
+    return -1;
+}
+
+// Evaluates the forms of path that changed since the last reload, and the
+// forms that depend on them. Returns how many were evaluated, or -1 if path
+// can't be read.
+int reload_file(const char *path) {
+    char *text = read_text(path);
+    if (!text) return -1;
+    LoadedFile *lf = file_record(path);
+
+    size_t cap = 64, count = 0, pos = 0;
+    Span *spans = malloc(sizeof(Span) * cap);
+    Span span;
+    while (next_span(text, &pos, &span)) {
+        if (count == cap) {
+            cap *= 2;
+            spans = realloc(spans, sizeof(Span) * cap);
+        }
+        spans[count++] = span;
+    }
+
+    OldForm *old = malloc(sizeof(OldForm) * (lf->count ? (size_t)lf->count : 1));
+    for (int i = 0; i < lf->count; i++) old[i] = (OldForm){ lf->forms[i].hash, i };
+    qsort(old, (size_t)lf->count, sizeof(OldForm), compare_old);
+
+    FormInfo *forms = calloc(count ? count : 1, sizeof(FormInfo));
+    char *claimed = calloc(lf->count ? (size_t)lf->count : 1, 1);
+    int *old_index = malloc(sizeof(int) * (count ? count : 1));
+    for (size_t i = 0; i < count; i++) {
+        forms[i].hash = span_hash(text, spans[i]);
+        old_index[i] = claim_old(old, lf->count, claimed, forms[i].hash);
+    }
+    free(old);
+
+    // Names rebound by this reload
+    size_t ndirty = 0, dirty_cap = 16;
+    char **dirty = malloc(sizeof(char *) * dirty_cap);
+    int evaluated = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        int run = old_index[i] < 0;
+        if (!run) {
+            forms[i] = lf->forms[old_index[i]];
+            lf->forms[old_index[i]].refs = NULL;
+            lf->forms[old_index[i]].nrefs = 0;
+            lf->forms[old_index[i]].binds = NULL;
+            for (size_t d = 0; d < ndirty && !run; d++) run = refers_to(&forms[i], dirty[d]);
+        }
+        if (!run) continue;
+
+        size_t len = spans[i].end - spans[i].start;
+        char *src = malloc(len + 1);
+        memcpy(src, text + spans[i].start, len);
+        src[len] = '\0';
+        sExpr *parsed = parse_forms(src);
+        free(src);
+
+        uint64_t h = forms[i].hash;
+        free_info(&forms[i]);
+        forms[i].hash = h;
+        forms[i].refs = NULL;
+        forms[i].nrefs = 0;
+        forms[i].binds = NULL;
+        if (isnil(parsed)) continue;
+        describe(car(parsed), &forms[i]);
+
+        eval(optimize_toplevel(car(parsed)));
+        evaluated++;
+        if (forms[i].binds) {
+            if (ndirty == dirty_cap) {
+                dirty_cap *= 2;
+                dirty = realloc(dirty, sizeof(char *) * dirty_cap);
+            }
+            dirty[ndirty++] = forms[i].binds;
+        }
+    }
+
+    for (int i = 0; i < lf->count; i++) free_info(&lf->forms[i]);
+    free(lf->forms);
+    lf->forms = forms;
+    lf->count = (int)count;
+
+    free(dirty);
+    free(old_index);
+    free(claimed);
+    free(spans);
+    free(text);
+    return evaluated;
+}
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static void reload_and_report(const char *path) {
+    double start = now_ms();
+    int n = reload_file(path);
+    if (n < 0) printf("reload: cannot read %s\n", path);
+    else printf("reload: %d form%s in %.1f ms\n", n, n == 1 ? "" : "s", now_ms() - start);
+    fflush(stdout);
+}
+
+// yisp --watch: loads path, then reloads it each time it is written.
+// Lines typed meanwhile are passed to on_line. Returns when stdin closes.
+int watch_file(const char *path, void (*on_line)(char *line)) {
+    char dir[4096];
+    const char *slash = strrchr(path, '/');
+    const char *base = slash ? slash + 1 : path;
+    if (slash) snprintf(dir, sizeof(dir), "%.*s", (int)(slash - path), path);
+    else strcpy(dir, ".");
+    if (dir[0] == '\0') strcpy(dir, "/");
+
+    int fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0 || inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0) {
+        perror("watch: inotify");
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+
+    reload_and_report(path);
+    printf("> ");
+    fflush(stdout);
+
+    struct pollfd fds[2] = { { fd, POLLIN, 0 }, { STDIN_FILENO, POLLIN, 0 } };
+    char line[1024];
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (fds[0].revents & POLLIN) {
+            // Editors produce several events per save; reload once for all
+            // the events that are already queued
+            char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+            int changed = 0;
+            ssize_t n;
+            while ((n = read(fd, buf, sizeof(buf))) > 0) {
+                for (char *p = buf; p < buf + n;) {
+                    struct inotify_event *ev = (struct inotify_event *)p;
+                    if (ev->len > 0 && strcmp(ev->name, base) == 0) changed = 1;
+                    p += sizeof(struct inotify_event) + ev->len;
+                }
+                struct pollfd more = { fd, POLLIN, 0 };
+                if (poll(&more, 1, 0) <= 0) break;
+            }
+            if (changed) {
+                printf("\n");
+                reload_and_report(path);
+                printf("> ");
+                fflush(stdout);
+            }
+        }
+        if (fds[1].revents & (POLLIN | POLLHUP)) {
+            if (!fgets(line, sizeof(line), stdin)) break;
+            line[strcspn(line, "\n")] = '\0';
+            if (line[0]) on_line(line);
+            printf("> ");
+            fflush(stdout);
+        }
+    }
+    close(fd);
+    return 0;
+}
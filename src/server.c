@@ -0,0 +1,275 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "sexpr.h"
+
+// Evaluation server
+//
+// yisp --serve path.sock loads the prelude once, then keeps a pool of forked
+// workers waiting in accept() on a Unix socket. Each worker answers exactly
+// one request and exits, and the master forks a replacement from its own
+// untouched heap. The result is that every request starts from the warm
+// prelude state without anything being reloaded or reset: whatever a request
+// defines or allocates disappears with its worker. Forking happens between
+// requests, off the request path.
+//
+// Frames on the wire are a status byte, a 4-byte big-endian length and the
+// payload. A request is source text; the response holds everything the forms
+// printed, followed by each form's result as in script mode.
+
+#define STATUS_OK 0
+#define STATUS_TIMEOUT 1
+#define MAX_FRAME (64u << 20)
+
+static int conn_fd = -1;
+static volatile sig_atomic_t stopping = 0;
+
+// write() until done; usable from a signal handler
+static int write_all(int fd, const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int read_all(int fd, void *data, size_t len) {
+    char *p = data;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int send_frame(int fd, int status, const char *data, size_t len) {
+    unsigned char head[5] = {
+        (unsigned char)status,
+        (unsigned char)(len >> 24), (unsigned char)(len >> 16),
+        (unsigned char)(len >> 8), (unsigned char)len
+    };
+    if (write_all(fd, head, sizeof(head)) < 0) return -1;
+    return write_all(fd, data, len);
+}
+
+// Reads one frame into a malloc'd, NUL-terminated buffer
+static char *recv_frame(int fd, int *status, size_t *len) {
+    unsigned char head[5];
+    if (read_all(fd, head, sizeof(head)) < 0) return NULL;
+    uint32_t n = ((uint32_t)head[1] << 24) | ((uint32_t)head[2] << 16) |
+                 ((uint32_t)head[3] << 8) | head[4];
+    if (n > MAX_FRAME) return NULL;
+
+    char *data = malloc((size_t)n + 1);
+    if (read_all(fd, data, n) < 0) {
+        free(data);
+        return NULL;
+    }
+    data[n] = '\0';
+    *status = head[0];
+    *len = n;
+    return data;
+}
+
+static void on_timeout(int sig) {
+    (void)sig;
+    static const char msg[] = "timeout\n";
+    send_frame(conn_fd, STATUS_TIMEOUT, msg, sizeof(msg) - 1);
+    _exit(1);
+}
+
+// Evaluates src with stdout sent to a temporary file, and sends back what
+// was written
+static void handle_request(const char *src, int timeout_secs) {
+    FILE *out = tmpfile();
+    if (!out) {
+        send_frame(conn_fd, STATUS_OK, "", 0);
+        return;
+    }
+    fflush(stdout);
+    dup2(fileno(out), STDOUT_FILENO);
+
+    signal(SIGALRM, on_timeout);
+    if (timeout_secs > 0) alarm((unsigned)timeout_secs);
+
+    for (sExpr *forms = parse_forms(src); !isnil(forms); forms = cdr(forms)) {
+        const char *error;
+        sExpr *result = eval_bounded(optimize_toplevel(car(forms)), &error);
+        if (result) print_sExpr(result);
+        else printf("error: %s", error);
+        printf("\n");
+    }
+    fflush(stdout);
+    alarm(0);
+
+    long size = lseek(fileno(out), 0, SEEK_END);
+    char *text = malloc(size > 0 ? (size_t)size : 1);
+    lseek(fileno(out), 0, SEEK_SET);
+    if (size < 0 || read_all(fileno(out), text, (size_t)size) < 0) size = 0;
+    send_frame(conn_fd, STATUS_OK, text, (size_t)size);
+    free(text);
+    fclose(out);
+}
+
+static void worker(int listen_fd, int timeout_secs, const sigset_t *mask) {
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGPIPE, SIG_IGN);
+    sigprocmask(SIG_SETMASK, mask, NULL);
+
+    do {
+        conn_fd = accept(listen_fd, NULL, NULL);
+    } while (conn_fd < 0 && errno == EINTR);
+    if (conn_fd < 0) _exit(1);
+    close(listen_fd);
+
+    int status;
+    size_t len;
+    char *src = recv_frame(conn_fd, &status, &len);
+    if (src) handle_request(src, timeout_secs);
+    close(conn_fd);
+    trace_at_exit(); // _exit skips atexit handlers
+    _exit(0);
+}
+
+static pid_t spawn_worker(int listen_fd, int timeout_secs) {
+    // A stop signal sent to a worker before it resets its handlers would
+    // only set stopping, leaving it in accept forever, so hold them off
+    sigset_t stop, old;
+    sigemptyset(&stop);
+    sigaddset(&stop, SIGINT);
+    sigaddset(&stop, SIGTERM);
+    sigprocmask(SIG_BLOCK, &stop, &old);
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) worker(listen_fd, timeout_secs, &old);
+    if (pid < 0) perror("serve: fork");
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    return pid;
+}
+
+static void on_stop(int sig) {
+    (void)sig;
+    stopping = 1;
+}
+
+// Runs until SIGINT or SIGTERM. prelude may be NULL.
+int serve(const char *sock_path, const char *prelude, int workers, int timeout_secs) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(sock_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "serve: socket path too long: %s\n", sock_path);
+        return -1;
+    }
+    strcpy(addr.sun_path, sock_path);
+
+    if (prelude) load_file(prelude);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("serve: socket");
+        return -1;
+    }
+    unlink(sock_path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 128) < 0) {
+        perror("serve: bind");
+        close(fd);
+        return -1;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_stop; // no SA_RESTART, so waitpid returns on a signal
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    if (workers < 1) workers = 1;
+    pid_t *pids = calloc((size_t)workers, sizeof(pid_t));
+    for (int i = 0; i < workers; i++) pids[i] = spawn_worker(fd, timeout_secs);
+
+    while (!stopping) {
+        pid_t pid = waitpid(-1, NULL, 0);
+        if (pid < 0 && errno != EINTR) {
+            sleep(1); // every fork failed; try again
+        }
+        for (int i = 0; i < workers && !stopping; i++) {
+            if (pids[i] == pid || pids[i] < 0) pids[i] = spawn_worker(fd, timeout_secs);
+        }
+    }
+
+    for (int i = 0; i < workers; i++) {
+        if (pids[i] > 0) kill(pids[i], SIGTERM);
+    }
+    while (waitpid(-1, NULL, 0) > 0) {}
+    free(pids);
+    close(fd);
+    unlink(sock_path);
+    return 0;
+}
+
+// Sends src to the server and appends the response to out. Returns the
+// response status, or -1 if the server couldn't be reached or hung up.
+int client_request(const char *sock_path, const char *src, size_t len, StringBuilder *out) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(sock_path) >= sizeof(addr.sun_path)) return -1;
+    strcpy(addr.sun_path, sock_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        send_frame(fd, STATUS_OK, src, len) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    int status;
+    size_t n;
+    char *data = recv_frame(fd, &status, &n);
+    close(fd);
+    if (!data) return -1;
+    builder_append(out, data, n);
+    free(data);
+    return status;
+}
+
+// yisp --client: sends stdin as one request and prints the response
+int run_client(const char *sock_path) {
+    StringBuilder *src = builder_new();
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), stdin)) > 0) builder_append(src, buf, n);
+
+    size_t len;
+    const char *text = builder_data(src, &len);
+    StringBuilder *out = builder_new();
+    int status = client_request(sock_path, text, len, out);
+    free_builder(src);
+
+    if (status < 0) {
+        fprintf(stderr, "client: no response from %s\n", sock_path);
+        free_builder(out);
+        return 1;
+    }
+    const char *result = builder_data(out, &len);
+    fwrite(result, 1, len, status == STATUS_OK ? stdout : stderr);
+    free_builder(out);
+    return status == STATUS_OK ? 0 : 1;
+}
@@ -1,10 +1,23 @@
 #ifndef SEXPR_H
 #define SEXPR_H
 
-typedef enum { TYPE_INT, TYPE_DOUBLE, TYPE_STRING, TYPE_SYMBOL, TYPE_CONS, TYPE_NIL } sExprType;
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+typedef enum { TYPE_INT, TYPE_DOUBLE, TYPE_STRING, TYPE_SYMBOL, TYPE_CONS, TYPE_NIL, TYPE_HASH, TYPE_BUILDER, TYPE_PROMISE, TYPE_QUICK, TYPE_GENERATOR, TYPE_PMAP, TYPE_PVEC, TYPE_NATIVE } sExprType;
+
+typedef struct HashTable HashTable;
+typedef struct StringBuilder StringBuilder;
+typedef struct Promise Promise;
+typedef struct Quick Quick;
+typedef struct Generator Generator;
+typedef struct PMap PMap;
+typedef struct PVec PVec;
+typedef struct Native Native;
+typedef struct EvalStack EvalStack;
 
 typedef struct sExpr {
-    sExprType type;
     union {
         long integer;
         double dbl;
@@ -14,9 +27,33 @@ typedef struct sExpr {
             struct sExpr *car;
             struct sExpr *cdr;
         } cons;
+        HashTable *hash;
+        StringBuilder *builder;
+        Promise *promise;
+        Quick *quick;
+        Generator *generator;
+        PMap *pmap;
+        PVec *pvec;
+        Native *native;
     } value;
+    sExprType type;     // missing from compact conses: read it with type_of()
 } sExpr;
 
+// Compact cons cells hold only value.cons and live in one reserved region,
+// which is what marks them as conses
+extern char *cons_region;
+extern size_t cons_region_size;
+
+#define is_compact_cons(e) ((size_t)((const char *)(e) - cons_region) < cons_region_size)
+
+// Macros rather than inline functions so that they cost no call in an
+// unoptimized build, where every type test would otherwise become one.
+// type_of evaluates e twice.
+#define type_of(e) (is_compact_cons(e) ? TYPE_CONS : (e)->type)
+
+sExpr* alloc_cons(void);
+void free_cell(sExpr *e);
+
 extern sExpr *NIL;
 extern sExpr *TRUE;
 extern sExpr *global_env;
@@ -34,12 +71,42 @@ sExpr* set(sExpr* symbol, sExpr* value);
 sExpr* push_env(sExpr* params, sExpr* args);
 void pop_env();
 sExpr* lookup_stack(sExpr* symbol);
+sExpr* lookup_local(sExpr* symbol);
+sExpr* lookup_global(sExpr* symbol);
+sExpr* apply_values(sExpr* fn, sExpr** args, int n);
+sExpr* apply_lambda(sExpr* lambda_expr, sExpr* args);
+int islambda(sExpr* e);
+int local_slot_of(sExpr* symbol, sExpr** params);
+sExpr* local_slot(sExpr* params, int slot);
+sExpr* eval_in_frame(sExpr* form, sExpr* params, sExpr** args, int n);
+sExpr* param_name(sExpr* param);
+void open_frame(sExpr* params, int n);
+void bind_local(sExpr* value);
+void set_local(int i, sExpr* value);
+sExpr* get_local(int i);
+int assign_local(sExpr* symbol, sExpr* value);
+
+// Call frame stacks (one per generator, plus the main one)
+EvalStack* eval_stack_new(void);
+void eval_stack_free(EvalStack* s);
+EvalStack* eval_stack_switch(EvalStack* s);
+
+// Position of the call frame stack, for unwinding back to it
+typedef struct {
+    EvalStack *stack;
+    int nframes;
+    int nslots;
+} StackMark;
+StackMark stack_mark(void);
+void stack_restore(StackMark mark);
 
 TokenStream tokenize(const char* input);
 void free_tokens(TokenStream *ts);
 sExpr* parse_sexpr(TokenStream *ts);
 
 // Constructors 
+extern _Thread_local size_t allocated_bytes; // per thread, so a parser thread's don't count against eval
+sExpr* alloc_sExpr(sExprType type);
 sExpr* create_int(long value);
 sExpr* create_double(double value);
 sExpr* create_string(const char *value);
@@ -78,4 +145,192 @@ sExpr* not_sExpr(sExpr *a);
 
 sExpr* eval(sExpr *expr);
 
+// Strings (length and hash are cached in front of the characters)
+#define FNV_INIT 0xcbf29ce484222325ULL
+uint64_t fnv1a(uint64_t h, const void *data, size_t len);
+char* alloc_string(const char *data, size_t len);
+void free_string(char *s);
+sExpr* create_string_len(const char *data, size_t len);
+size_t string_length(sExpr *s);
+uint64_t string_hash(sExpr *s);
+int string_equal(sExpr *a, sExpr *b);
+sExpr* string_append(sExpr *strings);
+sExpr* substring(sExpr *s, long start, long end);
+
+// String builders
+StringBuilder* builder_new(void);
+sExpr* create_builder(void);
+void free_builder(StringBuilder *b);
+void builder_append(StringBuilder *b, const char *data, size_t len);
+int builder_append_value(StringBuilder *b, sExpr *v);
+const char* builder_data(StringBuilder *b, size_t *len);
+sExpr* builder_to_string(StringBuilder *b);
+
+// Hash tables (keyed by eq)
+sExpr* create_hash(size_t capacity);
+HashTable* hash_new(size_t capacity);
+void hash_free(HashTable *t);
+sExpr* hash_get(HashTable *t, sExpr *key);
+int hash_set(HashTable *t, sExpr *key, sExpr *value);
+int hash_remove(HashTable *t, sExpr *key);
+size_t hash_count(HashTable *t);
+sExpr* hash_keys(HashTable *t);
+void hash_each(HashTable *t, void (*fn)(sExpr *key, sExpr *value, void *ctx), void *ctx);
+void print_hash(HashTable *t);
+int hash_key(sExpr *key, uint64_t *out);
+
+// Persistent maps and vectors (shared structure, transients for bulk updates)
+sExpr* create_pmap(void);
+sExpr* pmap_assoc(sExpr *map, sExpr *key, sExpr *value);
+sExpr* pmap_dissoc(sExpr *map, sExpr *key);
+sExpr* pmap_get(PMap *m, sExpr *key);
+size_t pmap_count(PMap *m);
+void pmap_each(PMap *m, void (*fn)(sExpr *key, sExpr *value, void *ctx), void *ctx);
+sExpr* pmap_keys(PMap *m);
+sExpr* create_pvec(void);
+sExpr* pvec_conj(sExpr *vec, sExpr *x);
+sExpr* pvec_assoc(sExpr *vec, size_t i, sExpr *x);
+sExpr* pvec_nth(PVec *v, size_t i);
+size_t pvec_count(PVec *v);
+sExpr* pvec_to_list(PVec *v);
+int is_transient(sExpr *coll);
+sExpr* make_transient(sExpr *coll);
+sExpr* make_persistent(sExpr *coll);
+void free_pmap(PMap *m);
+void free_pvec(PVec *v);
+void print_pmap(PMap *m);
+void print_pvec(PVec *v);
+
+// Quickening (call sites that specialize themselves)
+extern long global_epoch;
+void note_params(sExpr *params, int stable);
+int is_param_name(sExpr *sym);
+int quicken_builtin(sExpr *expr, const char *sym);
+void quicken_call(sExpr *expr, sExpr *target);
+sExpr* eval_quick_call(sExpr *expr);
+sExpr* eval_quick_ref(sExpr *e);
+sExpr* quick_symbol(sExpr *e);
+void free_quick(Quick *q);
+
+// Evaluation budgets (0 = unlimited)
+typedef struct {
+    long max_steps;
+    long max_ms;
+    size_t max_bytes;
+    long max_depth;
+} Budget;
+extern Budget eval_limits;
+extern int budget_active;
+void budget_enter(void);
+void budget_leave(void);
+void budget_step(void);
+sExpr* eval_bounded(sExpr *form, const char **error);
+
+// Checks at lambda application, macro expansion and loop points; one branch
+// when no budget
+#define BUDGET_ENTER() do { if (budget_active) budget_enter(); } while (0)
+#define BUDGET_LEAVE() do { if (budget_active) budget_leave(); } while (0)
+#define BUDGET_STEP() do { if (budget_active) budget_step(); } while (0)
+
+// Call tracing (ring buffer of call events, written as Chrome trace JSON)
+extern int trace_enabled;
+void trace_start(const char *path);
+int trace_claim(sExpr *expr);
+sExpr* trace_call(sExpr *expr);
+int trace_mark(void);
+void trace_unwind(int mark);
+int trace_dump(const char *path);
+void trace_at_exit(void);
+
+// Hash-consing (shared canonical copies of immutable data)
+extern int hash_cons_reader;
+sExpr* hash_cons(sExpr *e);
+sExpr* hash_cons_fresh(sExpr *e);
+int is_hash_consed(sExpr *e);
+sExpr* equal(sExpr *a, sExpr *b);
+
+// Promises and streams
+sExpr* make_promise(sExpr *expr);
+sExpr* make_native_promise(sExpr *(*thunk)(void *state), void *state);
+void free_promise(Promise *p);
+sExpr* force(sExpr *e);
+sExpr* stream_cdr(sExpr *s);
+int fresh_stream(sExpr *form);
+sExpr* stream_map(sExpr *fn, sExpr *s, int fresh);
+sExpr* stream_filter(sExpr *pred, sExpr *s, int fresh);
+sExpr* stream_take(sExpr *s, long n, int fresh);
+sExpr* stream_fold(sExpr *fn, sExpr *acc, sExpr *s, int fresh);
+sExpr* stream_to_list(sExpr *s, int fresh);
+sExpr* file_lines(const char *path);
+sExpr* file_forms(const char *path);
+void capture_locals(sExpr *expr, sExpr **params, sExpr **values);
+
+// Generators (coroutines with their own C stack and call frames)
+sExpr* make_generator(sExpr *fn);
+sExpr* generator_next(sExpr *gen);
+sExpr* generator_yield(sExpr *gen, sExpr *value);
+int generator_done(sExpr *gen);
+void free_generator(Generator *g);
+void generators_unwind(void);
+char* generator_stack_low(void);
+
+// Native functions, registered by a program embedding Yisp (libyisp.h)
+typedef sExpr* (*NativeFn)(sExpr **args, int n, void *ctx);
+sExpr* create_native(const char *name, NativeFn fn, void *ctx);
+const char* native_name(Native *n);
+sExpr* apply_native(sExpr *native, sExpr **args, int n);
+sExpr* call_native(sExpr *native, sExpr *arg_forms);
+void free_native(Native *n);
+
+// Local variables and loops
+sExpr* eval_body(sExpr *forms);
+sExpr* eval_let(sExpr *args, int sequential);
+sExpr* eval_while(sExpr *args);
+int only_arith_uses(sExpr *body, sExpr *var);
+sExpr* eval_dotimes(sExpr *args);
+sExpr* eval_dolist(sExpr *args);
+sExpr* eval_do(sExpr *args);
+
+// Macros
+int ismacro(sExpr *e);
+sExpr* macro_for_call(sExpr *expr);
+sExpr* expand_macro(sExpr *macro, sExpr *args);
+sExpr* expand_in_place(sExpr *expr, sExpr *macro);
+sExpr* macroexpand(sExpr *form);
+sExpr* quasiquote(sExpr *tmpl);
+
+// Inlining of small global functions into the functions that call them
+sExpr* inline_calls(sExpr *name, sExpr *lambda);
+void inline_invalidate(sExpr *name);
+sExpr* inline_source(sExpr *value);
+
+// Optimizer (constant folding and dead branch removal)
+extern int dump_optimized;
+sExpr* optimize(sExpr *expr);
+sExpr* optimize_toplevel(sExpr *expr);
+
+// Compiler to C
+int compile_to_c(const char *src_path, const char *out_path);
+
+// Heap images
+int save_image(const char *path);
+int load_image(const char *path);
+
+// Source loading (load keeps <file>.yc form caches)
+sExpr* parse_forms(const char *text);
+sExpr* load_forms(const char *path, int cache);
+sExpr* load_file(const char *path);
+
+// Incremental reload (only changed top-level forms are evaluated again)
+int reload_file(const char *path);
+int watch_file(const char *path, void (*on_line)(char *line));
+
+// Pipelined batch mode (reader, evaluator and writer threads)
+int run_batch(FILE *in, FILE *out, int (*run_form)(sExpr *form));
+
+// Evaluation server
+int serve(const char *sock_path, const char *prelude, int workers, int timeout_secs);
+int client_request(const char *sock_path, const char *src, size_t len, StringBuilder *out);
+int run_client(const char *sock_path);
+
 #endif
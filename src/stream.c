@@ -0,0 +1,406 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sexpr.h"
+
+// Promises and streams
+//
+// (delay expr) makes a promise; (force p) evaluates expr the first time and
+// returns the saved value after that. Parameters of the calls in progress
+// that expr mentions are copied into the promise when it is made, since those
+// calls will usually have returned by the time it is forced.
+//
+// A stream is () or a cons whose cdr is a promise of the rest of the stream.
+// The stream builtins produce their results one element at a time: each cell
+// they return holds a native promise that computes the next cell from the
+// source stream when forced, so nothing is built before it is asked for.
+//
+// Promises are memoized, so a stream held in a variable can be walked any
+// number of times and keeps every cell forced so far. A stream passed
+// straight from one builtin to another, as in
+// (stream-fold f 0 (stream-map g (file-lines "big"))), can't be held by
+// anything else, though: the builtin reading it frees each of its cells once
+// passed, and a file line or form too once the function it was handed to
+// can't have kept it (see only_arith_uses). Walking such a pipeline holds
+// about one element at a time.
+
+struct Promise {
+    sExpr *expr;                    // form to evaluate, NULL when native
+    sExpr *params;                  // captured bindings for expr
+    sExpr *values;
+    sExpr *(*thunk)(void *state);   // native producer
+    void *state;
+    sExpr *value;                   // NULL until forced
+    int fresh_head;                 // the car of the cell holding this promise
+                                    // was made for it, by a native producer
+};
+
+static sExpr *wrap(Promise *p) {
+    sExpr *e = alloc_sExpr(TYPE_PROMISE);
+    e->value.promise = p;
+    return e;
+}
+
+static int contains(sExpr *list, sExpr *sym) {
+    for (; !isnil(list); list = cdr(list)) {
+        if (strcmp(car(list)->value.symbol, sym->value.symbol) == 0) return 1;
+    }
+    return 0;
+}
+
+// Collects the symbols in expr that are bound by a call in progress
+void capture_locals(sExpr *expr, sExpr **params, sExpr **values) {
+    if (issymbol(expr)) {
+        sExpr *val = lookup_local(expr);
+        if (val && !contains(*params, expr)) {
+            *params = cons(expr, *params);
+            *values = cons(val, *values);
+        }
+        return;
+    }
+    for (; type_of(expr) == TYPE_CONS; expr = cdr(expr)) capture_locals(car(expr), params, values);
+    if (issymbol(expr)) capture_locals(expr, params, values);
+}
+
+sExpr *make_promise(sExpr *expr) {
+    Promise *p = calloc(1, sizeof(Promise));
+    p->expr = expr;
+    p->params = NIL;
+    p->values = NIL;
+    capture_locals(expr, &p->params, &p->values);
+    return wrap(p);
+}
+
+sExpr *make_native_promise(sExpr *(*thunk)(void *state), void *state) {
+    Promise *p = calloc(1, sizeof(Promise));
+    p->thunk = thunk;
+    p->state = state;
+    return wrap(p);
+}
+
+void free_promise(Promise *p) {
+    free(p);
+}
+
+// Runs the producer of a native promise. Its state is freed as it is used,
+// so it runs only once: forcing p again from inside it gives ()
+static sExpr *run_native(Promise *p) {
+    sExpr *(*thunk)(void *state) = p->thunk;
+    void *state = p->state;
+    p->thunk = NULL;
+    p->state = NULL;
+    p->value = NIL;
+    return thunk(state);
+}
+
+// Anything that isn't a promise forces to itself
+sExpr *force(sExpr *e) {
+    if (type_of(e) != TYPE_PROMISE) return e;
+    Promise *p = e->value.promise;
+    if (p->value) return p->value;
+
+    if (p->thunk) {
+        sExpr *value = run_native(p);
+        p->value = value;
+        return value;
+    }
+
+    push_env(p->params, p->values);
+    sExpr *value = eval(p->expr);
+    pop_env();
+
+    // Forcing expr may have forced p too; the first value wins
+    if (!p->value) {
+        p->value = value;
+        p->expr = NULL;
+        p->params = p->values = NIL;
+    }
+    return p->value;
+}
+
+sExpr *stream_cdr(sExpr *s) {
+    return type_of(s) == TYPE_CONS ? force(cdr(s)) : NIL;
+}
+
+static sExpr *call1(sExpr *fn, sExpr *x) {
+    return apply_values(fn, &x, 1);
+}
+
+// Nonzero if calling fn can't keep its argument number i
+static int drops_arg(sExpr *fn, int i) {
+    if (!islambda(fn)) return 0;
+    sExpr *params = car(cdr(fn));
+    for (; i > 0 && type_of(params) == TYPE_CONS; i--) params = cdr(params);
+    return type_of(params) == TYPE_CONS && only_arith_uses(cdr(cdr(fn)), car(params));
+}
+
+// A native producer's cell: head made by it or not
+static sExpr *stream_cell(sExpr *head, int fresh, sExpr *(*next)(void *), void *state) {
+    sExpr *rest = make_native_promise(next, state);
+    rest->value.promise->fresh_head = fresh;
+    return cons(head, rest);
+}
+
+// Nonzero if form makes a new stream that only its caller can reach: a call
+// to a stream builtin, rather than a variable holding a stream
+int fresh_stream(sExpr *form) {
+    static const char *makers[] = { "stream-map", "stream-filter", "stream-take",
+                                    "file-lines", "file-forms" };
+    if (type_of(form) != TYPE_CONS) return 0;
+    sExpr *op = car(form);
+    if (type_of(op) == TYPE_QUICK) op = quick_symbol(op);
+    if (!issymbol(op)) return 0;
+    for (size_t i = 0; i < sizeof(makers) / sizeof(makers[0]); i++) {
+        if (strcmp(op->value.symbol, makers[i]) == 0) return 1;
+    }
+    return 0;
+}
+
+// Nonzero if the car of s, a cell of a fresh stream, belongs to the stream
+static int owns_head(sExpr *s, int fresh) {
+    return fresh && type_of(s) == TYPE_CONS && type_of(cdr(s)) == TYPE_PROMISE &&
+           cdr(s)->value.promise->fresh_head;
+}
+
+// The cell after s. A cell of a fresh stream is freed along with its
+// promise, but not its car, once the next one is forced.
+static sExpr *next_cell(sExpr *s, int fresh) {
+    sExpr *next = stream_cdr(s);
+    if (fresh && type_of(s) == TYPE_CONS) {
+        free_sExpr(cdr(s));
+        free_cell(s);
+    }
+    return next;
+}
+
+// Native producers. Their state is the function they apply and the source
+// cell they are at.
+
+typedef struct {
+    sExpr *fn;          // map function or filter predicate
+    int drops;          // fn can't keep its argument
+    long n;             // elements left to take
+    sExpr *source;
+    int fresh;          // source is a fresh stream
+} Step;
+
+static sExpr *map_step(Step *st);
+static sExpr *filter_step(Step *st);
+static sExpr *take_step(Step *st);
+
+static Step *new_step(sExpr *fn, sExpr *source, int fresh) {
+    Step *st = malloc(sizeof(Step));
+    st->fn = fn;
+    st->drops = drops_arg(fn, 0);
+    st->n = 0;
+    st->source = source;
+    st->fresh = fresh;
+    return st;
+}
+
+static void advance(Step *st) {
+    st->source = next_cell(st->source, st->fresh);
+}
+
+// A take that stops early leaves its source unforced
+static sExpr *end_step(Step *st) {
+    if (st->fresh && type_of(st->source) == TYPE_CONS) {
+        free_sExpr(cdr(st->source));
+        free_cell(st->source);
+    }
+    free(st);
+    return NIL;
+}
+
+static sExpr *map_next(void *state) {
+    Step *st = state;
+    advance(st);
+    return map_step(st);
+}
+
+static sExpr *map_step(Step *st) {
+    sExpr *s = st->source;
+    if (type_of(s) != TYPE_CONS) return end_step(st);
+    sExpr *head = call1(st->fn, car(s));
+    if (st->drops && owns_head(s, st->fresh)) free_sExpr(car(s));
+    return stream_cell(head, 0, map_next, st);
+}
+
+static sExpr *filter_next(void *state) {
+    Step *st = state;
+    advance(st);
+    return filter_step(st);
+}
+
+static sExpr *filter_step(Step *st) {
+    while (type_of(st->source) == TYPE_CONS && isnil(call1(st->fn, car(st->source)))) {
+        BUDGET_STEP();
+        if (st->drops && owns_head(st->source, st->fresh)) free_sExpr(car(st->source));
+        advance(st);
+    }
+    sExpr *s = st->source;
+    if (type_of(s) != TYPE_CONS) return end_step(st);
+    return stream_cell(car(s), owns_head(s, st->fresh), filter_next, st);
+}
+
+static sExpr *take_next(void *state) {
+    Step *st = state;
+    if (st->n <= 0) return end_step(st); // don't force past the end
+    advance(st);
+    return take_step(st);
+}
+
+static sExpr *take_step(Step *st) {
+    sExpr *s = st->source;
+    if (st->n <= 0 || type_of(s) != TYPE_CONS) return end_step(st);
+    st->n--;
+    return stream_cell(car(s), owns_head(s, st->fresh), take_next, st);
+}
+
+sExpr *stream_map(sExpr *fn, sExpr *s, int fresh) {
+    return map_step(new_step(fn, s, fresh));
+}
+
+sExpr *stream_filter(sExpr *pred, sExpr *s, int fresh) {
+    return filter_step(new_step(pred, s, fresh));
+}
+
+sExpr *stream_take(sExpr *s, long n, int fresh) {
+    Step *st = new_step(NIL, s, fresh);
+    st->n = n;
+    return take_step(st);
+}
+
+// (fn acc x) over every element, front to back
+sExpr *stream_fold(sExpr *fn, sExpr *acc, sExpr *s, int fresh) {
+    int drops = drops_arg(fn, 1);
+    while (type_of(s) == TYPE_CONS) {
+        BUDGET_STEP();
+        sExpr *args[2] = { acc, car(s) };
+        acc = apply_values(fn, args, 2);
+        if (drops && owns_head(s, fresh)) free_sExpr(car(s));
+        s = next_cell(s, fresh);
+    }
+    return acc;
+}
+
+sExpr *stream_to_list(sExpr *s, int fresh) {
+    sExpr *head = NIL;
+    sExpr *tail = NIL;
+    while (type_of(s) == TYPE_CONS) {
+        BUDGET_STEP();
+        sExpr *cell = cons(car(s), NIL);
+        if (isnil(head)) head = cell;
+        else tail->value.cons.cdr = cell;
+        tail = cell;
+        s = next_cell(s, fresh);
+    }
+    return head;
+}
+
+// File streams
+
+typedef struct {
+    FILE *f;
+    sExpr *pending;     // forms already parsed but not yet returned
+} FileStream;
+
+static int read_line(FileStream *fs, StringBuilder *b) {
+    char buf[4096];
+    int got = 0;
+    while (fgets(buf, sizeof(buf), fs->f)) {
+        got = 1;
+        size_t n = strlen(buf);
+        builder_append(b, buf, n);
+        if (n > 0 && buf[n - 1] == '\n') break;
+    }
+    return got;
+}
+
+static sExpr *end_of_file(FileStream *fs) {
+    fclose(fs->f);
+    free(fs);
+    return NIL;
+}
+
+static sExpr *lines_next(void *state) {
+    FileStream *fs = state;
+    StringBuilder *b = builder_new();
+    if (!read_line(fs, b)) {
+        free_builder(b);
+        return end_of_file(fs);
+    }
+
+    size_t len;
+    const char *text = builder_data(b, &len);
+    if (len > 0 && text[len - 1] == '\n') len--;
+    sExpr *line = create_string_len(text, len);
+    free_builder(b);
+    return stream_cell(line, 1, lines_next, fs);
+}
+
+// Paren depth after text, ignoring parens inside strings
+static int depth_after(const char *text, size_t len, int depth) {
+    int in_string = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (text[i] == '"') in_string = !in_string;
+        else if (!in_string && text[i] == '(') depth++;
+        else if (!in_string && text[i] == ')') depth--;
+    }
+    return depth;
+}
+
+static int is_blank(const char *text, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (text[i] != ' ' && text[i] != '\t' && text[i] != '\n' && text[i] != '\r') return 0;
+    }
+    return 1;
+}
+
+// Reads lines until they hold one or more complete forms
+static sExpr *forms_next(void *state) {
+    FileStream *fs = state;
+    if (isnil(fs->pending)) {
+        StringBuilder *b = builder_new();
+        int depth = 0;
+        size_t seen = 0;
+        size_t len;
+        const char *text;
+        while (read_line(fs, b)) {
+            text = builder_data(b, &len);
+            depth = depth_after(text + seen, len - seen, depth);
+            seen = len;
+            if (depth <= 0 && !is_blank(text, len)) break;
+        }
+        text = builder_data(b, &len);
+        if (!is_blank(text, len)) fs->pending = parse_forms(text);
+        free_builder(b);
+        if (isnil(fs->pending)) return end_of_file(fs);
+    }
+
+    sExpr *done = fs->pending;
+    sExpr *form = car(done);
+    fs->pending = cdr(done);
+    free_cell(done);
+    return stream_cell(form, 1, forms_next, fs);
+}
+
+static sExpr *open_stream(const char *path, sExpr *(*next)(void *)) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        printf("cannot open %s\n", path);
+        return NIL;
+    }
+    FileStream *fs = malloc(sizeof(FileStream));
+    fs->f = f;
+    fs->pending = NIL;
+    return next(fs);
+}
+
+sExpr *file_lines(const char *path) {
+    return open_stream(path, lines_next);
+}
+
+sExpr *file_forms(const char *path) {
+    return open_stream(path, forms_next);
+}
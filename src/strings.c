@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "sexpr.h"
+
+// Strings
+//
+// value.string points at NUL-terminated characters, so it can still be handed
+// to printf and friends, but every string is allocated with a header in front
+// holding its length and hash. Both are computed once when the string is made.
+
+typedef struct {
+    size_t len;
+    uint64_t hash;
+    char data[];
+} StringHeader;
+
+#define HEADER(s) ((StringHeader *)((s) - offsetof(StringHeader, data)))
+
+struct StringBuilder {
+    char *buf;
+    size_t len;
+    size_t cap;
+};
+
+// FNV-1a over len bytes, continuing from h: FNV_INIT for a fresh hash.
+// Every hash of text or bytes in the interpreter goes through here.
+uint64_t fnv1a(uint64_t h, const void *data, size_t len) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+char *alloc_string(const char *data, size_t len) {
+    StringHeader *h = malloc(sizeof(StringHeader) + len + 1);
+    allocated_bytes += sizeof(StringHeader) + len + 1;
+    h->len = len;
+    h->hash = fnv1a(FNV_INIT, data, len);
+    memcpy(h->data, data, len);
+    h->data[len] = '\0';
+    return h->data;
+}
+
+void free_string(char *s) {
+    free(HEADER(s));
+}
+
+sExpr *create_string_len(const char *data, size_t len) {
+    sExpr *e = alloc_sExpr(TYPE_STRING);
+    e->value.string = alloc_string(data, len);
+    return e;
+}
+
+size_t string_length(sExpr *s) {
+    return HEADER(s->value.string)->len;
+}
+
+uint64_t string_hash(sExpr *s) {
+    return HEADER(s->value.string)->hash;
+}
+
+int string_equal(sExpr *a, sExpr *b) {
+    StringHeader *x = HEADER(a->value.string);
+    StringHeader *y = HEADER(b->value.string);
+    return x->len == y->len && x->hash == y->hash && memcmp(x->data, y->data, x->len) == 0;
+}
+
+// Concatenates a list of strings with a single allocation. NIL if any
+// element isn't a string.
+sExpr *string_append(sExpr *strings) {
+    size_t total = 0;
+    for (sExpr *it = strings; !isnil(it); it = cdr(it)) {
+        if (!isstring(car(it))) return NIL;
+        total += string_length(car(it));
+    }
+
+    StringHeader *h = malloc(sizeof(StringHeader) + total + 1);
+    allocated_bytes += sizeof(StringHeader) + total + 1;
+    size_t off = 0;
+    for (sExpr *it = strings; !isnil(it); it = cdr(it)) {
+        size_t n = string_length(car(it));
+        memcpy(h->data + off, car(it)->value.string, n);
+        off += n;
+    }
+    h->len = total;
+    h->hash = fnv1a(FNV_INIT, h->data, total);
+    h->data[total] = '\0';
+
+    sExpr *e = alloc_sExpr(TYPE_STRING);
+    e->value.string = h->data;
+    return e;
+}
+
+// Characters [start, end) of s; NIL if the range doesn't fit
+sExpr *substring(sExpr *s, long start, long end) {
+    long len = (long)string_length(s);
+    if (start < 0 || end < start || end > len) return NIL;
+    return create_string_len(s->value.string + start, (size_t)(end - start));
+}
+
+// String builders
+
+StringBuilder *builder_new(void) {
+    StringBuilder *b = malloc(sizeof(StringBuilder));
+    b->cap = 64;
+    b->len = 0;
+    b->buf = malloc(b->cap);
+    b->buf[0] = '\0';
+    return b;
+}
+
+sExpr *create_builder(void) {
+    sExpr *e = alloc_sExpr(TYPE_BUILDER);
+    e->value.builder = builder_new();
+    return e;
+}
+
+void free_builder(StringBuilder *b) {
+    free(b->buf);
+    free(b);
+}
+
+// Grows by doubling, so appends are amortized O(1)
+void builder_append(StringBuilder *b, const char *data, size_t len) {
+    if (b->len + len + 1 > b->cap) {
+        size_t old_cap = b->cap;
+        while (b->len + len + 1 > b->cap) b->cap *= 2;
+        allocated_bytes += b->cap - old_cap;
+        b->buf = realloc(b->buf, b->cap);
+    }
+    memcpy(b->buf + b->len, data, len);
+    b->len += len;
+    b->buf[b->len] = '\0';
+}
+
+// Appends the text of a string, symbol or number. Returns 0 for anything else.
+int builder_append_value(StringBuilder *b, sExpr *v) {
+    char num[64];
+    switch (type_of(v)) {
+        case TYPE_STRING:
+            builder_append(b, v->value.string, string_length(v));
+            return 1;
+        case TYPE_SYMBOL:
+            builder_append(b, v->value.symbol, strlen(v->value.symbol));
+            return 1;
+        case TYPE_INT:
+            builder_append(b, num, (size_t)snprintf(num, sizeof(num), "%ld", v->value.integer));
+            return 1;
+        case TYPE_DOUBLE:
+            builder_append(b, num, (size_t)snprintf(num, sizeof(num), "%f", v->value.dbl));
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+const char *builder_data(StringBuilder *b, size_t *len) {
+    *len = b->len;
+    return b->buf;
+}
+
+sExpr *builder_to_string(StringBuilder *b) {
+    return create_string_len(b->buf, b->len);
+}
@@ -3,7 +3,12 @@
 #include <string.h>
 #include <math.h>
 #include <ctype.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <malloc.h>
 #include "sexpr.h"
+#include "libyisp.h"
 
 // Counters
 int tests_passed = 0;
@@ -16,8 +21,8 @@ void assert_int_equal(long expected, sExpr *actual, const char *msg) {
         tests_failed++;
         return;
     }
-    if ((actual->type == TYPE_INT && actual->value.integer == expected) ||
-        (actual->type == TYPE_DOUBLE && actual->value.dbl == expected)) {
+    if ((type_of(actual) == TYPE_INT && actual->value.integer == expected) ||
+        (type_of(actual) == TYPE_DOUBLE && actual->value.dbl == expected)) {
         printf("[PASS] %s\n", msg);
         tests_passed++;
     } else {
@@ -34,8 +39,8 @@ void assert_double_equal(double expected, sExpr *actual, const char *msg) {
         tests_failed++;
         return;
     }
-    double val = (actual->type == TYPE_DOUBLE) ? actual->value.dbl :
-                 (actual->type == TYPE_INT ? actual->value.integer : 0.0);
+    double val = (type_of(actual) == TYPE_DOUBLE) ? actual->value.dbl :
+                 (type_of(actual) == TYPE_INT ? actual->value.integer : 0.0);
     if (fabs(val - expected) < 1e-6) {
         printf("[PASS] %s\n", msg);
         tests_passed++;
@@ -47,24 +52,51 @@ void assert_double_equal(double expected, sExpr *actual, const char *msg) {
     }
 }
 
-int sExpr_equal(sExpr *a, sExpr *b) {
-    if (a == b) return 1;        
+static int atom_equal(sExpr *a, sExpr *b) {
+    if (a == b) return 1;
     if (!a || !b) return 0;
-    if (a->type != b->type) return 0;
+    if (type_of(a) == TYPE_QUICK) a = quick_symbol(a);  // quickened call sites
+    if (type_of(b) == TYPE_QUICK) b = quick_symbol(b);
+    if (type_of(a) != type_of(b)) return 0;
 
-    switch (a->type) {
+    switch (type_of(a)) {
         case TYPE_INT:    return a->value.integer == b->value.integer;
         case TYPE_DOUBLE: return fabs(a->value.dbl - b->value.dbl) < 1e-6;
         case TYPE_STRING: return strcmp(a->value.string, b->value.string) == 0;
         case TYPE_SYMBOL: return strcmp(a->value.symbol, b->value.symbol) == 0;
         case TYPE_NIL:    return 1;  // all NILs are equal
-        case TYPE_CONS:
-            return sExpr_equal(a->value.cons.car, b->value.cons.car) &&
-                   sExpr_equal(a->value.cons.cdr, b->value.cons.cdr);
         default: return 0;
     }
 }
 
+// Structural equality. Pairs still to compare go on a heap stack, so deep
+// trees don't recurse.
+int sExpr_equal(sExpr *a, sExpr *b) {
+    int cap = 16, n = 0, equal = 1;
+    sExpr **stack = malloc(sizeof(sExpr *) * 2 * cap);
+    stack[n++] = a;
+    stack[n++] = b;
+
+    while (n > 0 && equal) {
+        b = stack[--n];
+        a = stack[--n];
+        if (a && b && a != b && type_of(a) == TYPE_CONS && type_of(b) == TYPE_CONS) {
+            if (n + 4 > 2 * cap) {
+                cap *= 2;
+                stack = realloc(stack, sizeof(sExpr *) * 2 * cap);
+            }
+            stack[n++] = a->value.cons.cdr;
+            stack[n++] = b->value.cons.cdr;
+            stack[n++] = a->value.cons.car;
+            stack[n++] = b->value.cons.car;
+        } else {
+            equal = atom_equal(a, b);
+        }
+    }
+    free(stack);
+    return equal;
+}
+
 
 void assert_sExpr_equal(sExpr *expected, sExpr *actual, const char *msg) {
     if (sExpr_equal(expected, actual)) {
@@ -135,6 +167,24 @@ void test_cons_and_list() {
 
     free_sExpr(nested);
     free_sExpr(improper);
+
+    // Cells are two words, and the cells of a list built in order are laid
+    // out in order, apart from reused freed cells and the end of a chunk
+    size_t before = allocated_bytes;
+    sExpr *cell = cons(NIL, NIL);
+    assert_int_equal(2 * sizeof(sExpr *), create_int((long)(allocated_bytes - before)),
+                     "cons cell is two words");
+    assert_int_equal(TYPE_CONS, create_int(type_of(cell)), "compact cell is a cons");
+    sExpr *head = cons(create_int(0), NIL), *tail = head;
+    for (long i = 1; i < 100; i++) {
+        tail->value.cons.cdr = cons(create_int(i), NIL);
+        tail = cdr(tail);
+    }
+    long adjacent = 0;
+    for (sExpr *p = head; type_of(cdr(p)) == TYPE_CONS; p = cdr(p)) {
+        if ((char *)cdr(p) - (char *)p == (long)(2 * sizeof(sExpr *))) adjacent++;
+    }
+    assert_int_equal(1, create_int(adjacent >= 90), "list cells are adjacent");
 }
 
 
@@ -297,6 +347,7 @@ void test_parser() {
         "(+ 1 2 3)",
         "((nested (list 1)) 2)",
         "(improper . 42)",   // improper list
+        "(\"a string\" 1)",
         "(missing",          // syntax error
         NULL
     };
@@ -395,6 +446,1017 @@ void test_or_and() {
     assert_sExpr_equal(NIL, eval(and_expr3), "and(NIL, 1) -> NIL");
 }
 
+// --- HASH TABLES ---
+sExpr *call2(const char *fn, sExpr *a, sExpr *b) {
+    return eval(cons(create_symbol(fn), cons(a, cons(b, NIL))));
+}
+
+void test_hash() {
+    printf("\n=== Hash Tables ===\n");
+
+    sExpr *h = eval(cons(create_symbol("make-hash"), NIL));
+    set(create_symbol("h"), h);
+    sExpr *hsym = create_symbol("h");
+
+    // Enough keys to go through several incremental resizes
+    for (long i = 0; i < 1000; i++) {
+        eval(cons(create_symbol("hash-set!"),
+                  cons(hsym, cons(create_int(i), cons(create_int(i * i), NIL)))));
+    }
+    assert_int_equal(1000, eval(cons(create_symbol("hash-count"), cons(hsym, NIL))),
+                     "hash-count after 1000 inserts");
+    assert_int_equal(961, call2("hash-get", hsym, create_int(31)), "hash-get 31");
+    assert_int_equal(100, call2("hash-get", hsym, create_double(10.0)),
+                     "hash-get with 10.0 finds key 10");
+    assert_sExpr_equal(NIL, call2("hash-get", hsym, create_int(5000)), "missing key -> NIL");
+
+    assert_sExpr_equal(TRUE, call2("hash-remove!", hsym, create_int(31)), "hash-remove! 31");
+    assert_sExpr_equal(NIL, call2("hash-remove!", hsym, create_int(31)), "hash-remove! twice -> NIL");
+    assert_sExpr_equal(NIL, call2("hash-get", hsym, create_int(31)), "removed key gone");
+    assert_int_equal(999, eval(cons(create_symbol("hash-count"), cons(hsym, NIL))),
+                     "hash-count after remove");
+
+    sExpr *keys = eval(cons(create_symbol("hash-keys"), cons(hsym, NIL)));
+    long nkeys = 0;
+    for (; !isnil(keys); keys = cdr(keys)) nkeys++;
+    assert_int_equal(999, create_int(nkeys), "hash-keys length");
+
+    // Strings and symbols with the same text are different keys
+    sExpr *h2 = create_hash(0);
+    hash_set(h2->value.hash, create_string("k"), create_int(1));
+    hash_set(h2->value.hash, create_symbol("k"), create_int(2));
+    assert_int_equal(1, hash_get(h2->value.hash, create_string("k")), "string key");
+    assert_int_equal(2, hash_get(h2->value.hash, create_symbol("k")), "symbol key");
+    assert_int_equal(-1, create_int(hash_set(h2->value.hash, cons(NIL, NIL), NIL)),
+                     "cons keys rejected");
+    print_sExpr(h2); printf("\n");
+    // A migrated entry must not stay behind in the old array
+    HashTable *t = hash_new(0);
+    for (long i = 0; i <= 384; i++) hash_set(t, create_int(i), create_int(i));
+    hash_remove(t, create_int(0));
+    assert_int_equal(1, create_int(hash_get(t, create_int(0)) == NULL), "removed key gone mid-resize");
+    nkeys = 0;
+    for (keys = hash_keys(t); !isnil(keys); keys = cdr(keys)) nkeys++;
+    assert_int_equal(384, create_int(nkeys), "no duplicate keys mid-resize");
+    hash_free(t);
+
+    // Shrinking then growing again while a big old array drains must not
+    // fill the new one
+    t = hash_new(0);
+    for (long i = 0; i < 1500; i++) hash_set(t, create_int(i), NIL);
+    for (long i = 10; i < 1500; i++) hash_remove(t, create_int(i));
+    for (long i = 0; i < 300; i++) hash_set(t, create_int(-i - 1), NIL);
+    assert_int_equal(310, create_int((long)hash_count(t)), "grow after shrink");
+    assert_int_equal(1, create_int(hash_get(t, create_int(4)) != NULL), "old key survives");
+    hash_free(t);
+}
+
+// --- STRINGS ---
+sExpr *parse_eval(const char *src) {
+    TokenStream ts = tokenize(src);
+    sExpr *result = eval(parse_sexpr(&ts));
+    free_tokens(&ts);
+    return result;
+}
+
+void test_strings() {
+    printf("\n=== Strings ===\n");
+
+    assert_int_equal(5, parse_eval("(string-length \"hello\")"), "string-length");
+    assert_int_equal(0, parse_eval("(string-length \"\")"), "string-length of empty");
+    assert_sExpr_equal(create_string("foobarbaz"),
+                       parse_eval("(string-append \"foo\" \"bar\" \"baz\")"),
+                       "string-append of three");
+    assert_sExpr_equal(NIL, parse_eval("(string-append \"foo\" 1)"),
+                       "string-append rejects non-strings");
+    assert_sExpr_equal(create_string("ell"), parse_eval("(substring \"hello\" 1 4)"),
+                       "substring with end");
+    assert_sExpr_equal(create_string("llo"), parse_eval("(substring \"hello\" 2)"),
+                       "substring to the end");
+    assert_sExpr_equal(NIL, parse_eval("(substring \"hello\" 3 9)"), "substring out of range");
+
+    assert_sExpr_equal(TRUE, eq(create_string("abc"), create_string("abc")), "eq equal strings");
+    assert_sExpr_equal(NIL, eq(create_string("abc"), create_string("abcd")), "eq different lengths");
+    assert_sExpr_equal(NIL, eq(create_string("abc"), create_string("abd")), "eq same length");
+
+    parse_eval("(set sb (make-string-builder))");
+    for (int i = 0; i < 1000; i++) parse_eval("(builder-append! sb \"ab\")");
+    parse_eval("(builder-append! sb 42)");
+    parse_eval("(builder-append! sb 'x)");
+    assert_int_equal(2003, parse_eval("(string-length sb)"), "builder length after appends");
+    sExpr *built = parse_eval("(builder->string sb)");
+    assert_int_equal(2003, create_int((long)string_length(built)), "builder->string length");
+    assert_sExpr_equal(create_string("ab42x"), substring(built, 1998, 2003), "builder tail");
+}
+
+// --- PERSISTENT COLLECTIONS ---
+void test_persistent() {
+    printf("\n=== Persistent Collections ===\n");
+
+    // 40000 elements takes the vector trie to three levels
+    parse_eval("(set pv (vector))");
+    parse_eval("(dotimes (i 40000) (set pv (conj pv (* i 3))))");
+    assert_int_equal(40000, parse_eval("(vector-count pv)"), "conj 40000 elements");
+    assert_int_equal(0, parse_eval("(let ((bad 0)) (dotimes (i 40000 bad) (if (= (nth pv i) (* i 3)) () (set bad (+ bad 1)))))"),
+                     "nth finds every element");
+    parse_eval("(set pv2 (assoc pv 33000 'x))");
+    assert_int_equal(99000, parse_eval("(nth pv 33000)"), "assoc leaves the old vector alone");
+    assert_sExpr_equal(create_symbol("x"), parse_eval("(nth pv2 33000)"), "assoc in the new vector");
+    assert_sExpr_equal(NIL, parse_eval("(nth pv 40000)"), "nth past the end -> NIL");
+
+    parse_eval("(set pt (transient (vector)))");
+    parse_eval("(dotimes (i 40000) (conj! pt (* i 3)))");
+    assert_sExpr_equal(TRUE, parse_eval("(equal (persistent! pt) pv)"), "transient builds the same vector");
+    assert_sExpr_equal(NIL, parse_eval("(conj! pt 1)"), "conj! after persistent! -> NIL");
+    assert_sExpr_equal(NIL, parse_eval("(conj (transient pv) 1)"), "conj on a transient -> NIL");
+
+    parse_eval("(set pm (hash-map))");
+    parse_eval("(dotimes (i 20000) (set pm (assoc pm (* i 7) i)))");
+    parse_eval("(set pm-all pm)");
+    assert_int_equal(20000, parse_eval("(map-count pm)"), "assoc 20000 keys");
+    assert_int_equal(3, parse_eval("(get pm 21.0)"), "get with 21.0 finds key 21");
+    parse_eval("(dotimes (i 20000) (if (= (% i 2) 0) (set pm (dissoc pm (* i 7))) ()))");
+    assert_int_equal(10000, parse_eval("(map-count pm)"), "dissoc half the keys");
+    assert_int_equal(20000, parse_eval("(map-count pm-all)"), "dissoc leaves the old map alone");
+    assert_sExpr_equal(NIL, parse_eval("(get pm 14)"), "dissoc'd key gone");
+    assert_int_equal(3, parse_eval("(get pm-all 21)"), "old map keeps its keys");
+
+    parse_eval("(set pmt (transient pm-all))");
+    parse_eval("(dotimes (i 20000) (if (= (% i 2) 0) (dissoc! pmt (* i 7)) ()))");
+    assert_sExpr_equal(TRUE, parse_eval("(equal (persistent! pmt) pm)"), "dissoc! matches dissoc");
+    assert_int_equal(20000, parse_eval("(map-count pm-all)"), "transient leaves its source alone");
+    assert_sExpr_equal(TRUE, parse_eval("(equal (hash-map 1 'a 2 'b) (hash-map 2 'b 1 'a))"),
+                       "maps equal regardless of insertion order");
+}
+
+// --- OPTIMIZER ---
+sExpr *parse_optimize(const char *src) {
+    TokenStream ts = tokenize(src);
+    sExpr *result = optimize(parse_sexpr(&ts));
+    free_tokens(&ts);
+    return result;
+}
+
+void test_optimizer() {
+    printf("\n=== Optimizer ===\n");
+
+    assert_int_equal(3, parse_optimize("(+ 1 2)"), "fold (+ 1 2)");
+    assert_int_equal(14, parse_optimize("(+ 2 (* 3 4))"), "fold nested arithmetic");
+    assert_sExpr_equal(TRUE, car(cdr(parse_optimize("(eq 10 10)"))), "fold (eq 10 10) to 't");
+    assert_sExpr_equal(NIL, parse_optimize("(< 3 1)"), "fold false comparison to NIL");
+    assert_int_equal(5, parse_optimize("'5"), "hoist quoted number");
+
+    sExpr *partial = parse_optimize("(+ x (* 2 3))");
+    assert_int_equal(6, car(cdr(cdr(partial))), "fold constant argument of open call");
+
+    assert_sExpr_equal(create_symbol("yes"), car(cdr(parse_optimize("(if (< 1 2) 'yes 'no)"))),
+                       "if with constant test");
+    assert_int_equal(1, parse_optimize("(cond ('t 1) (x 2))"), "cond with leading 't");
+
+    sExpr *pruned = parse_optimize("(cond (() 0) ((< x 1) 1) ('t 2) (y 3))");
+    sExpr *expected = parse_optimize("(cond ((< x 1) 1) ('t 2))");
+    assert_sExpr_equal(expected, pruned, "cond drops dead clauses");
+
+    sExpr *untouched = parse_optimize("(f x y)");
+    assert_sExpr_equal(create_symbol("f"), car(untouched), "unknown call left alone");
+
+    // Bodies are optimized when a lambda is defined
+    parse_eval("(define opt-f (lambda (x) (+ x (* 2 3))))");
+    sExpr *body = car(cdr(cdr(lookup(create_symbol("opt-f")))));
+    assert_int_equal(6, car(cdr(cdr(body))), "define optimizes lambda body");
+    assert_int_equal(10, parse_eval("(opt-f 4)"), "optimized lambda still runs");
+}
+
+// --- FUNCTION CALLS ---
+void test_calls() {
+    printf("\n=== Calls ===\n");
+
+    parse_eval("(define scale 10)");
+    parse_eval("(define add3 (lambda (a b c) (+ a (+ (* b scale) c))))");
+    assert_int_equal(124, parse_eval("(add3 3 (add3 0 1 2) 1)"),
+                     "nested call in argument position");
+    assert_int_equal(12, parse_eval("(add3 (add3 1 0 0) 1 (add3 0 0 1))"),
+                     "sibling calls reuse argument slots");
+
+    parse_eval("(define count (lambda (n acc) (if (= n 0) acc (count (- n 1) (+ acc 1)))))");
+    assert_int_equal(2000, parse_eval("(count 2000 0)"), "deep recursion");
+
+    parse_eval("(define inner (lambda (y) (+ x y)))");
+    parse_eval("(define outer (lambda (x) (inner 1)))");
+    assert_int_equal(6, parse_eval("(outer 5)"), "callee sees caller's bindings");
+    assert_sExpr_equal(create_symbol("undefined"), lookup(create_symbol("no-such-name")),
+                       "unbound symbol");
+}
+
+// --- LOOPS ---
+void test_loops() {
+    printf("\n=== Loops ===\n");
+
+    parse_eval("(set loop-x 1)");
+    assert_int_equal(3, parse_eval("(let ((loop-x 2) (y loop-x)) (+ loop-x y))"),
+                     "let inits see the enclosing scope");
+    assert_int_equal(4, parse_eval("(let* ((loop-x 2) (y loop-x)) (+ loop-x y))"),
+                     "let* inits see earlier names");
+    assert_int_equal(1, parse_eval("loop-x"), "let leaves the global alone");
+
+    assert_int_equal(1024, parse_eval("(let ((n 1)) (while (< n 1000) (set n (* n 2))) n)"),
+                     "while with a local set");
+    assert_int_equal(4950, parse_eval("(let ((sum 0)) (dotimes (i 100 sum) (set sum (+ sum i))))"),
+                     "dotimes sum");
+    assert_int_equal(7, parse_eval("(dotimes (i 7 i) ())"), "dotimes result sees the count");
+    assert_int_equal(10, parse_eval("(let ((sum 0)) (dolist (e '(1 2 3 4) sum) (set sum (+ sum e))))"),
+                     "dolist");
+    assert_int_equal(10, parse_eval("(do ((i 0 (+ i 1)) (acc 0 (+ acc i))) ((= i 5) acc))"),
+                     "do steps in parallel");
+    assert_int_equal(3, parse_eval("(let ((n 0)) (dotimes (i 10 n) (if (< i 3) (set n (+ n 1)) ())))"),
+                     "set updates the loop's binding");
+
+    parse_eval("(define loop-count (lambda (n) (let ((k 0)) (while (< k n) (set k (+ k 1))) k)))");
+    assert_int_equal(100000, parse_eval("(loop-count 100000)"), "long loop runs without recursing");
+
+    size_t before = allocated_bytes;
+    parse_eval("(dotimes (i 100000) (< i 0))");
+    assert_int_equal(1, create_int(allocated_bytes - before < 1000 * sizeof(sExpr)),
+                     "dotimes counter isn't reboxed");
+    // A function called from the body can see the counter and keep it
+    parse_eval("(set loop-h (make-hash))");
+    parse_eval("(define loop-grab (lambda () (hash-set! loop-h i i)))");
+    parse_eval("(dotimes (i 3) (loop-grab))");
+    assert_int_equal(0, parse_eval("(hash-get loop-h 0)"), "counter kept by a callee isn't overwritten");
+    assert_int_equal(3, parse_eval("(hash-count loop-h)"), "callee saw every counter value");
+}
+
+// --- MACROS ---
+void test_macros() {
+    printf("\n=== Macros ===\n");
+
+    assert_sExpr_equal(parse_eval("'(1 2 3 4 . 5)"),
+                       parse_eval("`(1 ,(+ 1 1) ,@'(3 4) . ,(+ 2 3))"),
+                       "quasiquote with unquote and splicing");
+    assert_sExpr_equal(parse_eval("'(a `(b ,(c 3) ,(d e)))"),
+                       parse_eval("`(a `(b ,(c ,(+ 1 2)) ,(d ,'e)))"),
+                       "nested quasiquote evaluates innermost unquotes only");
+
+    parse_eval("(defmacro unless (c body) `(if ,c () ,body))");
+    parse_eval("(define dbl (lambda (x) (* x 2)))");
+    parse_eval("(define safe-dbl (lambda (x) (unless (< x 0) (dbl x))))");
+    assert_int_equal(6, parse_eval("(safe-dbl 3)"), "macro inside lambda body");
+    assert_sExpr_equal(NIL, parse_eval("(safe-dbl -1)"), "macro other branch");
+
+    // The call site now holds the expansion
+    sExpr *body = car(cdr(cdr(lookup(create_symbol("safe-dbl")))));
+    assert_sExpr_equal(create_symbol("if"), car(body), "call site replaced by expansion");
+
+    sExpr *expanded = parse_eval("(macroexpand '(unless t 5))");
+    assert_sExpr_equal(parse_eval("'(if t () 5)"), expanded, "macroexpand");
+    assert_sExpr_equal(parse_eval("'(f 1)"), parse_eval("(macroexpand '(f 1))"),
+                       "macroexpand leaves non-macro calls alone");
+}
+
+// --- INLINING ---
+// Nonzero if print_sExpr writes exactly text for e
+static int prints_as(sExpr *e, const char *text) {
+    const char *path = "/tmp/yisp_test_print.txt";
+    fflush(stdout);
+    int saved = dup(1);
+    FILE *f = fopen(path, "w");
+    dup2(fileno(f), 1);
+    print_sExpr(e);
+    fflush(stdout);
+    dup2(saved, 1);
+    close(saved);
+    fclose(f);
+
+    char buf[256] = "";
+    f = fopen(path, "r");
+    size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    buf[n] = '\0';
+    fclose(f);
+    remove(path);
+    return strcmp(buf, text) == 0;
+}
+
+void test_inlining() {
+    printf("\n=== Inlining ===\n");
+
+    parse_eval("(define in-inc (lambda (x) (+ x 1)))");
+    parse_eval("(define in-sq (lambda (x) (* x x)))");
+    parse_eval("(define in-f (lambda (n) (in-sq (in-inc n))))");
+    sExpr *body = car(cdr(cdr(lookup(create_symbol("in-f")))));
+    assert_sExpr_equal(create_symbol("let"), car(body), "small calls replaced by their bodies");
+    assert_sExpr_equal(create_symbol("*"), car(car(cdr(cdr(body)))), "argument bound once for two uses");
+    assert_int_equal(16, parse_eval("(in-f 3)"), "inlined function runs");
+    assert_int_equal(1, create_int(prints_as(parse_eval("(define in-h (lambda (x) (in-inc x)))"),
+                                             "(lambda (x) (in-inc x))")),
+                     "define shows the function as written");
+    assert_int_equal(1, create_int(prints_as(parse_eval("in-f"), "(lambda (n) (in-sq (in-inc n)))")),
+                     "an inlined function prints as written");
+    parse_eval("(define in-g (lambda (y) (in-inc 4)))");
+    assert_int_equal(5, car(cdr(cdr(lookup(create_symbol("in-g"))))), "inlined constants fold");
+
+    // Arguments with side effects still run once each, in order
+    parse_eval("(define in-n 0)");
+    parse_eval("(define in-tick (lambda () (set in-n (+ in-n 1))))");
+    parse_eval("(define in-sub (lambda (a b) (- a b)))");
+    parse_eval("(define in-order (lambda () (in-sub (in-tick) (in-tick))))");
+    assert_int_equal(-1, parse_eval("(in-order)"), "arguments evaluated in order");
+    assert_int_equal(2, parse_eval("in-n"), "each argument evaluated once");
+
+    parse_eval("(set in-inc (lambda (x) (+ x 10)))");
+    assert_int_equal(169, parse_eval("(in-f 3)"), "caller recompiled after redefinition");
+    assert_int_equal(14, parse_eval("(in-g 0)"), "every caller recompiled");
+
+    parse_eval("(define in-fact (lambda (n) (if (= n 0) 1 (* n (in-fact (- n 1))))))");
+    assert_int_equal(120, parse_eval("(in-fact 5)"), "recursive function not inlined");
+
+    // With dynamic scoping a parameter named in-dbl rebinds it for callees,
+    // so callers of in-dbl stop inlining it
+    parse_eval("(define in-dbl (lambda (x) (* 2 x)))");
+    parse_eval("(define in-use (lambda (x) (in-dbl x)))");
+    assert_int_equal(6, parse_eval("(in-use 3)"), "inlined before shadowing");
+    parse_eval("(define in-shadow (lambda (in-dbl) (in-use 3)))");
+    assert_int_equal(0, parse_eval("(in-shadow (lambda (v) 0))"), "parameter shadows inlined function");
+    assert_int_equal(6, parse_eval("(in-use 3)"), "global again after shadowing");
+}
+
+// --- QUICKENING ---
+void test_quickening() {
+    printf("\n=== Quickening ===\n");
+
+    parse_eval("(define qadd (lambda (a b) (+ a b)))");
+    assert_int_equal(5, parse_eval("(qadd 2 3)"), "int call");
+    assert_int_equal(7, parse_eval("(qadd 3 4)"), "specialized int call");
+    sExpr *body = car(cdr(cdr(lookup(create_symbol("qadd")))));
+    assert_int_equal(TYPE_QUICK, create_int(type_of(car(body))), "call site quickened");
+    assert_sExpr_equal(create_double(4.0), parse_eval("(qadd 1.5 2.5)"), "deoptimizes on doubles");
+    assert_sExpr_equal(NIL, parse_eval("(qadd \"a\" 1)"), "deoptimizes on strings");
+    assert_int_equal(9, parse_eval("(qadd 4 5)"), "ints again after deopt");
+    assert_sExpr_equal(TRUE, parse_eval("(< 1.5 2)"), "mixed comparison");
+
+    parse_eval("(define qsq (lambda (x) (* x x)))");
+    parse_eval("(define quse (lambda (x) (qsq (+ x 1))))");
+    assert_int_equal(16, parse_eval("(quse 3)"), "global call");
+    assert_int_equal(16, parse_eval("(quse 3)"), "cached global call");
+    parse_eval("(define qsq (lambda (x) (+ x x)))");
+    assert_int_equal(8, parse_eval("(quse 3)"), "redefinition seen by cached call");
+
+    // Once qsq is also a parameter name, calls to it can't be cached
+    parse_eval("(define qapply (lambda (qsq) (qsq 10)))");
+    assert_int_equal(11, parse_eval("(qapply (lambda (v) (+ v 1)))"), "parameter shadows global");
+    assert_int_equal(8, parse_eval("(quse 3)"), "global call after shadowing");
+
+    assert_sExpr_equal(parse_eval("'(lambda (x) (qsq (+ x 1)))"), lookup(create_symbol("quse")),
+                       "quickened code still reads as written");
+}
+
+// --- STREAMS ---
+void test_streams() {
+    printf("\n=== Streams ===\n");
+
+    parse_eval("(set forced 0)");
+    parse_eval("(set p (delay (set forced (+ forced 1))))");
+    assert_int_equal(0, parse_eval("forced"), "delay doesn't evaluate");
+    parse_eval("(force p)");
+    assert_int_equal(1, parse_eval("(force p)"), "force memoizes");
+
+    parse_eval("(define later (lambda (n) (delay (* n 10))))");
+    assert_int_equal(70, parse_eval("(force (later 7))"), "promise keeps its call's parameters");
+
+    parse_eval("(define ints (lambda (n) (stream-cons n (ints (+ n 1)))))");
+    parse_eval("(define even (lambda (x) (= (% x 2) 0)))");
+    assert_sExpr_equal(parse_eval("'(4 16 36)"),
+                       parse_eval("(stream->list (stream-take (stream-filter even "
+                                  "(stream-map (lambda (x) (* x x)) (ints 1))) 3))"),
+                       "pipeline over an infinite stream");
+    assert_int_equal(5050, parse_eval("(stream-fold + 0 (stream-take (ints 1) 100))"), "stream-fold");
+
+    parse_eval("(define noisy (lambda (n) (stream-cons n (noisy (set forced n)))))");
+    parse_eval("(stream->list (stream-take (noisy 1) 2))");
+    assert_int_equal(1, parse_eval("forced"), "take forces only what it returns");
+
+    const char *path = "/tmp/yisp_test_stream.lisp";
+    FILE *f = fopen(path, "w");
+    fputs("(+ 1\n 2) (* 2 3)\n\n\"x\"\n", f);
+    fclose(f);
+    assert_int_equal(4, parse_eval("(stream-fold (lambda (n l) (+ n 1)) 0 "
+                                   "(file-lines \"/tmp/yisp_test_stream.lisp\"))"),
+                     "file-lines");
+    assert_sExpr_equal(parse_eval("'((+ 1 2) (* 2 3) \"x\")"),
+                       parse_eval("(stream->list (file-forms \"/tmp/yisp_test_stream.lisp\"))"),
+                       "file-forms");
+
+    // Walking a big file holds about one line at a time
+    f = fopen(path, "w");
+    for (int i = 0; i < 5000; i++) fprintf(f, "%0199d\n", i);
+    fclose(f);
+    size_t before = mallinfo2().uordblks;
+    assert_int_equal(995000, parse_eval("(stream-fold (lambda (n l) (+ n (string-length l))) 0 "
+                                         "(stream-filter (lambda (l) (> (string-length l) 0)) "
+                                         "(file-lines \"/tmp/yisp_test_stream.lisp\")))"),
+                     "fold over file lines");
+    assert_int_equal(1, create_int(mallinfo2().uordblks - before < 800000),
+                     "consumed lines and cells are freed");
+
+    remove(path);
+
+    parse_eval("(set sq (stream-map (lambda (x) (* x x)) (ints 1)))");
+    parse_eval("(stream->list (stream-take sq 3))");
+    assert_sExpr_equal(parse_eval("'(1 4 9)"), parse_eval("(stream->list (stream-take sq 3))"),
+                       "a stream held in a variable can be walked again");
+    assert_int_equal(4, parse_eval("(stream-car (stream-cdr sq))"), "walked cells stay memoized");
+}
+
+// --- GENERATORS ---
+void test_generators() {
+    printf("\n=== Generators ===\n");
+
+    parse_eval("(define count-up (lambda (yield i n) (if (< i n) (or (yield i) (count-up yield (+ i 1) n)) 'end)))");
+    parse_eval("(define counter (lambda (n) (make-generator (lambda (yield) (count-up yield 0 n)))))");
+    parse_eval("(set g (counter 2))");
+    assert_int_equal(0, parse_eval("(next g)"), "first next");
+    assert_int_equal(1, parse_eval("(next g)"), "resumes where it yielded");
+    assert_sExpr_equal(NIL, parse_eval("(generator-done? g)"), "not done while suspended");
+    assert_sExpr_equal(NIL, parse_eval("(next g)"), "() when the function returns");
+    assert_sExpr_equal(TRUE, parse_eval("(generator-done? g)"), "done");
+    assert_sExpr_equal(NIL, parse_eval("(next g)"), "() after done");
+
+    // Each generator keeps its own call frames while the other runs
+    parse_eval("(set a (counter 10))");
+    parse_eval("(set b (counter 10))");
+    parse_eval("(next a)");
+    parse_eval("(next a)");
+    assert_int_equal(0, parse_eval("(next b)"), "separate frames");
+    assert_int_equal(2, parse_eval("(next a)"), "frames kept across switches");
+    assert_int_equal(3, parse_eval("(+ (next a) 0)"), "next inside a call");
+
+    parse_eval("(define relay (lambda (yield src) (if (generator-done? src) 'done "
+               "(or (yield (+ 10 (next src))) (relay yield src)))))");
+    parse_eval("(set h (make-generator (lambda (yield) (relay yield (counter 2)))))");
+    assert_int_equal(10, parse_eval("(next h)"), "generator inside a generator");
+    assert_int_equal(11, parse_eval("(next h)"), "inner generator resumed");
+
+    assert_sExpr_equal(NIL, parse_eval("(a 5)"), "yield outside its generator");
+}
+
+// --- COMPILER ---
+int file_contains(const char *path, const char *needle) {
+    FILE *f = fopen(path, "r");
+    if (!f) return 0;
+    char buf[1 << 16];
+    size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    buf[n] = '\0';
+    fclose(f);
+    return strstr(buf, needle) != NULL;
+}
+
+void test_compile_c() {
+    printf("\n=== Compiler to C ===\n");
+
+    const char *src = "/tmp/yisp_test_compile.lisp";
+    const char *out = "/tmp/yisp_test_compile.c";
+    FILE *f = fopen(src, "w");
+    fputs("(define cfib (lambda (n) (cond ((< n 2) n) ('t (+ (cfib (- n 1)) (cfib (- n 2)))))))\n"
+          "(define cgreet (lambda (s) (string-append \"hi \" s)))\n"
+          "(cfib 10)\n", f);
+    fclose(f);
+
+    assert_int_equal(0, create_int(compile_to_c(src, out)), "compile_to_c succeeds");
+    assert_int_equal(1, create_int(file_contains(out, "static sExpr *yf0(sExpr *a0)")),
+                     "define becomes a C function");
+    assert_int_equal(1, create_int(file_contains(out, "open_frame(K[")),
+                     "compiled function pushes a frame for its parameters");
+    assert_int_equal(1, create_int(file_contains(out,
+                         "(type_of(get_local(0)) == TYPE_INT) ? (get_local(0)->value.integer < 2L)")),
+                     "integer comparison is unboxed behind a guard");
+    assert_int_equal(1, create_int(file_contains(out, "yf0(t")), "recursive call is a direct C call");
+    assert_int_equal(1, create_int(file_contains(out, "eval(K[")),
+                     "unsupported builtin falls back to eval");
+
+    remove(src);
+    remove(out);
+
+    // A callee reads and sets its caller's parameter by name, and operands
+    // are evaluated left to right
+    const char *dyn = "(define cdg (lambda () (+ x 1)))\n"
+                      "(define cdf (lambda (x) (cdg)))\n"
+                      "(define cdh (lambda () (set x 10)))\n"
+                      "(define cdk (lambda (x) (cond ((cdh) x))))\n"
+                      "(define tick (lambda () (set cdn (+ cdn 1))))\n"
+                      "(define ticks (lambda (x) (- (tick) (+ x (tick)))))\n"
+                      "(set cdn 0)\n"
+                      "(cdf 5)\n"
+                      "(cdk 1)\n"
+                      "(- (tick) (tick))\n"
+                      "(ticks 0)\n";
+    f = fopen("/tmp/yisp_test_dyn.lisp", "w");
+    fputs(dyn, f);
+    fclose(f);
+    char interpreted[64] = "";
+    for (sExpr *forms = parse_forms(dyn); !isnil(forms); forms = cdr(forms)) {
+        sExpr *result = eval(car(forms));
+        if (type_of(result) == TYPE_INT) {
+            size_t n = strlen(interpreted);
+            snprintf(interpreted + n, sizeof(interpreted) - n, "%ld\n", result->value.integer);
+        }
+    }
+    assert_int_equal(1, create_int(strcmp(interpreted, "0\n6\n10\n-1\n-1\n") == 0),
+                     "interpreter is dynamically scoped and evaluates left to right");
+
+    char compiled[256] = "";
+    if (system("make -s native SCRIPT=/tmp/yisp_test_dyn.lisp > /dev/null 2>&1") == 0) {
+        FILE *p = popen("/tmp/yisp_test_dyn", "r");
+        size_t n = fread(compiled, 1, sizeof(compiled) - 1, p);
+        compiled[n] = '\0';
+        pclose(p);
+    }
+    size_t len = strlen(compiled), ilen = strlen(interpreted);
+    assert_int_equal(1, create_int(len >= ilen && strcmp(compiled + len - ilen, interpreted) == 0),
+                     "compiled code agrees with the interpreter");
+    remove("/tmp/yisp_test_dyn.lisp");
+    remove("/tmp/yisp_test_dyn.c");
+    remove("/tmp/yisp_test_dyn");
+}
+
+// --- HEAP IMAGES ---
+void test_image() {
+    printf("\n=== Heap Image ===\n");
+
+    const char *path = "/tmp/yisp_test.img";
+    set(create_symbol("img-int"), create_int(7));
+    set(create_symbol("img-str"), create_string("seven"));
+    set(create_symbol("img-list"), cons(create_double(1.5), cons(TRUE, NIL)));
+    sExpr *table = create_hash(0);
+    hash_set(table->value.hash, create_string("answer"), create_int(42));
+    set(create_symbol("img-hash"), table);
+    parse_eval("(set img-map (hash-map 'k (vector 1 2 3)))");
+
+    assert_sExpr_equal(TRUE, eval(cons(create_symbol("save-image"),
+                                       cons(create_string(path), NIL))),
+                       "save-image returns t");
+
+    sExpr *saved_env = global_env;
+    global_env = create_env();
+    assert_sExpr_equal(create_symbol("undefined"), lookup(create_symbol("img-int")),
+                       "fresh env has no img-int");
+
+    assert_int_equal(0, create_int(load_image(path)), "load_image succeeds");
+    assert_int_equal(7, lookup(create_symbol("img-int")), "img-int restored");
+    assert_sExpr_equal(create_string("seven"), lookup(create_symbol("img-str")),
+                       "img-str restored");
+    sExpr *list = lookup(create_symbol("img-list"));
+    assert_double_equal(1.5, car(list), "img-list car restored");
+    assert_int_equal(1, create_int(car(cdr(list)) == TRUE), "TRUE identity kept");
+    assert_int_equal(1, create_int(cdr(cdr(list)) == NIL), "NIL identity kept");
+    sExpr *restored = lookup(create_symbol("img-hash"));
+    assert_int_equal(42, hash_get(restored->value.hash, create_string("answer")),
+                     "hash table restored");
+    assert_sExpr_equal(TRUE, parse_eval("(equal img-map (hash-map 'k (vector 1 2 3)))"),
+                       "persistent map and vector restored");
+
+    global_env = saved_env;
+
+    // A record count whose block size overflows is rejected up front
+    FILE *f = fopen(path, "wb");
+    unsigned long long header[2] = { ~0ULL / sizeof(sExpr) + 1, 0 };
+    fwrite("YISPIMG1", 1, 8, f);
+    fwrite(header, sizeof(header), 1, f);
+    fputs("\x01\x01\x01\x01", f);
+    fclose(f);
+    assert_int_equal(-1, create_int(load_image(path)), "corrupt record count rejected");
+    remove(path);
+}
+
+// --- FORM CACHE ---
+void test_load_cache() {
+    printf("\n=== Form Cache ===\n");
+
+    const char *path = "/tmp/yisp_test_load.lisp";
+    const char *cpath = "/tmp/yisp_test_load.lisp.yc";
+    remove(cpath);
+
+    FILE *f = fopen(path, "w");
+    fputs("(set cached-a (+ 1 2))\n(* cached-a\n 2)\n", f);
+    fclose(f);
+
+    sExpr *forms = load_forms(path, 0);
+    assert_sExpr_equal(create_symbol("set"), car(car(forms)), "script forms parsed without a cache");
+    FILE *cache = fopen(cpath, "rb");
+    assert_int_equal(0, create_int(cache != NULL), "running a script writes no cache");
+    if (cache) fclose(cache);
+
+    assert_int_equal(6, load_file(path), "load evaluates multi-line forms");
+
+    cache = fopen(cpath, "rb");
+    assert_int_equal(1, create_int(cache != NULL), "cache written next to source");
+    if (cache) fclose(cache);
+
+    forms = load_forms(path, 1);
+    assert_sExpr_equal(create_symbol("set"), car(car(forms)), "forms read back from cache");
+
+    // Editing the source invalidates the cache
+    f = fopen(path, "w");
+    fputs("(- 10 1)\n", f);
+    fclose(f);
+    assert_int_equal(9, load_file(path), "changed source is re-parsed");
+
+    // An unmatched paren loses only its own form
+    f = fopen(path, "w");
+    fputs("(set unmatched-a 1)\n(define broken (lambda (x) (+ x 1)\n\n(set unmatched-b 2))\n(+ 3 4)\n", f);
+    fclose(f);
+    remove(cpath);
+    long count = 0;
+    for (forms = load_forms(path, 0); !isnil(forms); forms = cdr(forms)) count++;
+    assert_int_equal(3, create_int(count), "parsing recovers at the next top-level form");
+    assert_int_equal(7, load_file(path), "forms after an unmatched paren still run");
+    assert_int_equal(2, parse_eval("unmatched-b"), "form after the unclosed one");
+    cache = fopen(cpath, "rb");
+    assert_int_equal(0, create_int(cache != NULL), "source with unmatched parens isn't cached");
+    if (cache) fclose(cache);
+
+    remove(path);
+    remove(cpath);
+}
+
+// --- RELOAD ---
+static void write_file(const char *path, const char *text) {
+    FILE *f = fopen(path, "w");
+    fputs(text, f);
+    fclose(f);
+}
+
+void test_reload() {
+    printf("\n=== Reload ===\n");
+
+    const char *path = "/tmp/yisp_test_reload.lisp";
+    write_file(path, "(define rscale (lambda (x) (* x 2)))\n"
+                     "(set rbase 5)\n"
+                     "(set rvalue (rscale rbase))\n"
+                     "(define rother (lambda (x) x))\n");
+    assert_int_equal(4, create_int(reload_file(path)), "first reload evaluates everything");
+    assert_int_equal(10, parse_eval("rvalue"), "forms evaluated in order");
+    assert_int_equal(0, create_int(reload_file(path)), "unchanged file evaluates nothing");
+
+    write_file(path, "(define rscale (lambda (x)\n    (* x 2)))\n"
+                     "(define rother (lambda (x) x))\n"
+                     "(set rbase 5)\n"
+                     "(set rvalue (rscale rbase))\n");
+    assert_int_equal(0, create_int(reload_file(path)), "reindenting and moving forms changes nothing");
+
+    write_file(path, "(define rscale (lambda (x) (* x 3)))\n"
+                     "(define rother (lambda (x) x))\n"
+                     "(set rbase 5)\n"
+                     "(set rvalue (rscale rbase))\n");
+    assert_int_equal(2, create_int(reload_file(path)), "changed form and its dependent");
+    assert_int_equal(15, parse_eval("rvalue"), "dependent sees the new definition");
+
+    assert_sExpr_equal(NIL, parse_eval("(reload \"/tmp/yisp_no_such_file.lisp\")"), "missing file");
+    remove(path);
+}
+
+// --- SERVER ---
+// Sends src to the server at path and returns the response as a string
+sExpr *request(const char *path, const char *src, int *status) {
+    StringBuilder *out = builder_new();
+    *status = client_request(path, src, strlen(src), out);
+    sExpr *result = builder_to_string(out);
+    free_builder(out);
+    return result;
+}
+
+void test_server() {
+    printf("\n=== Server ===\n");
+
+    const char *sock = "/tmp/yisp_test.sock";
+    const char *prelude = "/tmp/yisp_test_prelude.lisp";
+    FILE *f = fopen(prelude, "w");
+    fputs("(define sq (lambda (x) (* x x)))\n", f);
+    fclose(f);
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) _exit(serve(sock, prelude, 2, 1) == 0 ? 0 : 1);
+
+    // Wait for the socket to come up
+    int status = -1;
+    sExpr *out = NIL;
+    for (int i = 0; i < 100 && status < 0; i++) {
+        out = request(sock, "(sq 12)", &status);
+        if (status < 0) usleep(10000);
+    }
+    assert_sExpr_equal(create_string("144\n"), out, "request sees the prelude");
+
+    out = request(sock, "(set leaked 1) (+ leaked 1)", &status);
+    assert_sExpr_equal(create_string("1\n2\n"), out, "one result per form");
+    out = request(sock, "leaked", &status);
+    assert_sExpr_equal(create_string("leaked\n"), out, "requests don't see each other's state");
+
+    out = request(sock, "(define busy (lambda (n) (if (= n 0) 0 (+ (busy (- n 1)) (busy (- n 1))))))"
+                        "(busy 40)", &status);
+    assert_int_equal(1, create_int(status), "runaway request times out");
+    out = request(sock, "(sq 3)", &status);
+    assert_sExpr_equal(create_string("9\n"), out, "pool refilled after timeout");
+
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    remove(prelude);
+    remove("/tmp/yisp_test_prelude.lisp.yc");
+}
+
+// --- BATCH ---
+// Evaluates and prints a form the way script mode does
+static int batch_form(sExpr *form) {
+    const char *error;
+    sExpr *result = eval_bounded(form, &error);
+    if (!result) return 0;
+    print_sExpr(result);
+    printf("\n");
+    return 1;
+}
+
+void test_batch() {
+    printf("\n=== Batch ===\n");
+
+    const char *in_path = "/tmp/yisp_test_batch.lisp";
+    write_file(in_path, "(set bx 20)\n\n(+ bx 1)\n(add-missing 1)\n(runaway 0)\n\"done\"\n");
+    FILE *in = fopen(in_path, "r");
+    FILE *out = tmpfile();
+
+    eval_limits.max_depth = 100;
+    int status = run_batch(in, out, batch_form);
+    eval_limits.max_depth = 0;
+    fclose(in);
+
+    char buf[256];
+    size_t n = (size_t)ftell(out);
+    rewind(out);
+    n = fread(buf, 1, n < sizeof(buf) - 1 ? n : sizeof(buf) - 1, out);
+    buf[n] = '\0';
+    fclose(out);
+    assert_sExpr_equal(create_string("20\n21\nUnknown function: add-missing\n()\n\"done\"\n"), create_string(buf),
+                       "output of every form, in order");
+    assert_int_equal(1, create_int(status), "status reports the stopped form");
+    remove(in_path);
+}
+
+// --- EMBEDDING ---
+static yisp_value *host_sum(yisp_value **args, int nargs, void *ctx) {
+    long total = *(long *)ctx, v;
+    for (int i = 0; i < nargs; i++) {
+        if (yisp_to_long(args[i], &v) == 0) total += v;
+    }
+    return yisp_from_long(total);
+}
+
+void test_embedding() {
+    printf("\n=== Embedding ===\n");
+
+    assert_int_equal(0, create_int(yisp_init()), "init again is harmless");
+    assert_int_equal(7, yisp_eval("(define emb-add (lambda (a b) (+ a b))) (emb-add 3 4)"),
+                     "eval returns the last value");
+
+    yisp_function *add = yisp_function_get("emb-add");
+    yisp_value *args[] = { yisp_from_long(40), yisp_from_long(2) };
+    assert_int_equal(42, yisp_call(add, args, 2), "call through a handle");
+    assert_int_equal(1, create_int(yisp_function_get("no-such-fn") == NULL), "no handle for an unbound name");
+
+    long n = 0;
+    double d = 0;
+    const char *str = NULL;
+    assert_int_equal(1, create_int(yisp_to_long(yisp_from_long(-5), &n) == 0 && n == -5), "long round trip");
+    assert_int_equal(1, create_int(yisp_to_double(yisp_from_long(3), &d) == 0 && d == 3.0), "int reads as double");
+    assert_int_equal(1, create_int(yisp_to_string(yisp_from_string("hi"), &str) == 0 && strcmp(str, "hi") == 0),
+                     "string round trip");
+    assert_int_equal(1, create_int(yisp_to_long(yisp_from_string("hi"), &n) == -1), "type mismatch is reported");
+    assert_int_equal(1, create_int(yisp_type_of(yisp_cons(yisp_true(), yisp_nil())) == YISP_LIST), "list type");
+
+    long base = 100;
+    yisp_register("host-sum", host_sum, &base);
+    assert_int_equal(106, yisp_eval("(host-sum 1 2 (emb-add 1 2))"), "native called from Lisp");
+    assert_int_equal(111, yisp_eval("(emb-add (host-sum 1) 10)"), "native as an argument");
+    yisp_function *sum = yisp_function_get("host-sum");
+    assert_int_equal(142, yisp_call(sum, args, 2), "native through a handle");
+
+    yisp_eval("(set emb-add (lambda (a b) (* a b)))");
+    assert_int_equal(80, yisp_call(add, args, 2), "handle follows a redefinition");
+
+    yisp_eval("(set emb-add 5)");
+    assert_int_equal(1, create_int(yisp_call(add, args, 2) == NULL), "no call once the name isn't a function");
+
+    yisp_function_free(add);
+    yisp_function_free(sum);
+}
+
+// --- BUDGETS ---
+sExpr *parse_bounded(const char *src, const char **error) {
+    TokenStream ts = tokenize(src);
+    sExpr *expr = parse_sexpr(&ts);
+    free_tokens(&ts);
+    return eval_bounded(expr, error);
+}
+
+void test_budgets() {
+    printf("\n=== Budgets ===\n");
+
+    const char *error;
+    parse_eval("(define runaway (lambda (depth) (runaway (+ depth 1))))");
+    parse_eval("(define busy (lambda (n) (if (= n 0) 0 (+ (busy (- n 1)) (busy (- n 1))))))");
+
+    eval_limits.max_depth = 1000;
+    assert_int_equal(1, create_int(parse_bounded("(runaway 0)", &error) == NULL), "depth limit stops recursion");
+    assert_sExpr_equal(create_string("recursion depth limit exceeded"), create_string(error ? error : ""),
+                       "depth limit error");
+    assert_sExpr_equal(create_symbol("undefined"), lookup(create_symbol("depth")),
+                       "frames popped on unwind");
+    assert_int_equal(3, parse_bounded("(+ 1 2)", &error), "next form runs normally");
+
+    eval_limits.max_steps = 500;
+    assert_int_equal(1, create_int(parse_bounded("(busy 12)", &error) == NULL), "step limit");
+    assert_int_equal(0, parse_bounded("(busy 5)", &error), "within the step limit");
+    eval_limits.max_steps = 0;
+
+    eval_limits.max_bytes = 10000;
+    assert_int_equal(1, create_int(parse_bounded("(busy 12)", &error) == NULL), "memory limit");
+    eval_limits.max_bytes = 0;
+
+    eval_limits.max_ms = 20;
+    assert_int_equal(1, create_int(parse_bounded("(busy 30)", &error) == NULL), "time limit");
+    assert_sExpr_equal(create_string("time limit exceeded"), create_string(error ? error : ""),
+                       "time limit error");
+    eval_limits.max_ms = 0;
+
+    // Unwinding out of a generator ends it and leaves the caller's frames
+    parse_eval("(set spinner (make-generator (lambda (yield) (busy 30))))");
+    eval_limits.max_steps = 500;
+    assert_int_equal(1, create_int(parse_bounded("(next spinner)", &error) == NULL), "limit inside a generator");
+    eval_limits.max_steps = 0;
+    assert_sExpr_equal(TRUE, parse_eval("(generator-done? spinner)"), "stopped generator is done");
+    assert_int_equal(3, parse_bounded("(+ 1 2)", &error), "main frames after unwinding a generator");
+    eval_limits.max_depth = 0;
+
+    // Any budget guards the C stack, and macro expansion is a check point
+    eval_limits.max_steps = 100000000;
+    assert_int_equal(1, create_int(parse_bounded("(runaway 0)", &error) == NULL), "stack guard without a depth limit");
+    assert_sExpr_equal(create_string("stack limit exceeded"), create_string(error ? error : ""),
+                       "stack limit error");
+    parse_eval("(defmacro spin (x) (quasiquote (spin (unquote x))))");
+    assert_int_equal(1, create_int(parse_bounded("(spin 1)", &error) == NULL), "recursive macro stopped");
+    eval_limits.max_steps = 1000;
+    parse_eval("(defmacro spin2 (x) (quasiquote (spin2 (unquote x))))");
+    parse_bounded("(spin2 1)", &error);
+    assert_sExpr_equal(create_string("step limit exceeded"), create_string(error ? error : ""),
+                       "macro expansions count as steps");
+    eval_limits.max_steps = 0;
+    assert_int_equal(3, parse_bounded("(+ 1 2)", &error), "next form runs after a stack overflow");
+}
+
+// --- TRACING ---
+static int count_in_file(const char *path, const char *needle) {
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+    int count = 0;
+    char line[512];
+    while (fgets(line, sizeof(line), f)) {
+        if (strstr(line, needle)) count++;
+    }
+    fclose(f);
+    return count;
+}
+
+void test_tracing() {
+    printf("\n=== Tracing ===\n");
+
+    const char *path = "/tmp/yisp_test_trace.json";
+    const char *error;
+    parse_eval("(define tsq (lambda (x) (* x x)))");
+    trace_start(NULL);
+    parse_eval("(tsq 3)");
+    assert_sExpr_equal(TRUE, parse_eval("(trace-dump \"/tmp/yisp_test_trace.json\")"), "trace-dump");
+    assert_int_equal(1, create_int(file_contains(path, "\"name\":\"tsq\",\"args\":{\"depth\":0}")),
+                     "lambda call recorded");
+    assert_int_equal(1, create_int(file_contains(path, "\"name\":\"*\",\"args\":{\"depth\":1}")),
+                     "builtin recorded with its depth");
+
+    // Calls cut short by a budget still get their end events
+    eval_limits.max_depth = 50;
+    parse_eval("(define tdeep (lambda (n) (tdeep (+ n 1))))");
+    parse_bounded("(tdeep 0)", &error);
+    eval_limits.max_depth = 0;
+    trace_dump(path);
+    trace_enabled = 0;
+    assert_int_equal(count_in_file(path, "\"ph\":\"B\""), create_int(count_in_file(path, "\"ph\":\"E\"")),
+                     "events balanced after unwinding");
+    remove(path);
+}
+
+// --- LARGE INPUTS ---
+// Writes n copies of unit, wrapped in prefix and suffix
+char *repeat(const char *prefix, const char *unit, long n, const char *suffix) {
+    size_t plen = strlen(prefix), ulen = strlen(unit), slen = strlen(suffix);
+    char *buf = malloc(plen + ulen * n + slen + 1);
+    char *p = buf;
+    memcpy(p, prefix, plen);
+    p += plen;
+    for (long i = 0; i < n; i++, p += ulen) memcpy(p, unit, ulen);
+    memcpy(p, suffix, slen + 1);
+    return buf;
+}
+
+sExpr *parse_text(const char *src) {
+    TokenStream ts = tokenize(src);
+    sExpr *e = parse_sexpr(&ts);
+    free_tokens(&ts);
+    return e;
+}
+
+// Prints e to a temporary file and returns the number of bytes written
+long printed_length(sExpr *e) {
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    FILE *tmp = tmpfile();
+    dup2(fileno(tmp), STDOUT_FILENO);
+    print_sExpr(e);
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    long len = lseek(fileno(tmp), 0, SEEK_END);
+    fclose(tmp);
+    return len;
+}
+
+void test_large_inputs() {
+    printf("\n=== Large Inputs ===\n");
+
+    long n = 2000000;
+    char *src = repeat("(", "7 ", n, ")");
+    sExpr *a = parse_text(src);
+    sExpr *b = parse_text(src);
+    long count = 0;
+    for (sExpr *it = a; !isnil(it); it = cdr(it)) count++;
+    assert_int_equal(n, create_int(count), "parse a 2M element list");
+    assert_int_equal(1, create_int(sExpr_equal(a, b)), "compare 2M element lists");
+    assert_int_equal(2 * n + 1, create_int(printed_length(a)), "print a 2M element list");
+    free_sExpr(a);
+    free_sExpr(b);
+    free(src);
+
+    long depth = 100000;
+    char *open = repeat("", "(", depth, "x");
+    char *nested = repeat(open, ")", depth, "");
+    a = parse_text(nested);
+    b = parse_text(nested);
+    sExpr *inner = a;
+    for (long i = 1; i < depth; i++) inner = car(inner);
+    assert_sExpr_equal(create_symbol("x"), car(inner), "parse nesting 100k deep");
+    assert_int_equal(1, create_int(sExpr_equal(a, b)), "compare nesting 100k deep");
+    assert_int_equal(2 * depth + 1, create_int(printed_length(a)), "print nesting 100k deep");
+    free_sExpr(a);
+    free_sExpr(b);
+    free(open);
+    free(nested);
+
+    char *quotes = repeat("", "'", depth, "y");
+    a = parse_text(quotes);
+    assert_int_equal(depth + 1, create_int(printed_length(a)), "nested quote prefixes");
+    free_sExpr(a);
+    free(quotes);
+}
+
+// --- HASH-CONSING ---
+void test_hash_cons() {
+    printf("\n=== Hash-consing ===\n");
+
+    sExpr *a = parse_eval("(hash-cons '(1 (2 \"s\") 2.5))");
+    sExpr *b = parse_eval("(hash-cons '(1 (2 \"s\") 2.5))");
+    assert_int_equal(1, create_int(a == b), "equal trees share one copy");
+    assert_int_equal(1, create_int(is_hash_consed(car(cdr(a)))), "sublists are canonical");
+    assert_sExpr_equal(TRUE, equal(a, b), "equal on canonical data");
+    assert_sExpr_equal(NIL, parse_eval("(equal (hash-cons '(1 2)) (hash-cons '(1 3)))"),
+                       "different canonical trees");
+    assert_sExpr_equal(TRUE, parse_eval("(equal '(a (b \"c\")) '(a (b \"c\")))"),
+                       "equal on ordinary lists");
+    assert_sExpr_equal(NIL, parse_eval("(equal 1 1.0)"), "equal compares types");
+
+    sExpr *h = create_hash(0);
+    sExpr *mixed = hash_cons(cons(h, cons(create_int(1), NIL)));
+    assert_int_equal(0, create_int(is_hash_consed(mixed)), "tables aren't shared");
+    assert_int_equal(1, create_int(is_hash_consed(cdr(mixed))), "their siblings still are");
+
+    hash_cons_reader = 1;
+    sExpr *data = parse_text("((x y) (x y) (x y))");
+    hash_cons_reader = 0;
+    assert_int_equal(1, create_int(car(data) == car(cdr(data))), "reader shares repeated sublists");
+    free_sExpr(data);
+    assert_sExpr_equal(parse_eval("'(x y)"), car(cdr(cdr(data))), "free leaves shared data alone");
+
+    // A macro call in shared code is expanded without rewriting the call
+    parse_eval("(defmacro twice (x) `(+ ,x ,x))");
+    hash_cons_reader = 1;
+    sExpr *call = parse_text("(twice 4)");
+    hash_cons_reader = 0;
+    assert_int_equal(8, eval(call), "macro call in shared code");
+    assert_sExpr_equal(create_symbol("twice"), car(call), "shared call site not overwritten");
+}
+
 int main() {
     // Initialize singletons
     NIL = malloc(sizeof(sExpr));
@@ -416,6 +1478,28 @@ int main() {
     test_if();
     test_cond();
     test_or_and();
+    test_hash();
+    test_persistent();
+    test_strings();
+    test_calls();
+    test_loops();
+    test_optimizer();
+    test_inlining();
+    test_macros();
+    test_streams();
+    test_generators();
+    test_quickening();
+    test_compile_c();
+    test_image();
+    test_load_cache();
+    test_reload();
+    test_server();
+    test_large_inputs();
+    test_hash_cons();
+    test_budgets();
+    test_batch();
+    test_embedding();
+    test_tracing();
 
 
     printf("\n=== Summary ===\n");
@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include "sexpr.h"
+
+// Call tracing
+//
+// With --trace, eval records an event when each call form starts and when
+// it returns: lambda applications, builtins and special forms alike, with a
+// timestamp, the operator's name and the call depth. Events go into a ring
+// buffer that keeps the most recent TRACE_CAPACITY of them. The interpreter
+// is single-threaded (the server runs one per worker process), so the ring
+// has exactly one writer and needs no locking.
+//
+// The buffer is written out as Chrome trace JSON, which chrome://tracing and
+// Perfetto open, by (trace-dump "path") or when the process exits. A server
+// worker writes to the trace path with its pid appended.
+//
+// Names point at the symbols in the code being run, which is never freed.
+
+#define TRACE_CAPACITY (1 << 18)
+
+typedef struct {
+    uint64_t ns;
+    const char *name;
+    int depth;
+    char phase;         // 'B' on entry, 'E' on return
+} TraceEvent;
+
+int trace_enabled = 0;
+
+static TraceEvent *ring;
+static uint64_t head;           // events written so far
+static int depth;
+static sExpr *claimed;          // call form trace_call is evaluating
+static const char *trace_path;
+static pid_t owner_pid;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void record(char phase, const char *name) {
+    TraceEvent *ev = &ring[head & (TRACE_CAPACITY - 1)];
+    ev->ns = now_ns();
+    ev->name = name;
+    ev->depth = depth;
+    ev->phase = phase;
+    head++;
+}
+
+// Turns tracing on; path, if not NULL, is where trace_at_exit writes
+void trace_start(const char *path) {
+    if (!ring) ring = malloc(sizeof(TraceEvent) * TRACE_CAPACITY);
+    trace_path = path;
+    owner_pid = getpid();
+    trace_enabled = 1;
+}
+
+static const char *call_name(sExpr *fn) {
+    if (type_of(fn) == TYPE_QUICK) fn = quick_symbol(fn);
+    if (issymbol(fn)) return fn->value.symbol;
+    return "lambda";
+}
+
+// Nonzero if expr is the call trace_call just recorded, which eval should
+// now run normally
+int trace_claim(sExpr *expr) {
+    if (expr != claimed) return 0;
+    claimed = NULL;
+    return 1;
+}
+
+sExpr *trace_call(sExpr *expr) {
+    const char *name = call_name(car(expr));
+    record('B', name);
+    depth++;
+    claimed = expr;
+    sExpr *result = eval(expr);
+    depth--;
+    record('E', name);
+    return result;
+}
+
+int trace_mark(void) {
+    return depth;
+}
+
+// Closes the calls a budget unwound past
+void trace_unwind(int mark) {
+    while (trace_enabled && depth > mark) {
+        depth--;
+        record('E', NULL);
+    }
+}
+
+static void write_name(FILE *f, const char *s) {
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') fprintf(f, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20) fprintf(f, "\\u%04x", *s);
+        else fputc(*s, f);
+    }
+}
+
+// Writes the events in the ring, oldest first. Returns -1 if path can't be
+// written.
+int trace_dump(const char *path) {
+    FILE *f = fopen(path, "w");
+    if (!f) return -1;
+
+    uint64_t first = head > TRACE_CAPACITY ? head - TRACE_CAPACITY : 0;
+    uint64_t base = first < head ? ring[first & (TRACE_CAPACITY - 1)].ns : 0;
+    int pid = (int)getpid();
+
+    fprintf(f, "{\"traceEvents\":[\n");
+    for (uint64_t i = first; i < head; i++) {
+        TraceEvent *ev = &ring[i & (TRACE_CAPACITY - 1)];
+        uint64_t us = (ev->ns - base) / 1000;
+        unsigned frac = (unsigned)((ev->ns - base) % 1000);
+        fprintf(f, "{\"ph\":\"%c\",\"ts\":%llu.%03u,\"pid\":%d,\"tid\":1", ev->phase,
+                (unsigned long long)us, frac, pid);
+        if (ev->phase == 'B') {
+            fprintf(f, ",\"name\":\"");
+            write_name(f, ev->name);
+            fprintf(f, "\",\"args\":{\"depth\":%d}", ev->depth);
+        }
+        fprintf(f, "}%s\n", i + 1 < head ? "," : "");
+    }
+    fprintf(f, "]}\n");
+    return fclose(f) == 0 ? 0 : -1;
+}
+
+void trace_at_exit(void) {
+    if (!trace_enabled || !trace_path) return;
+    if (getpid() == owner_pid) {
+        trace_dump(trace_path);
+        return;
+    }
+    char path[4096];
+    snprintf(path, sizeof(path), "%s.%d", trace_path, (int)getpid());
+    trace_dump(path);
+}